@@ -0,0 +1,736 @@
+/**
+ * @file bench.c
+ * @brief Load generator and benchmark for SMS system
+ *
+ * Benchmark registers many users, starts the server and simulates logged clients - every client has its own inbox (named pipe or socket connection).
+ * Clients send a mix of login, online list, message and logout requests at target rate. Every message carries the time when it was sent,
+ * so the delay of delivery is measured when the recipient receives it. At the end throughput and percentiles of delay are printed
+ * and optionally compared with baseline results.
+ * @see https://github.com/kabell/SMSsystem
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+#define BUFFER_SIZE 1000        /**< Maximum size of one request or message */
+#define READ_SIZE 65536         /**< Size of buffer for reading inboxes */
+#define MAX_EVENTS 256          /**< Maximum number of events returned by one call of epoll_wait() */
+#define OPERATIONS 4            /**< Number of kinds of requests */
+#define LOGIN_TIMEOUT 30        /**< Seconds to wait for login of all clients */
+#define DRAIN_TIMEOUT 3         /**< Seconds to wait for messages which are still on the way after the end of run */
+
+/**
+ * Kinds of requests sent by clients
+ */
+enum { OPERATION_LOGIN, OPERATION_ONLINE, OPERATION_SEND, OPERATION_LOGOUT };
+
+/**
+ * State of simulated client
+ */
+enum { CLIENT_OFFLINE, CLIENT_LOGGING, CLIENT_ONLINE, CLIENT_LEAVING };
+
+/**
+ * Simulated client
+ */
+typedef struct {
+    char name[32];          /**< Username, password is the same with prefix "p" */
+    int fd;                 /**< Inbox - named pipe or socket connection */
+    int state;              /**< CLIENT_OFFLINE, CLIENT_LOGGING, CLIENT_ONLINE or CLIENT_LEAVING */
+    int position;           /**< Position in online array if client is online */
+    char * partial;         /**< Unfinished line received from server */
+    size_t partialLength;   /**< Length of partial */
+} bench_client_t;
+
+char * operationName[OPERATIONS] = {"login", "online", "send", "logout"};   /**< Names of requests in mix and in results */
+
+int clientCount = 1000;                 /**< Number of simulated clients, option -u */
+
+double duration = 10;                   /**< Length of measured run in seconds, option -d */
+
+double rate = 20000;                    /**< Target number of requests per second, 0 means as fast as possible, option -r */
+
+int window = 10000;                     /**< Maximum number of messages on the way when rate is 0, option -i */
+
+int mix[OPERATIONS] = {1, 1, 97, 1};    /**< Weights of requests, option -m */
+
+int useSocket = 0;                      /**< Clients are connected by socket instead of named pipes, option -s */
+
+char * workers = NULL;                  /**< Number of delivery threads of server, option -w */
+
+double tolerance = 20;                  /**< Allowed difference from baseline in percent, option -t */
+
+char * runDir = "bench.run";            /**< Working directory of server during benchmark, option -D */
+
+char serverPath[PATH_MAX] = "./server"; /**< Server executable, option -S */
+
+bench_client_t * clients = NULL;        /**< Simulated clients */
+
+int * online = NULL;                    /**< Indexes of online clients */
+
+int onlineCount = 0;                    /**< Number of online clients */
+
+int * offline = NULL;                   /**< Indexes of offline clients */
+
+int offlineCount = 0;                   /**< Number of offline clients */
+
+int serverIn = -1;                      /**< Named pipe of server input */
+
+int epollFd = -1;                       /**< Epoll for inboxes of all clients */
+
+pid_t serverPid = 0;                    /**< Process of server */
+
+char requestBuffer[PIPE_BUF];           /**< Requests for server input collected to one write */
+
+size_t requestLength = 0;               /**< Number of bytes in requestBuffer */
+
+long requests[OPERATIONS];              /**< Number of sent requests of every kind */
+
+long loginFailed = 0;                   /**< Number of refused logins */
+
+long messagesSent = 0;                  /**< Number of sent messages */
+
+long messagesDelivered = 0;             /**< Number of received messages */
+
+uint64_t * latency = NULL;              /**< Delays of received messages in nanoseconds */
+
+size_t latencyCapacity = 0;             /**< Allocated size of latency */
+
+/**
+ * @brief Get current time
+ * @return Monotonic time in nanoseconds
+ */
+uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Write whole buffer
+ * @param fd - Descriptor
+ * @param data - Data
+ * @param length - Length of data
+ * @return 0 on success, -1 on error
+ */
+int write_all(int fd, const char * data, size_t length){
+    while(length){
+        ssize_t n = write(fd, data, length);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send collected requests to server input
+ *
+ * Requests are collected to at most PIPE_BUF bytes, so one write is not mixed with requests of real clients.
+ */
+void request_flush(){
+    if(requestLength && write_all(serverIn, requestBuffer, requestLength))
+        perror("request_flush");
+    requestLength = 0;
+}
+
+/**
+ * @brief Send request of client
+ * @param client - Client
+ * @param format - Request without newline, printf format
+ *
+ * Client connected by socket sends request by its connection, others by server input.
+ */
+void request_send(bench_client_t * client, const char * format, ...){
+    char request[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(request, BUFFER_SIZE - 1, format, args);
+    va_end(args);
+    request[length++] = '\n';
+
+    if(useSocket){
+        if(send(client->fd, request, length, MSG_NOSIGNAL) != length)
+            perror("request_send");
+        return;
+    }
+    if(requestLength + length > sizeof(requestBuffer))
+        request_flush();
+    memcpy(requestBuffer + requestLength, request, length);
+    requestLength += length;
+}
+
+/**
+ * @brief Add client to online clients
+ * @param i - Index of client
+ */
+void client_online(int i){
+    clients[i].state = CLIENT_ONLINE;
+    clients[i].position = onlineCount;
+    online[onlineCount++] = i;
+}
+
+/**
+ * @brief Move client from online clients to offline clients
+ * @param i - Index of client
+ * @param state - New state of client
+ *
+ * Client which is logging out is not online anymore - nobody sends messages to it.
+ */
+void client_leave(int i, int state){
+    if(clients[i].state == CLIENT_ONLINE){
+        int last = online[--onlineCount];
+        online[clients[i].position] = last;
+        clients[last].position = clients[i].position;
+    }
+    if(state == CLIENT_OFFLINE)
+        offline[offlineCount++] = i;
+    clients[i].state = state;
+}
+
+/**
+ * @brief Process one line received by client
+ * @param i - Index of client
+ * @param line - Line without newline
+ * @param length - Length of line
+ */
+void client_line(int i, char * line, size_t length){
+    char * arrow = memmem(line, length, " -> t", 5);
+    if(arrow){
+        uint64_t sent = strtoull(arrow + 5, NULL, 10);
+        if(messagesDelivered == (long)latencyCapacity){
+            latencyCapacity = latencyCapacity ? 2 * latencyCapacity : 65536;
+            latency = realloc(latency, latencyCapacity * sizeof(uint64_t));
+        }
+        latency[messagesDelivered++] = now_ns() - sent;
+    }
+    else if(length == 8 && !memcmp(line, "Login OK", 8))
+        client_online(i);
+    else if(length == 11 && !memcmp(line, "Logged out.", 11))
+        client_leave(i, CLIENT_OFFLINE);
+    else if(clients[i].state == CLIENT_LOGGING && (!strncmp(line, "Login incorrect", length) || !strncmp(line, "User already logged in", length))){
+        loginFailed++;
+        client_leave(i, CLIENT_OFFLINE);
+    }
+}
+
+/**
+ * @brief Read all available data from inbox of client
+ * @param i - Index of client
+ * @return 0 on success, -1 if server closed inbox
+ */
+int client_read(int i){
+    static char buffer[READ_SIZE];
+    bench_client_t * client = &clients[i];
+    while(1){
+        //unfinished line is moved to the beginning of buffer
+        size_t length = client->partialLength;
+        memcpy(buffer, client->partial, length);
+        ssize_t n = read(client->fd, buffer + length, sizeof(buffer) - length);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+            return 0;
+        if(n <= 0)
+            return -1;
+        length += n;
+
+        char * line = buffer;
+        char * end = buffer + length;
+        char * newline;
+        while((newline = memchr(line, '\n', end - line))){
+            client_line(i, line, newline - line);
+            line = newline + 1;
+        }
+        client->partialLength = end - line;
+        if(client->partialLength){
+            client->partial = realloc(client->partial, client->partialLength);
+            memcpy(client->partial, line, client->partialLength);
+        }
+    }
+}
+
+/**
+ * @brief Wait for messages and process them
+ * @param timeout - Maximum time of waiting in milliseconds
+ */
+void clients_poll(int timeout){
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+    for(int i=0; i<n; i++)
+        if(client_read(events[i].data.u32)){
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, clients[events[i].data.u32].fd, NULL);
+            client_leave(events[i].data.u32, CLIENT_LEAVING);
+        }
+}
+
+/**
+ * @brief Send login request of offline client
+ * @param i - Position in offline array
+ */
+void client_login(int i){
+    int c = offline[i];
+    offline[i] = offline[--offlineCount];
+    clients[c].state = CLIENT_LOGGING;
+    request_send(&clients[c], "1|%s|p%s", clients[c].name, clients[c].name);
+    requests[OPERATION_LOGIN]++;
+}
+
+/**
+ * @brief Send one request chosen by mix
+ *
+ * Messages are sent between random online clients - message text is time of sending, recipient measures delay of delivery.
+ */
+void operation_run(){
+    int total = 0;
+    for(int i=0; i<OPERATIONS; i++)
+        total += mix[i];
+    int pick = rand() % total;
+    int operation = 0;
+    while(pick >= mix[operation])
+        pick -= mix[operation++];
+
+    if(operation == OPERATION_LOGIN && offlineCount)
+        client_login(rand() % offlineCount);
+    if(!onlineCount || operation == OPERATION_LOGIN)
+        return;
+
+    bench_client_t * client = &clients[online[rand() % onlineCount]];
+    if(operation == OPERATION_ONLINE)
+        request_send(client, "2|%s", useSocket ? "-" : client->name);
+    else if(operation == OPERATION_SEND){
+        bench_client_t * to = &clients[online[rand() % onlineCount]];
+        request_send(client, "3|%s|%s|t%llu", client->name, to->name, (unsigned long long)now_ns());
+        messagesSent++;
+    }
+    else{
+        request_send(client, "4|%s", client->name);
+        client_leave(client - clients, CLIENT_LEAVING);
+    }
+    requests[operation]++;
+}
+
+/**
+ * @brief Remove file or directory - callback for nftw()
+ */
+int remove_entry(const char * path, const struct stat * st, int flag, struct FTW * ftw){
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/**
+ * @brief Run server with given arguments and wait until it ends
+ * @param argv - Arguments
+ * @param input - Data for standard input of server or NULL
+ * @param length - Length of input
+ * @return Exit status of server
+ */
+int server_exec(char ** argv, const char * input, size_t length){
+    int fds[2];
+    if(pipe(fds))
+        return -1;
+    pid_t pid = fork();
+    if(pid == 0){
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(serverPath, argv);
+        perror(serverPath);
+        _exit(127);
+    }
+    close(fds[0]);
+    if(input && write_all(fds[1], input, length))
+        perror("server_exec");
+    close(fds[1]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * @brief Prepare clean working directory and register all users
+ *
+ * Users are registered by one "./server adduser --batch" - usernames are bench0, bench1,... and password of user is its name with prefix "p".
+ */
+void users_prepare(){
+    nftw(runDir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    if(mkdir(runDir, 0755) || chdir(runDir)){
+        perror(runDir);
+        exit(1);
+    }
+
+    char * input = malloc((size_t)clientCount * 48);
+    size_t length = 0;
+    clients = calloc(clientCount, sizeof(bench_client_t));
+    for(int i=0; i<clientCount; i++){
+        snprintf(clients[i].name, sizeof(clients[i].name), "bench%d", i);
+        length += sprintf(input + length, "%s p%s\n", clients[i].name, clients[i].name);
+    }
+    char * argv[] = {"server", "adduser", "--batch", "-", NULL};
+    if(server_exec(argv, input, length)){
+        fprintf(stderr, "Registration of users failed\n");
+        exit(1);
+    }
+    free(input);
+}
+
+/**
+ * @brief Start server in its own session
+ *
+ * Server has no console - its output goes to file server.log and its input is empty. It runs in its own session, so signals for the process group of benchmark do not reach it.
+ */
+void server_start(){
+    serverPid = fork();
+    if(serverPid == 0){
+        setsid();
+        int null = open("/dev/null", O_RDONLY);
+        int log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(null, STDIN_FILENO);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        char * argv[] = {"server", workers ? "-w" : NULL, workers, NULL};
+        execv(serverPath, argv);
+        perror(serverPath);
+        _exit(127);
+    }
+
+    //wait until server is ready
+    const char * ready = useSocket ? "server.sock" : "serverin";
+    for(int i=0; i<500 && access(ready, F_OK); i++)
+        usleep(10000);
+    if(access(ready, F_OK)){
+        fprintf(stderr, "Server did not start\n");
+        exit(1);
+    }
+    if(!useSocket)
+        serverIn = open("serverin", O_WRONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief Stop server and wait for it
+ */
+void server_stop(){
+    request_flush();
+    if(serverIn >= 0)
+        close(serverIn);
+    kill(serverPid, SIGTERM);
+    waitpid(serverPid, NULL, 0);
+}
+
+/**
+ * @brief Open inboxes of all clients
+ *
+ * Client by named pipe creates pipe named by username and keeps it open for reading and writing. Client by socket connects to server.
+ */
+void clients_open(){
+    struct rlimit limit;
+    if(!getrlimit(RLIMIT_NOFILE, &limit)){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    online = malloc(clientCount * sizeof(int));
+    offline = malloc(clientCount * sizeof(int));
+    for(int i=0; i<clientCount; i++){
+        bench_client_t * client = &clients[i];
+        if(useSocket){
+            struct sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            strcpy(address.sun_path, "server.sock");
+            client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(client->fd >= 0 && connect(client->fd, (struct sockaddr *)&address, sizeof(address))){
+                close(client->fd);
+                client->fd = -1;
+            }
+        }
+        else{
+            mkfifo(client->name, 0666);
+            client->fd = open(client->name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        }
+        if(client->fd < 0){
+            perror(client->name);
+            fprintf(stderr, "Only %d clients can be opened\n", i);
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, client->fd, &ev);
+        offline[offlineCount++] = i;
+    }
+}
+
+/**
+ * @brief Log in all clients
+ */
+void clients_login(){
+    while(offlineCount)
+        client_login(offlineCount - 1);
+    request_flush();
+    uint64_t deadline = now_ns() + LOGIN_TIMEOUT * 1000000000ULL;
+    while(onlineCount + offlineCount < clientCount && now_ns() < deadline)
+        clients_poll(100);
+    if(onlineCount < clientCount)
+        fprintf(stderr, "Only %d of %d clients logged in\n", onlineCount, clientCount);
+}
+
+/**
+ * @brief Send requests at target rate for the whole run
+ * @return Real length of run in seconds
+ *
+ * Number of requests is driven by elapsed time (open loop) - slow server does not slow down the generator, it increases the delay.
+ * With rate 0 requests are sent as fast as possible, but at most window messages can be on the way.
+ */
+double clients_run(){
+    memset(requests, 0, sizeof(requests));
+    messagesSent = messagesDelivered = 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    long issued = 0;
+    uint64_t now;
+    while((now = now_ns()) < end){
+        long due = rate > 0 ? (long)((now - start) * rate / 1e9) - issued : 256;
+        for(long i=0; i<due && (rate > 0 || messagesSent - messagesDelivered < window); i++, issued++)
+            operation_run();
+        request_flush();
+        clients_poll(due > 0 ? 0 : 1);
+    }
+    return (now - start) / 1e9;
+}
+
+/**
+ * @brief Wait for messages which are still on the way
+ */
+void clients_drain(){
+    uint64_t deadline = now_ns() + DRAIN_TIMEOUT * 1000000000ULL;
+    while(messagesDelivered < messagesSent && now_ns() < deadline)
+        clients_poll(10);
+}
+
+/**
+ * @brief Close inboxes of all clients
+ */
+void clients_close(){
+    for(int i=0; i<clientCount; i++){
+        if(clients[i].fd >= 0)
+            close(clients[i].fd);
+        if(!useSocket)
+            unlink(clients[i].name);
+        free(clients[i].partial);
+    }
+    close(epollFd);
+}
+
+/**
+ * @brief Compare delays - callback for qsort()
+ */
+int latency_compare(const void * a, const void * b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Get percentile of delays
+ * @param p - Percentile (0-100)
+ * @return Delay in microseconds, latency must be sorted
+ */
+double latency_percentile(double p){
+    if(!messagesDelivered)
+        return 0;
+    size_t i = (size_t)(p / 100 * messagesDelivered);
+    if(i >= (size_t)messagesDelivered)
+        i = messagesDelivered - 1;
+    return latency[i] / 1000.0;
+}
+
+/**
+ * @brief Find value in results
+ * @param results - Results - lines "key value", lines starting by # are comments
+ * @param key - Key
+ * @param value - Output
+ * @return 1 if key was found
+ */
+int result_get(const char * results, const char * key, double * value){
+    size_t length = strlen(key);
+    for(const char * line = results; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+        if(!strncmp(line, key, length) && line[length] == ' ')
+            return sscanf(line + length, "%lf", value) == 1;
+    return 0;
+}
+
+/**
+ * @brief Compare results with baseline
+ * @param results - Results of this run
+ * @param baseline - Baseline results
+ * @return Number of metrics which are worse than baseline by more than tolerance
+ *
+ * Throughput must not drop and delays must not grow by more than tolerance percent.
+ */
+int results_compare(const char * results, const char * baseline){
+    const char * metrics[] = {"msgs_per_sec", "p50_us", "p99_us", "p999_us"};
+    int regressions = 0;
+    printf("\nComparison with baseline (tolerance %.0f%%):\n", tolerance);
+    for(int i=0; i<4; i++){
+        double now, base;
+        if(!result_get(results, metrics[i], &now) || !result_get(baseline, metrics[i], &base) || base <= 0)
+            continue;
+        double change = (now - base) / base * 100;
+        int worse = i == 0 ? change < -tolerance : change > tolerance;
+        printf("  %-14s %12.1f  baseline %12.1f  %+7.1f%%%s\n", metrics[i], now, base, change, worse ? "  REGRESSION" : "");
+        regressions += worse;
+    }
+    return regressions;
+}
+
+/**
+ * @brief Read whole file
+ * @param path - Name of file
+ * @return Content terminated by zero or NULL
+ */
+char * file_read(const char * path){
+    FILE * f = fopen(path, "r");
+    if(!f)
+        return NULL;
+    char * data = calloc(1, 65536);
+    size_t n = fread(data, 1, 65535, f);
+    data[n] = '\0';
+    fclose(f);
+    return data;
+}
+
+/**
+ * @brief Main
+ *
+ * Options:
+ * - -u clients - number of simulated clients
+ * - -d seconds - length of measured run
+ * - -r rate - requests per second, 0 means as fast as possible
+ * - -i window - messages on the way when rate is 0
+ * - -m login,online,send,logout - weights of requests
+ * - -s - clients are connected by socket
+ * - -w threads - delivery threads of server
+ * - -S path - server executable
+ * - -D directory - working directory of server, it is deleted at start
+ * - -o file - write results to file (used for baseline)
+ * - -c file - compare results with baseline, exit status is 1 if there is a regression
+ * - -t percent - tolerance of comparison
+ */
+int main(int argc, char ** argv){
+    char * output = NULL;
+    char * baseline = NULL;
+    int option;
+    while((option = getopt(argc, argv, "u:d:r:i:m:sw:S:D:o:c:t:")) != -1){
+        if(option == 'u')
+            clientCount = atoi(optarg);
+        else if(option == 'd')
+            duration = atof(optarg);
+        else if(option == 'r')
+            rate = atof(optarg);
+        else if(option == 'i')
+            window = atoi(optarg);
+        else if(option == 'm' && sscanf(optarg, "%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3]) == 4)
+            continue;
+        else if(option == 's')
+            useSocket = 1;
+        else if(option == 'w')
+            workers = optarg;
+        else if(option == 'S')
+            snprintf(serverPath, PATH_MAX, "%s", optarg);
+        else if(option == 'D')
+            runDir = optarg;
+        else if(option == 'o')
+            output = optarg;
+        else if(option == 'c')
+            baseline = optarg;
+        else if(option == 't')
+            tolerance = atof(optarg);
+        else{
+            printf("Usage: ./bench [-u clients] [-d seconds] [-r rate] [-i window] [-m login,online,send,logout] [-s] [-w threads]\n"
+                   "               [-S server] [-D directory] [-o results] [-c baseline] [-t tolerance]\n");
+            return 1;
+        }
+    }
+    if(clientCount < 1 || mix[0] + mix[1] + mix[2] + mix[3] <= 0){
+        fprintf(stderr, "Invalid options\n");
+        return 1;
+    }
+
+    //files given by user are relative to the current directory, server runs in its own directory
+    char * baselineData = baseline ? file_read(baseline) : NULL;
+    if(baseline && !baselineData)
+        perror(baseline);
+    FILE * outputFile = output ? fopen(output, "w") : NULL;
+    if(output && !outputFile)
+        perror(output);
+    char path[PATH_MAX];
+    if(realpath(serverPath, path))
+        snprintf(serverPath, PATH_MAX, "%s", path);
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+
+    users_prepare();
+    server_start();
+    clients_open();
+    uint64_t loginStart = now_ns();
+    clients_login();
+    double loginTime = (now_ns() - loginStart) / 1e9;
+
+    double elapsed = clients_run();
+    long sent = messagesSent;
+    clients_drain();
+    server_stop();
+    clients_close();
+
+    //results
+    qsort(latency, messagesDelivered, sizeof(uint64_t), latency_compare);
+    char results[4096];
+    size_t length = 0;
+    length += snprintf(results + length, sizeof(results) - length,
+                       "# clients %d, duration %.0f s, rate %.0f/s, mix %d,%d,%d,%d, transport %s, delivery threads %s\n",
+                       clientCount, duration, rate, mix[0], mix[1], mix[2], mix[3], useSocket ? "socket" : "fifo", workers ? workers : "default");
+    length += snprintf(results + length, sizeof(results) - length, "login_all_sec %.3f\n", loginTime);
+    for(int i=0; i<OPERATIONS; i++)
+        length += snprintf(results + length, sizeof(results) - length, "requests_%s %ld\n", operationName[i], requests[i]);
+    length += snprintf(results + length, sizeof(results) - length,
+                       "requests_per_sec %.1f\nmessages_sent %ld\nmessages_delivered %ld\nmsgs_per_sec %.1f\n"
+                       "p50_us %.1f\np99_us %.1f\np999_us %.1f\nmax_us %.1f\nlogin_failed %ld\n",
+                       (requests[0] + requests[1] + requests[2] + requests[3]) / elapsed, sent, messagesDelivered, messagesDelivered / elapsed,
+                       latency_percentile(50), latency_percentile(99), latency_percentile(99.9), latency_percentile(100), loginFailed);
+    printf("%s", results);
+    if(outputFile){
+        fputs(results, outputFile);
+        fclose(outputFile);
+    }
+
+    int regressions = baselineData ? results_compare(results, baselineData) : 0;
+    free(baselineData);
+    free(latency);
+    return regressions > 0;
+}
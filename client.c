@@ -1,380 +1,1131 @@
-/**
- * @file client.c
- * @author Michal Korbela, Dvid Horov
- * @date 13 May 2016
- * @brief Implementation of client for SMS system
- * @see https://github.com/kabell/SMSsystem
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <signal.h>
-#include <termios.h>
-
-
-#define BUFFER_SIZE 1000            /**< Size of buffer for everything */
-
-
-char * serverPipe = "serverin";     /**< Name of the named pipe used by server as input */
-
-char * serverLock = "server.lock";  /**< Name of the file indicates if server is running */
-
-char username[BUFFER_SIZE];         /**< Username of client */
-char password[BUFFER_SIZE];         /**< Password of client */
-
-FILE * server;                      /**< Named pipe for communicating with server */
-
-int mypid = 0;                      /**< Pid of parent process */
-
-/**
- * @brief Recieve requests from server
- *
- * Function is waiting for new messages in infinity loop, if the message is command to exit the program,
- * function closes input file and unlinks the pipe and then sends SIGTERM signal to parents process.
- *
- */
-
-void receive_messages(){
-    
-    //buffer for input
-    char buffer[BUFFER_SIZE];
-    
-    //create named pipe for receiving messages
-    mkfifo(username,0666);
-    FILE * in = fopen(username,"r");
-
-    //and checking for new messages
-    while(1){
-
-        //if there is a new message
-        if(fgets(buffer,BUFFER_SIZE,in)!=NULL){
-
-            //if message is a command to exit program
-            if(!strcmp(buffer,"Logged out.")){
-
-                printf("Exiting...\n");
-                //close all streams and named pipes and ask parent process to exit
-                fclose(in);
-                unlink(username);
-                kill(mypid, SIGTERM);
-                exit(0);
-            }
-
-            //print message
-            printf("%s",buffer);
-            fflush(stdout);
-        }
-        //this is optional, but prevent for heavy use of CPU
-        usleep(10000);
-    }
-}
-
-/**
- * @brief Read password from stanard input with prompt 
- * @param message - Prompt
- *
- * Function stores password to global variable password
- */
-
-void getpassword(char * message)
-{
-    printf("%s\n",message);
-    static struct termios oldt, newt;
-    int i = 0;
-    int c;
-
-    //saving the old settings of STDIN_FILENO and copy settings for reseting
-    tcgetattr( STDIN_FILENO, &oldt);
-    newt = oldt;
-
-    //setting the approriate bit in the termios struct
-    newt.c_lflag &= ~(ECHO);          
-
-    //setting new bits
-    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
-
-    //reading the password from the console
-    while ((c = getchar())!= '\n' && c != EOF && i < BUFFER_SIZE){
-        password[i++] = c;
-    }
-    password[i] = '\0';
-
-    /*reseting our old STDIN_FILENO*/ 
-    tcsetattr( STDIN_FILENO, TCSANOW, &oldt);
-
-}
-
-/**
- * @brief Login user to server
- *
- *  Function tries to log in user in the loop of maximum 3 tries
- *  Firstly function loads password via function getpassword() and sends it to the server and waits for the answer recieved in pipe.
- *  Then destroys and unlinks used pipe. In the end of the loop function checks if the username and password are correct and finish, if not
- *  user has 2 more attempts for log in, if user fails after third attempt acces is denied and program ends.
- */
-void login(){
-    
-    int logged = 0;
-    int tries = 0;
-    
-    //buffer for input
-    char buffer[BUFFER_SIZE];
- 
-    //while user is not logged in, try to repeat password
-    while(!logged && tries<3){
-
-        //get password
-        getpassword("Password: ");
-
-        //send username and password to server
-        server = fopen(serverPipe, "w");
-        fprintf(server,"1|%s|%s",username,password);
-        fclose(server);
-
-        //create named pipe for receiving answer
-        mkfifo(username,0666);
-        FILE * in = fopen(username,"r");
-        
-        //read answer 
-        fgets(buffer,BUFFER_SIZE,in);
-        printf("Response: %s\n",buffer);
-        
-        //destroy named pipe
-        fclose(in);
-        unlink(username);
-
-        //if username and password are correct
-        if(strcmp(buffer,"Login OK")==0){
-            logged = 1;
-        }
-        //if not
-        else
-            printf("Try again.\n");
-        tries++;
-    }
-    if(!logged && tries==3){
-        printf("Acces denied !!\n");
-        exit(0);
-    }
-}
-
-/**
- *
- * @brief Ask server for all online users
- *
- * Function creates a pipe with the name of PID of actual process, then sends a query to the server in format:<br/>
- * <pre>2|pipename</pre>
- * After that function is waiting for the response from the server. Response (message) is in format "login1|login2|login3..." so function replace all 
- * "|" characters to "\n" character. Then function prints the result and closes and unlinks the pipe.
- *
- */
-
-
-void query_online(){
-    
-    //create a new pipe with name of pid process(it is unique)
-    int pid = getpid();
-    char pipe_name[10];
-    sprintf(pipe_name,"%d",pid);
-    mkfifo(pipe_name,0666);
-
-    //send query to server
-    server = fopen(serverPipe,"w");
-    fprintf(server,"2|%s",pipe_name);
-    fflush(server);
-    fclose(server);
-
-    //get response from server
-    char result[BUFFER_SIZE];
-    FILE * pipe = fopen(pipe_name,"r");
-    fgets(result,BUFFER_SIZE,pipe);
-
-    //replace all | for newlines
-    for(int i=0; i<(int)strlen(result); i++){
-        if(result[i]=='|')
-            result[i]='\n';
-    }
-
-    //print online users
-    printf("%s\n",result);
-
-    //destroy pipe
-    fclose(pipe);
-    unlink(pipe_name);
-}
-
-/**
- *
- * @brief Send message to user(s)
- *
- * Function asks for username - send "TO". Then asks for a message.
- * If there ia not just 1 username, but multiple usernames separated by exactly one space, function parses whole line with delimiter-space, and sends message to all these users.
- * Request server to send message to given users is in following format:
- * <pre>3|from|to|message</pre> For every username separated by space.
- */
-
-void query_send_message(){
-
-    //ask for username
-    printf("Message send to(write username): \n");
-    char name[BUFFER_SIZE];
-    fgets(name,BUFFER_SIZE,stdin);
-    name[strlen(name)-1]='\0';
-    
-    //ask for message
-    printf("Write message:\n");
-    char message[BUFFER_SIZE];
-    fgets(message,BUFFER_SIZE,stdin);
-    message[strlen(message)-1]='\0';
-
-    //parse username
-
-    char * newname = name;
-    char * pos=strchr(newname,' ');
-    while(1){
-        if(pos!=NULL)
-            pos[0]='\0';
-        //send message to server
-        server = fopen(serverPipe,"w");
-        fprintf(server,"3|%s|%s|%s\n",username,newname,message);
-        fclose(server);
-        if(pos==NULL)
-            break;
-        newname=pos+1;
-        pos=strchr(newname,' ');
-    }
-
-}
-
-
-/**
- *
- * @brief Ask server for logout
- *
- * Functions sends a request  to server via pipe that user wants to log out. The format of the query is <pre>4|userNameToLogout</pre>
- *
- */
-void query_logout(){
-
-    //send query for logout to server
-    server = fopen(serverPipe,"w");
-    fprintf(server,"4|%s",username);
-    fclose(server);
-}
-
-/**
- *
- * @brief Run client
- *
- * Functions creates 2 processes.
- *  - Child proces is recieving messages via calling function receive_messages()
- *  - Parents process writes to the console options for user then loads choosen option.
- *      1. If option is 1 process calls function query_online() to list all logged in users
- *      2. If option is 2 process calls function query_send_message() to send message to users
- *      3. If option is 3 process calls function query_logout() to log out actual user
- *      4. Else process informs user about bad option.
- *      
- *      Parents process is in the loop so after finishing one option user is asked again to choose an option and again,..
- *
- */
-
-
-
-void client_run(){
-
-    //at first start receiving messages
-    int pid = fork();
-    if (pid == (pid_t) 0){
-        //childs process
-        receive_messages();
-    }
-    else{
-        //parents process
-
-        //set pid as global variable - child process will terminate parents process in the end
-        mypid = pid;
-
-        //infinity loop for comunicating with user
-        while(1){
-
-            //print menu
-            printf("Choose an option (Press [1-3]):\n1 - Display online users\n2 - Send message to username\n3 - Quit\n");
-            
-            //read option
-            int mode;
-            scanf("%d",&mode);
-            getchar();
-
-            //print onilne
-            if(mode==1){
-                query_online();
-            }
-            //send message
-            else if(mode==2)
-                query_send_message();
-            //logout
-            else if(mode==3)
-                query_logout();
-            //nothing happens
-            else
-                printf("Bad option\n"); 
-        }
-    }
-
-
-
-}
-
-
-/**
- *
- * @brief Main
- *
- * 1. Check if username is given as argument.
- * 2. Check if server is running.
- * 3. Try to login user via login()
- * 4. Run client_run()
- *
- */
-
-
-int main(int argc, char ** argv){
-
-    //help for run
-    if(argc!=2){
-        printf("Usage: ./client username\n");
-        return 0;
-    }
-
-    //check for server running
-    
-    FILE * f = fopen(serverLock,"r");
-    if(!f){
-        printf("Server is not running !!!!\n");
-        return 0;
-    }
-    fclose(f);
-        
-
-
-
-    //get username from argv
-    strcpy(username,argv[1]);
-    
-    //check for already logged user
-    if(access( username, F_OK ) != -1){
-        printf("User already loggen in\n");
-        return 0;
-    }
-    
-    //login
-    login();
-    //run program
-    client_run();
-    return 0;
-}
+/**
+ * @file client.c
+ * @author Michal Korbela, Dvid Horov
+ * @date 13 May 2016
+ * @brief Implementation of client for SMS system
+ * @see https://github.com/kabell/SMSsystem
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <termios.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+
+#define BUFFER_SIZE 1000            /**< Size of buffer for everything */
+#define FRAME_MAGIC 0xFB            /**< First byte of binary frame */
+#define FRAME_VERSION 1             /**< Version of binary frame format */
+#define FRAME_HEADER 8              /**< Size of fixed part of frame header */
+#define FRAME_MAX 65536             /**< Maximum size of whole binary frame */
+#define FRAME_FIELDS 8              /**< Maximum number of fields in frame */
+#define FRAME_MESSAGE 100           /**< Type of frame with message - fields are sender, text and number of message with receipt (only for message with receipt) */
+#define FRAME_FILE 102              /**< Type of frame with large message - fields are sender and payload, payload is not limited by FRAME_MAX */
+#define TRANSFER_MAX (1 << 30)      /**< Maximum size of file sent as large message */
+#define INBOX_BUFFER_SIZE 524288    /**< Size of buffer for data received from server - one packet from socket must fit into its free half */
+#define HISTORY_PAGE 20             /**< Number of messages asked in one page of history */
+#define ACK_SIZE 4096               /**< Maximum size of list of senders in one acknowledgement of messages with receipt */
+
+
+char * serverPipe = "serverin";     /**< Name of the named pipe used by server as input */
+
+char * serverLock = "server.lock";  /**< Name of the file indicates if server is running */
+
+char * serverSocket = "server.sock"; /**< Name of the unix domain socket of server */
+
+char username[BUFFER_SIZE];         /**< Username of client */
+char password[BUFFER_SIZE];         /**< Password of client */
+
+int binary = 0;                     /**< Client communicates with server by binary frames instead of text lines */
+
+int inbox = -1;                     /**< Named pipe or socket for receiving messages from server, it is opened before login and stays opened until logout */
+
+char inboxBuffer[INBOX_BUFFER_SIZE]; /**< Data received from server which were not processed yet */
+
+size_t inboxStart = 0;              /**< Beginning of unprocessed data in inboxBuffer */
+
+size_t inboxEnd = 0;                /**< End of unprocessed data in inboxBuffer */
+
+int downloadFd = -1;                /**< File for payload of large message which is being received, -1 if file can not be written */
+
+uint64_t downloadLeft = 0;          /**< Number of bytes of payload which were not received yet, 0 if no large message is being received */
+
+char downloadPath[BUFFER_SIZE + NAME_MAX + 16]; /**< Name of file for payload of large message */
+
+int uploadFile = -1;                /**< File which is being sent as large message, -1 if there is none */
+
+int uploadPipe = -1;                /**< Upload pipe - server moves data from it to the recipient */
+
+uint64_t uploadLeft = 0;            /**< Number of bytes of file which were not written to upload pipe yet */
+
+char uploadPath[BUFFER_SIZE + 16];  /**< Name of upload pipe */
+
+/**
+ * Sender of messages with receipt
+ */
+typedef struct {
+    char name[NAME_MAX + 1];        /**< Username of sender */
+    unsigned long long seen;        /**< Number of the last printed message from sender */
+    unsigned long long acked;       /**< Number of the last message acknowledged to server */
+} sender_t;
+
+sender_t * senders = NULL;          /**< Senders of messages with receipt received since login */
+
+int senderCount = 0;                /**< Number of senders in senders */
+
+/**
+ * Way of communication with server
+ */
+typedef struct {
+    int (*open)(void);                                  /**< Prepare channel for receiving messages - return 0 on success */
+    int (*send)(const void * data, size_t length);      /**< Send request to server - return 0 on success */
+    ssize_t (*receive)(char * buffer, size_t size);     /**< Wait for data from server */
+    void (*close)(void);                                /**< Close channel */
+} transport_t;
+
+transport_t * transport;            /**< Transport used by client */
+
+char inputBuffer[2 * BUFFER_SIZE];  /**< Data read from standard input which were not processed yet */
+
+size_t inputLength = 0;             /**< Number of bytes in inputBuffer */
+
+int inputClosed = 0;                /**< Standard input reached end of file */
+
+int menuOption = 0;                 /**< Option chosen from menu whose questions are being answered, 0 if client waits for option */
+
+int menuStep = 0;                   /**< Number of answered questions of chosen option */
+
+char menuAnswer[3][BUFFER_SIZE];    /**< Answers to questions of chosen option */
+
+const char * menuPrompt[14][3] = {  /**< Questions asked for every option of menu */
+    [1] = {"Show users starting with (empty for all users): ", "Show users after (empty for the first page): "},
+    [2] = {"Message send to(write username): ", "Write message:"},
+    [4] = {"Name of group: "},
+    [5] = {"Name of group: "},
+    [6] = {"Name of group: "},
+    [7] = {"Message send to group: ", "Write message:"},
+    [9] = {"Watch users going online and offline? (y/n): "},
+    [10] = {"Send file to (write username): ", "Name of file: "},
+    [11] = {"Show history with (username or #group): ", "Show messages before (#number from previous page or unix time, empty for the newest): "},
+    [12] = {"Search for words: ", "Show messages before (#number from previous page or unix time, empty for the newest): "},
+    [13] = {"Message send to(write username): ", "Deliver after seconds (+seconds) or at unix time: ", "Write message:"},
+};
+
+/**
+ * @brief Store 32-bit number in little endian
+ * @param p - Output
+ * @param value - Number
+ */
+void le32_put(unsigned char * p, uint32_t value){
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/**
+ * @brief Load 32-bit number in little endian
+ * @param p - Input
+ * @return Number
+ */
+uint32_t le32_get(const unsigned char * p){
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Create named pipe for messages - named pipe transport
+ * @return 0 on success
+ *
+ * Pipe is opened for reading and writing, so it never reports end of file and server can open it in non-blocking mode anytime.
+ */
+int fifo_open(){
+    mkfifo(username,0666);
+    inbox = open(username, O_RDWR);
+    return inbox < 0;
+}
+
+/**
+ * @brief Send request to server by its named pipe - named pipe transport
+ * @param data - Request
+ * @param length - Length of request
+ * @return 0 on success
+ *
+ * Pipe is opened for every request - write of at most PIPE_BUF bytes is not mixed with requests of other clients.
+ */
+int fifo_send(const void * data, size_t length){
+    int server = open(serverPipe, O_WRONLY);
+    if(server < 0)
+        return -1;
+    ssize_t written = write(server, data, length);
+    close(server);
+    return written != (ssize_t)length;
+}
+
+/**
+ * @brief Wait for data in named pipe - named pipe transport
+ * @param buffer - Buffer for data
+ * @param size - Size of buffer
+ * @return Number of bytes or -1 on error
+ */
+ssize_t fifo_receive(char * buffer, size_t size){
+    return read(inbox, buffer, size);
+}
+
+/**
+ * @brief Close and destroy named pipe - named pipe transport
+ */
+void fifo_close(){
+    close(inbox);
+    unlink(username);
+}
+
+/**
+ * @brief Connect to server - socket transport
+ * @return 0 on success
+ *
+ * Socket is SOCK_SEQPACKET - connection is persistent, requests and messages are sent as packets.
+ */
+int socket_open(){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, serverSocket, sizeof(address.sun_path) - 1);
+    inbox = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(inbox < 0)
+        return -1;
+    return connect(inbox, (struct sockaddr *)&address, sizeof(address));
+}
+
+/**
+ * @brief Send request by connection - socket transport
+ * @param data - Request
+ * @param length - Length of request
+ * @return 0 on success
+ */
+int socket_send(const void * data, size_t length){
+    return send(inbox, data, length, MSG_NOSIGNAL) != (ssize_t)length;
+}
+
+/**
+ * @brief Wait for packet from server - socket transport
+ * @param buffer - Buffer for data
+ * @param size - Size of buffer
+ * @return Number of bytes or -1 on error
+ */
+ssize_t socket_receive(char * buffer, size_t size){
+    return recv(inbox, buffer, size, 0);
+}
+
+/**
+ * @brief Close connection - socket transport
+ */
+void socket_close(){
+    close(inbox);
+}
+
+transport_t fifoTransport = {fifo_open, fifo_send, fifo_receive, fifo_close};           /**< Named pipes - server input and pipe named by username */
+
+transport_t socketTransport = {socket_open, socket_send, socket_receive, socket_close};  /**< Unix domain socket of server */
+
+/**
+ * @brief Send request to server
+ * @param type - Type of request
+ * @param count - Number of fields
+ * @param ... - Fields of request (strings)
+ *
+ * In text mode request is one line <pre>type|field1|field2...</pre>
+ * In binary mode request is a frame: magic, version, type, count of fields, length of payload, end offsets of fields and fields without separators (numbers are little endian).
+ * Whole request is written by one write, so it is not mixed with requests of other clients.
+ * Request is sent by current transport.
+ */
+void request_send(int type, int count, ...){
+    static unsigned char request[FRAME_MAX];
+    const char * field[FRAME_FIELDS];
+    size_t length = 0;
+
+    va_list args;
+    va_start(args, count);
+    for(int i=0; i<count; i++)
+        field[i] = va_arg(args, const char *);
+    va_end(args);
+
+    if(binary){
+        size_t offset = FRAME_HEADER + 4 * count;
+        request[0] = FRAME_MAGIC;
+        request[1] = FRAME_VERSION;
+        request[2] = type;
+        request[3] = count;
+        for(int i=0; i<count; i++){
+            size_t fieldLength = strlen(field[i]);
+            memcpy(request + offset, field[i], fieldLength);
+            offset += fieldLength;
+            le32_put(request + FRAME_HEADER + 4 * i, offset - FRAME_HEADER - 4 * count);
+        }
+        le32_put(request + 4, offset - FRAME_HEADER - 4 * count);
+        length = offset;
+    }
+    else{
+        length = snprintf((char *)request, FRAME_MAX, "%d", type);
+        for(int i=0; i<count; i++)
+            length += snprintf((char *)request + length, FRAME_MAX - length, "|%s", field[i]);
+        request[length++] = '\n';
+    }
+
+    if(transport->send(request, length))
+        perror("request_send");
+}
+
+/**
+ * @brief Start receiving payload of large message
+ * @param from - Sender, it does not have to be terminated by zero
+ * @param fromLength - Length of sender
+ * @param size - Size of payload
+ * @param buffer - Buffer for message about the file
+ * @param bufferSize - Size of buffer
+ *
+ * Payload is written to new file "username.from.N" as it comes, so it does not have to fit into memory.
+ */
+void download_start(const char * from, size_t fromLength, uint64_t size, char * buffer, size_t bufferSize){
+    for(int i=1; ; i++){
+        snprintf(downloadPath, sizeof(downloadPath), "%s.%.*s.%d", username, (int)(fromLength < NAME_MAX ? fromLength : NAME_MAX), from, i);
+        downloadFd = open(downloadPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(downloadFd >= 0 || errno != EEXIST)
+            break;
+    }
+    downloadLeft = size;
+    if(downloadFd < 0)
+        snprintf(buffer, bufferSize, "File from %.*s (%llu bytes) can not be saved\n", (int)fromLength, from, (unsigned long long)size);
+    else
+        snprintf(buffer, bufferSize, "Receiving file from %.*s (%llu bytes) to %s\n", (int)fromLength, from, (unsigned long long)size, downloadPath);
+}
+
+/**
+ * @brief Stop sending file - close the file and destroy upload pipe
+ */
+void upload_end(){
+    if(uploadFile < 0)
+        return;
+    close(uploadFile);
+    if(uploadPipe >= 0)
+        close(uploadPipe);
+    unlink(uploadPath);
+    uploadFile = -1;
+    uploadPipe = -1;
+    uploadLeft = 0;
+}
+
+/**
+ * @brief Receive data from server to inboxBuffer
+ * @return 1 if some data were received, 0 at end of file
+ *
+ * Function blocks until data arrive - it is called when poll() reports them or when client waits for answer of server.
+ */
+int inbox_receive(){
+    //move unprocessed data to the beginning of buffer
+    if(inboxEnd > INBOX_BUFFER_SIZE / 2){
+        memmove(inboxBuffer, inboxBuffer + inboxStart, inboxEnd - inboxStart);
+        inboxEnd -= inboxStart;
+        inboxStart = 0;
+    }
+    ssize_t n;
+    do
+        n = transport->receive(inboxBuffer + inboxEnd, INBOX_BUFFER_SIZE - inboxEnd);
+    while(n < 0 && errno == EINTR);
+    if(n <= 0)
+        return 0;
+    inboxEnd += n;
+    return 1;
+}
+
+/**
+ * @brief Take one message from inboxBuffer
+ * @param buffer - Buffer for message
+ * @param size - Size of buffer
+ * @return 1 if message was taken, 0 if there is no complete message in inboxBuffer
+ *
+ * In text mode message is one line. In binary mode message is a frame - it is converted to line "from -> text" (or just text for notices from server),
+ * text can contain any characters. Invalid frame is dropped with the rest of received data.
+ */
+int message_parse(char * buffer, size_t size){
+    size_t available = inboxEnd - inboxStart;
+
+    //payload of large message goes directly to file
+    if(downloadLeft){
+        size_t length = available < downloadLeft ? available : downloadLeft;
+        if(downloadFd >= 0 && write(downloadFd, inboxBuffer + inboxStart, length) != (ssize_t)length){
+            perror("download");
+            close(downloadFd);
+            downloadFd = -1;
+        }
+        inboxStart += length;
+        downloadLeft -= length;
+        if(downloadLeft || downloadFd < 0)
+            return 0;
+        close(downloadFd);
+        downloadFd = -1;
+        snprintf(buffer, size, "File saved to %s\n", downloadPath);
+        return 1;
+    }
+
+    if(!binary){
+        char * newline = memchr(inboxBuffer + inboxStart, '\n', available);
+        if(!newline)
+            return 0;
+        size_t length = newline + 1 - (inboxBuffer + inboxStart);
+        snprintf(buffer, size, "%.*s", (int)length, inboxBuffer + inboxStart);
+        inboxStart += length;
+
+        //large message is announced by line "from => size" - ordinary messages contain " -> "
+        char from[NAME_MAX + 1], end;
+        unsigned long long payload;
+        if(sscanf(buffer, "%255[A-Za-z0-9] => %llu%c", from, &payload, &end) == 3 && end == '\n' && payload)
+            download_start(from, strlen(from), payload, buffer, size);
+        return 1;
+    }
+
+    //check that header, field offsets and payload are complete
+    if(available < FRAME_HEADER)
+        return 0;
+    unsigned char * header = (unsigned char *)inboxBuffer + inboxStart;
+    size_t offsets = 4 * header[3];
+    size_t length = le32_get(header + 4);
+
+    //large message - only sender is in buffer, payload follows
+    if(header[0] == FRAME_MAGIC && header[2] == FRAME_FILE && header[3] == 2){
+        if(available < FRAME_HEADER + offsets)
+            return 0;
+        size_t fromLength = le32_get(header + FRAME_HEADER);
+        if(fromLength > NAME_MAX || fromLength >= length){
+            inboxStart = inboxEnd;
+            return 0;
+        }
+        if(available < FRAME_HEADER + offsets + fromLength)
+            return 0;
+        download_start((char *)header + FRAME_HEADER + offsets, fromLength, length - fromLength, buffer, size);
+        inboxStart += FRAME_HEADER + offsets + fromLength;
+        return 1;
+    }
+
+    if(header[0] != FRAME_MAGIC || length > FRAME_MAX){
+        inboxStart = inboxEnd;
+        return 0;
+    }
+    if(available < FRAME_HEADER + offsets + length)
+        return 0;
+    char * payload = (char *)header + FRAME_HEADER + offsets;
+
+    //message is printed as "from -> text", message with receipt as "from #seq -> text"
+    if(header[2] == FRAME_MESSAGE && header[3] == 2){
+        size_t fromLength = le32_get(header + FRAME_HEADER);
+        snprintf(buffer, size, "%.*s -> %.*s\n", (int)fromLength, payload, (int)(length - fromLength), payload + fromLength);
+    }
+    else if(header[2] == FRAME_MESSAGE && header[3] == 3){
+        size_t fromLength = le32_get(header + FRAME_HEADER), textEnd = le32_get(header + FRAME_HEADER + 4);
+        if(fromLength > textEnd || textEnd > length){
+            inboxStart = inboxEnd;
+            return 0;
+        }
+        snprintf(buffer, size, "%.*s #%.*s -> %.*s\n", (int)fromLength, payload, (int)(length - textEnd), payload + textEnd,
+                 (int)(textEnd - fromLength), payload + fromLength);
+    }
+    else
+        snprintf(buffer, size, "%.*s", (int)length, payload);
+    inboxStart += FRAME_HEADER + offsets + length;
+    return 1;
+}
+
+/**
+ * @brief Wait for one message from server
+ * @param buffer - Buffer for message
+ * @param size - Size of buffer
+ * @return 1 if message was read, 0 at end of file
+ */
+int message_read(char * buffer, size_t size){
+    while(!message_parse(buffer, size))
+        if(!inbox_receive())
+            return 0;
+    return 1;
+}
+
+/**
+ * @brief Remember message with receipt, so it is acknowledged
+ * @param message - Received message
+ * @return 0 if message with the same or lower number from the same sender was already printed, 1 otherwise
+ */
+int receipt_check(const char * message){
+    char from[NAME_MAX + 1];
+    unsigned long long seq;
+    int n = 0;
+    if(sscanf(message, "%255[A-Za-z0-9] #%llu%n", from, &seq, &n) != 2 || strncmp(message + n, " -> ", 4))
+        return 1;
+
+    int i = 0;
+    while(i < senderCount && strcmp(senders[i].name, from))
+        i++;
+    if(i == senderCount){
+        senders = realloc(senders, (senderCount + 1) * sizeof(sender_t));
+        snprintf(senders[i].name, sizeof(senders[i].name), "%s", from);
+        senders[i].seen = senders[i].acked = 0;
+        senderCount++;
+    }
+    if(seq <= senders[i].seen)
+        return 0;
+    senders[i].seen = seq;
+    return 1;
+}
+
+/**
+ * @brief Acknowledge printed messages with receipt
+ *
+ * One request acknowledges all messages printed since the last acknowledgement - number of the last message from every sender covers all older messages.
+ * Request has format <pre>18|username|from1 seq1 from2 seq2...</pre>
+ * Longer list is split into more requests, each of them has at most PIPE_BUF bytes.
+ */
+void receipt_ack(){
+    char list[ACK_SIZE];
+    size_t length = 0;
+    //whole request with header (code, separators and newline or frame header) and username must fit into one atomic write to named pipe - see fifo_send()
+    size_t limit = PIPE_BUF - strlen(username) - (binary ? FRAME_HEADER + 8 : 5);
+    if(limit > ACK_SIZE)
+        limit = ACK_SIZE;
+    for(int i=0; i<senderCount; i++){
+        if(senders[i].seen == senders[i].acked)
+            continue;
+        if(length + NAME_MAX + 24 > limit){
+            request_send(18,2,username,list);
+            length = 0;
+        }
+        length += snprintf(list + length, ACK_SIZE - length, "%s%s %llu", length ? " " : "", senders[i].name, senders[i].seen);
+        senders[i].acked = senders[i].seen;
+    }
+    if(length)
+        request_send(18,2,username,list);
+}
+
+/**
+ * @brief Print all received messages
+ *
+ * Messages are printed to buffered standard output, which is flushed once before client waits again - whole chunk of messages is written at once.
+ * Messages with receipt of the whole chunk are acknowledged by one request - see receipt_ack().
+ * If the message is command to exit the program, function closes inbox and exits.
+ */
+void messages_print(){
+
+    //buffer for message
+    char buffer[BUFFER_SIZE];
+
+    while(message_parse(buffer,BUFFER_SIZE)){
+
+        //if message is a command to exit program
+        if(!strcmp(buffer,"Logged out.\n")){
+
+            printf("Exiting...\n");
+            fflush(stdout);
+            //close all streams and named pipes
+            upload_end();
+            transport->close();
+            exit(0);
+        }
+
+        //message with receipt which was already printed is not printed again
+        if(!receipt_check(buffer))
+            continue;
+
+        //server finished moving of file which is being sent
+        if(uploadFile >= 0 && !strncmp(buffer,"Upload to ",10) && (strstr(buffer," complete\n") || strstr(buffer," failed")))
+            upload_end();
+
+        //print message
+        printf("%s",buffer);
+    }
+    receipt_ack();
+}
+
+/**
+ * @brief Read available data from standard input
+ * @return 1 if some data were read, 0 at end of file
+ */
+int input_receive(){
+    ssize_t n;
+    do
+        n = read(STDIN_FILENO, inputBuffer + inputLength, sizeof(inputBuffer) - inputLength);
+    while(n < 0 && errno == EINTR);
+    if(n <= 0){
+        inputClosed = 1;
+        return 0;
+    }
+    inputLength += n;
+    return 1;
+}
+
+/**
+ * @brief Take one line from inputBuffer
+ * @param line - Buffer for line of BUFFER_SIZE bytes, newline is removed
+ * @return 1 if line was taken, 0 if there is no complete line
+ *
+ * Too long line is cut. Unfinished last line is taken when standard input is closed.
+ */
+int input_line(char * line){
+    char * newline = memchr(inputBuffer, '\n', inputLength);
+    size_t length = newline ? (size_t)(newline - inputBuffer) : inputLength;
+    if(!newline && !(inputClosed && inputLength) && inputLength < sizeof(inputBuffer))
+        return 0;
+    snprintf(line, BUFFER_SIZE, "%.*s", (int)length, inputBuffer);
+    if(newline)
+        length++;
+    inputLength -= length;
+    memmove(inputBuffer, inputBuffer + length, inputLength);
+    return 1;
+}
+
+/**
+ * @brief Read password from stanard input with prompt 
+ * @param message - Prompt
+ *
+ * Function stores password to global variable password
+ */
+
+void getpassword(char * message)
+{
+    printf("%s\n",message);
+    static struct termios oldt, newt;
+
+    //saving the old settings of STDIN_FILENO and copy settings for reseting
+    tcgetattr( STDIN_FILENO, &oldt);
+    newt = oldt;
+
+    //setting the approriate bit in the termios struct
+    newt.c_lflag &= ~(ECHO);          
+
+    //setting new bits
+    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
+
+    //reading the password from the console - it is read by the same buffer as menu, so no typed line is lost
+    while(!input_line(password)){
+        if(!input_receive()){
+            if(!input_line(password))
+                password[0] = '\0';
+            break;
+        }
+    }
+
+    /*reseting our old STDIN_FILENO*/ 
+    tcsetattr( STDIN_FILENO, TCSANOW, &oldt);
+
+}
+
+/**
+ * @brief Login user to server
+ *
+ *  Function creates named pipe for receiving messages (or connects to server by socket) - see transport_t. Pipe stays opened after successful login - server keeps it opened until logout.
+ *  Then function tries to log in user in the loop of maximum 3 tries
+ *  Firstly function loads password via function getpassword() and sends it to the server and waits for the answer recieved in pipe.
+ *  In the end of the loop function checks if the username and password are correct and finish, if not
+ *  user has 2 more attempts for log in, if user fails after third attempt pipe is destroyed, acces is denied and program ends.
+ */
+void login(){
+    
+    int logged = 0;
+    int tries = 0;
+    
+    //buffer for input
+    char buffer[BUFFER_SIZE];
+
+    //create named pipe (or connect to server) for receiving answer and messages
+    if(transport->open()){
+        perror("Can not connect to server");
+        exit(0);
+    }
+ 
+    //while user is not logged in, try to repeat password
+    while(!logged && tries<3){
+
+        //get password
+        getpassword("Password: ");
+
+        //send username and password to server
+        request_send(1,2,username,password);
+
+        //read answer 
+        if(!message_read(buffer,BUFFER_SIZE))
+            buffer[0]='\0';
+        printf("Response: %s",buffer);
+
+        //if username and password are correct
+        if(strcmp(buffer,"Login OK\n")==0){
+            logged = 1;
+        }
+        //if not
+        else
+            printf("Try again.\n");
+        tries++;
+    }
+    if(!logged && tries==3){
+        //destroy named pipe
+        transport->close();
+        printf("Acces denied !!\n");
+        exit(0);
+    }
+}
+
+/**
+ *
+ * @brief Ask server for online users
+ * @param prefix - Only usernames starting by prefix are listed, empty for all users
+ * @param after - The last username of previous page, empty for the first page
+ *
+ * Function sends a query to the server in format:<br/>
+ * <pre>11|username|prefix|after</pre>
+ * Server answers to the inbox of logged user by one message "Online users:" followed by one username per line in alphabetical order, so the answer is printed by messages_print() like any other message.
+ * Long list is split to pages - the last line of page tells the username which is given as after for the next page.
+ * Client connected by socket sends "-" instead of username - server answers by the connection.
+ *
+ */
+
+
+void query_online(char * prefix, char * after){
+
+    //send query to server
+    request_send(11,3,transport == &socketTransport ? "-" : username,prefix,after);
+}
+
+/**
+ *
+ * @brief Subscribe to changes of presence of users or cancel subscription
+ * @param answer - Answer of user, subscription is asked by "y"
+ *
+ * Request is in format <pre>12|username|1</pre> (0 for cancel). Subscribed client gets message whenever another user logs in or out.
+ */
+void query_subscribe(char * answer){
+
+    //send request to server
+    request_send(12,2,username,answer[0]=='y' || answer[0]=='Y' ? "1" : "0");
+}
+
+/**
+ *
+ * @brief Ask server for its statistics
+ *
+ * Request is in format <pre>10|username</pre> (or "-" instead of username for client connected by socket).
+ * Server answers by one message "Server statistics:" followed by one value per line - see stats_format() of server.
+ */
+void query_stats(){
+
+    //send query to server
+    request_send(10,1,transport == &socketTransport ? "-" : username);
+}
+
+/**
+ *
+ * @brief Send message to user(s)
+ * @param name - Recipient or more recipients separated by space
+ * @param message - Message
+ *
+ * If there ia not just 1 username, but multiple usernames separated by space, server sends message to all these users.
+ * Request server to send message to given users is in following format:
+ * <pre>5|from|to1 to2 to3|message</pre> One request for all usernames.
+ * Message to one user is sent with receipt in format <pre>17|from|to|message</pre>
+ * Server answers "Message #N to user delivered" when recipient reads it, or that the message failed.
+ */
+
+void query_send_message(char * name, char * message){
+
+    //message to one user gets receipt
+    if(!strchr(name,' ')){
+        request_send(17,3,username,name,message);
+        return;
+    }
+
+    //send message to server - server splits usernames
+    request_send(5,3,username,name,message);
+
+}
+
+
+/**
+ *
+ * @brief Create, join or leave group
+ * @param type - Type of request: 6 - create group, 7 - join group, 8 - leave group
+ * @param group - Name of group
+ *
+ * Function sends a request to server in format:
+ * <pre>type|username|group</pre>
+ * Server answers by a message, which is printed by messages_print().
+ */
+void query_group(int type, char * group){
+
+    //send request to server
+    request_send(type,2,username,group);
+}
+
+/**
+ *
+ * @brief Post message to group
+ * @param group - Name of group
+ * @param message - Message
+ *
+ * Request is in format:
+ * <pre>9|from|group|message</pre>
+ * Server delivers message to all members of group.
+ */
+void query_group_post(char * group, char * message){
+
+    //send request to server
+    request_send(9,3,username,group,message);
+}
+
+/**
+ *
+ * @brief Start sending file to user
+ * @param to - Recipient
+ * @param path - Name of file
+ *
+ * File is written to upload pipe "username.upload" and server moves it to the recipient without storing it, so the file can be much bigger than messages.
+ * Request is in format:
+ * <pre>13|from|to|size</pre>
+ * Upload pipe is opened for reading and writing, so it can be filled before server opens it. File is written by upload_write() whenever the pipe has space.
+ * Server reports progress by messages "Upload to NAME ..." - the last of them is "complete" or "failed".
+ */
+void query_send_file(char * to, char * path){
+    if(uploadFile >= 0){
+        printf("Another file is being sent\n");
+        return;
+    }
+    struct stat st;
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if(file < 0 || fstat(file, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > TRANSFER_MAX){
+        printf("File %s can not be sent\n", path);
+        if(file >= 0)
+            close(file);
+        return;
+    }
+
+    snprintf(uploadPath, sizeof(uploadPath), "%s.upload", username);
+    unlink(uploadPath);
+    if(mkfifo(uploadPath, 0600) || (uploadPipe = open(uploadPath, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0){
+        perror("upload");
+        unlink(uploadPath);
+        close(file);
+        return;
+    }
+    uploadFile = file;
+    uploadLeft = st.st_size;
+
+    //send request to server
+    char size[32];
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)st.st_size);
+    request_send(13,3,username,to,size);
+}
+
+/**
+ * @brief Write next part of file to upload pipe
+ *
+ * Data are moved from file to pipe by splice() until the pipe is full.
+ */
+void upload_write(){
+    while(uploadLeft){
+        ssize_t n = splice(uploadFile, NULL, uploadPipe, NULL, uploadLeft < 65536 ? uploadLeft : 65536, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n > 0)
+            uploadLeft -= n;
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else if(n < 0 && errno == EAGAIN)
+            return;
+        //file is shorter than it was - server gets end of pipe and sending fails
+        else{
+            perror("upload");
+            close(uploadPipe);
+            uploadPipe = -1;
+            uploadLeft = 0;
+        }
+    }
+}
+
+/**
+ *
+ * @brief Ask server for history of conversation
+ * @param peer - Username or "#group"
+ * @param before - Only older messages are shown - "#number" from previous page or unix time, empty for the newest messages
+ *
+ * Request is in format <pre>14|username|peer|count|before</pre>
+ * Server answers by one message "History with PEER:" followed by messages oldest first. If there are older messages,
+ * the line after title is "More messages before #NUMBER" - the next page is asked by this number.
+ */
+void query_history(char * peer, char * before){
+    char count[16];
+    snprintf(count, sizeof(count), "%d", HISTORY_PAGE);
+
+    //send query to server
+    request_send(14,4,username,peer,count,before);
+}
+
+/**
+ *
+ * @brief Search history for messages containing words
+ * @param words - Words separated by spaces, message must contain all of them
+ * @param before - Only older messages are shown - "#number" from previous page or unix time, empty for the newest messages
+ *
+ * Request is in format <pre>15|username|words|count|before</pre>
+ * Server searches conversations of user and groups which he is member of, answer is like answer for history.
+ */
+void query_search(char * words, char * before){
+    char count[16];
+    snprintf(count, sizeof(count), "%d", HISTORY_PAGE);
+
+    //send query to server
+    request_send(15,4,username,words,count,before);
+}
+
+/**
+ *
+ * @brief Send message which is delivered later
+ * @param to - Recipient
+ * @param when - "+seconds" to deliver after given number of seconds or unix time of delivery
+ * @param message - Text of message
+ *
+ * Request is in format <pre>16|username|to|when|message</pre>
+ * Server answers by number of message and its time of delivery. At that time recipient gets the message like any other message,
+ * or it is stored for him if he is offline.
+ */
+void query_send_later(char * to, char * when, char * message){
+
+    //send query to server
+    request_send(16,4,username,to,when,message);
+}
+
+/**
+ *
+ * @brief Ask server for logout
+ *
+ * Functions sends a request  to server via pipe that user wants to log out. The format of the query is <pre>4|userNameToLogout</pre>
+ *
+ */
+void query_logout(){
+
+    //send query for logout to server
+    request_send(4,1,username);
+}
+
+/**
+ * @brief Print menu
+ */
+void menu_print(){
+    printf("Choose an option (Press [1-13]):\n1 - Display online users\n2 - Send message to username\n3 - Quit\n"
+           "4 - Create group\n5 - Join group\n6 - Leave group\n7 - Send message to group\n8 - Display server statistics\n"
+           "9 - Watch users going online and offline\n10 - Send file to username\n11 - Display history of conversation\n12 - Search history\n"
+           "13 - Send message later\n");
+}
+
+/**
+ * @brief Process one line typed by user
+ * @param line - Line without newline
+ *
+ * Menu is a state machine - the first line chooses an option, next lines answer its questions (see menuPrompt).
+ * When all questions are answered, the option is executed and menu is printed again.
+ *  1. If option is 1 query_online() lists logged in users
+ *  2. If option is 2 query_send_message() sends message to users
+ *  3. If option is 3 query_logout() logs out actual user - client ends when server confirms it
+ *  4. If option is 4, 5 or 6 query_group() creates, joins or leaves group
+ *  5. If option is 7 query_group_post() sends message to group
+ *  6. If option is 8 query_stats() shows statistics of server
+ *  7. If option is 9 query_subscribe() starts or stops watching of users
+ *  8. If option is 10 query_send_file() starts sending file
+ *  9. If option is 11 or 12 query_history() or query_search() shows messages from history
+ * 10. If option is 13 query_send_later() sends message delivered later
+ * 11. Else user is informed about bad option.
+ */
+void menu_input(char * line){
+
+    //choose option
+    if(!menuOption){
+        int mode = atoi(line);
+        if(mode<1 || mode>13){
+            printf("Bad option\n");
+            menu_print();
+            return;
+        }
+        menuOption = mode;
+        menuStep = 0;
+    }
+    //answer question of option
+    else
+        snprintf(menuAnswer[menuStep++],BUFFER_SIZE,"%s",line);
+
+    //ask next question
+    if(menuStep<3 && menuPrompt[menuOption][menuStep]){
+        printf("%s\n",menuPrompt[menuOption][menuStep]);
+        return;
+    }
+
+    int mode = menuOption;
+    menuOption = 0;
+    //print onilne
+    if(mode==1)
+        query_online(menuAnswer[0],menuAnswer[1]);
+    //send message
+    else if(mode==2)
+        query_send_message(menuAnswer[0],menuAnswer[1]);
+    //logout
+    else if(mode==3){
+        query_logout();
+        return;
+    }
+    //groups
+    else if(mode>=4 && mode<=6)
+        query_group(mode+2,menuAnswer[0]);
+    else if(mode==7)
+        query_group_post(menuAnswer[0],menuAnswer[1]);
+    //statistics
+    else if(mode==8)
+        query_stats();
+    //presence
+    else if(mode==9)
+        query_subscribe(menuAnswer[0]);
+    //large message
+    else if(mode==10)
+        query_send_file(menuAnswer[0],menuAnswer[1]);
+    //history
+    else if(mode==11)
+        query_history(menuAnswer[0],menuAnswer[1]);
+    else if(mode==12)
+        query_search(menuAnswer[0],menuAnswer[1]);
+    //delayed message
+    else if(mode==13)
+        query_send_later(menuAnswer[0],menuAnswer[1],menuAnswer[2]);
+    menu_print();
+}
+
+/**
+ *
+ * @brief Run client
+ *
+ * Client waits by poll() for standard input and for its inbox at the same time - one process is enough for both.
+ *  - Messages from server are printed by messages_print() as soon as they arrive, all messages received by one read are printed together.
+ *  - Lines typed by user are processed by menu_input().
+ *  - File which is being sent is written to upload pipe by upload_write() whenever the pipe has space.
+ *
+ * When standard input is closed, client asks server for logout and waits for confirmation. Client ends when server confirms logout or when server closes the connection.
+ *
+ */
+void client_run(){
+
+    //messages are written in chunks by fflush()
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
+    char line[BUFFER_SIZE];
+    struct pollfd fds[3] = {{inbox, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}, {-1, POLLOUT, 0}};
+    menu_print();
+    while(1){
+
+        //messages received together with answer for login or with previous messages
+        messages_print();
+
+        //lines typed ahead
+        while(input_line(line))
+            menu_input(line);
+        fflush(stdout);
+
+        //descriptors with negative number are ignored by poll()
+        fds[1].fd = inputClosed ? -1 : STDIN_FILENO;
+        fds[2].fd = uploadLeft ? uploadPipe : -1;
+        if(poll(fds, 3, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        //new messages from server
+        if(fds[0].revents && !inbox_receive()){
+            printf("Server closed connection\n");
+            break;
+        }
+
+        //new input from user, end of input means logout
+        if(!inputClosed && fds[1].revents && !input_receive()){
+            while(input_line(line))
+                menu_input(line);
+            query_logout();
+        }
+
+        //upload pipe has space for next part of file
+        if(uploadLeft && fds[2].revents)
+            upload_write();
+    }
+    fflush(stdout);
+    upload_end();
+    transport->close();
+}
+
+
+/**
+ *
+ * @brief Main
+ *
+ * 1. Check if username is given as argument. Option -b selects binary protocol - see request_send(). Option -s selects socket transport instead of named pipes - see transport_t.
+ * 2. Check if server is running.
+ * 3. Try to login user via login()
+ * 4. Run client_run()
+ *
+ */
+
+
+int main(int argc, char ** argv){
+
+    //binary protocol and socket transport are optional
+    transport = &fifoTransport;
+    while(argc>2 && argv[1][0]=='-'){
+        if(!strcmp(argv[1],"-b"))
+            binary = 1;
+        else if(!strcmp(argv[1],"-s"))
+            transport = &socketTransport;
+        else
+            break;
+        argv++;
+        argc--;
+    }
+
+    //help for run
+    if(argc!=2){
+        printf("Usage: ./client [-b] [-s] username\n");
+        return 0;
+    }
+
+    //check for server running
+    
+    FILE * f = fopen(serverLock,"r");
+    if(!f){
+        printf("Server is not running !!!!\n");
+        return 0;
+    }
+    fclose(f);
+        
+
+
+
+    //get username from argv
+    snprintf(username,BUFFER_SIZE,"%s",argv[1]);
+    
+    //check for already logged user - server checks it for clients connected by socket
+    if(transport == &fifoTransport && access( username, F_OK ) != -1){
+        printf("User already loggen in\n");
+        return 0;
+    }
+    
+    //login
+    login();
+    //run program
+    client_run();
+    return 0;
+}
@@ -1,557 +1,8148 @@
-/**
- * @file server.c
- * @author Michal Korbela, Dvid Horov
- * @date 13 May 2016
- * @brief Implementation of server for SMS system
- * @see https://github.com/kabell/SMSsystem
- */
-
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <signal.h>
-#include <termios.h>
-
-
-#define SERVER_CAPACITY 1000    /**< Maximum number of users connected to theserver */
-#define BUFFER_SIZE 1000        /**< Maximum size of buffer for everything - messages, usernames, passwords, queries*/
-
-
-/**
- * Struct for storing users in memory
- */
-typedef struct {
-    char * username;
-    char * password;
-} user_t;
-
-char * inPipe = "serverin";             /**< Name of named pipe for comunicating with server */
-
-FILE * in = NULL;                       /**< Named pipe for server input */
-
-char * serverLock = "server.lock";      /**< If exist file with this name, an instance of server is running */
-
-user_t * users_logged[SERVER_CAPACITY]; /**< Array for storing logged users in memory */
-
-/**
- * @brief Read password from stanard input with prompt 
- * @param message - Prompt
- * @param password - String for storing password - memory must be allocated before
- *
- */
-void getpassword(char * message, char * password)
-{
-    printf("%s\n",message);
-    static struct termios oldt, newt;
-    int i = 0;
-    int c;
-
-    //saving the old settings of STDIN_FILENO and copy settings for reseting
-    tcgetattr( STDIN_FILENO, &oldt);
-    newt = oldt;
-
-    //setting the approriate bit in the termios struct
-    newt.c_lflag &= ~(ECHO);
-
-    //setting the new bits
-    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
-
-    //reading the password from the console
-    while ((c = getchar())!= '\n' && c != EOF && i < BUFFER_SIZE){
-        password[i++] = c;
-    }
-    password[i] = '\0';
-
-    /*reseting our old STDIN_FILENO*/
-    tcsetattr( STDIN_FILENO, TCSANOW, &oldt);
-
-}
-
-/**
- *  @brief Send message to client
- *  @param user - Message will be send to this user
- *  @param message - Message
- *
- *  Message is written to named pipe of target client. Name of the named pipe is same as username.
- */
-void message_send(user_t * user, char * message){
-    
-    //message is send to same pipe as username
-    FILE * out = fopen(user->username,"w");
-    fprintf(out,"%s",message);
-    fclose(out);
-}
-
-/**
- * @brief Check if given credentials are correct
- * @param user - struct containing username and password for check
- * @return 1 if credentials are valid 0 otherwise
- *
- * Function opens a file with all users and passwords and then it is trying to find given user in the file with all registered users.
- * If we find a user we check if the password is the same as password given at registration if yes returns 1 else 0.
- */
-int user_auth(user_t * user){
-
-    //file contains all registered logins and passwords
-    FILE * login = fopen("login","r");
-
-    //if file doesn't exist - there are no valid logins and password - credentials are wrong
-    if(!login)
-        return 0;
-
-    //find given username and password in login file
-    char username[BUFFER_SIZE],password[BUFFER_SIZE];
-    while(fgets(username,BUFFER_SIZE,login)!=NULL){
-        fgets(password,BUFFER_SIZE,login);
-        username[strlen(username)-1]='\0';
-        password[strlen(password)-1]='\0';
-        
-        //if we found suitable username and password credentials are OK
-        if(!strcmp(user->username,username) && !strcmp(user->password,password)){
-            fclose(login);
-           return 1;
-        }
-    }
-    fclose(login);
-    //we didn't find given login and password
-    return 0;
-}
-
-
-/**
- * @brief Login user to server
- * @param user - User to be logged
- * @return 1 if login was successful, 0 otherwise (server is full and there is no space for more users)
- *
- * Function finds a first free index in the array of users strucures, when it finds index we put that user to that index. If there is no free index, return 0.
- *
- */
-
-//login user - add user to list of logged in users
-int user_login(user_t * user){
-    
-    //find empty index
-    int pos = 0;
-    while(pos<SERVER_CAPACITY && users_logged[pos]){
-        pos++;
-    }
-
-    //if there is no empty index - server is full
-    if(pos==SERVER_CAPACITY)
-        return 0;
-   
-    //put user to the empty space
-    users_logged[pos] = user;
-
-    //print message in server console
-    printf("user %s logged in.\n",user->username);
-    fflush(NULL);
-
-    //send message to user - login OK
-    message_send(user,"Login OK");    
-    return 1;
-
-}
-
-/**
- * @brief Logout user from server
- * @param name - Username for logout
- *
- * Function finds a user which is given as name in the array of users structures and then it deletes user from that structure and frees all allocated memory.
- * After successful logout, send message to client. Message is "Logged out.".
- *
- */
-void user_logout(char * name){
-
-    //browse all logged users
-    for(int i=0; i<SERVER_CAPACITY; i++){
-
-        //if username is same as username to logout
-        if(users_logged[i] && !strcmp(name,users_logged[i]->username)){
-
-            //send message to client - logged out
-            message_send(users_logged[i],"Logged out.");
-
-            //write message to server console
-            printf("User %s logged out.\n",name);
-
-            //free used memory and delete user from list of logged in users
-            free(users_logged[i]->username);
-            free(users_logged[i]->password);
-            free(users_logged[i]);
-            users_logged[i]=NULL;
-        }
-    }
-}
-
-/**
- * @brief - Send all online users to client
- * @param pipename - Name of named pipe for output
- *
- * Write all online users to given named pipe. Pipe is named by pid of client process - which is unique. Usernames are separated by | (pipe) and added "- " before every username - for better reading at client side.
- *
- */
-void print_online(char * pipename){
-
-    //name of named pipe is given, so open it
-    FILE * pipe = fopen(pipename,"w");
-    
-    //list all logged in users
-    for(int i=0; i<SERVER_CAPACITY; i++){
-        //if this is logged in user, print him to the named pipe
-        if(users_logged[i]){
-            fprintf(pipe,"|- %s",users_logged[i]->username);
-        }
-    }
-    
-    //print newline and close the pipe
-    fprintf(pipe,"\n");
-    fclose(pipe);
-}
-
-/**
- * @brief Request for server is parsed by this function
- * @param message - Request for server
- *
- * 
- * Format of request should be valid otherwise you probably get SEGFAULT
- *
- * There are 4 types of request
- *
- * 1. <b>Request for login</b><br/>
- * Format: <pre>1|username|password</pre>
- * Username and password are stored in memory. After that server is trying to authenticate user via user_auth() and log in user via user_login().<br/>
- * If credentials are invalid, or login was unsuccessful - client recieves a message about it by function message_send().
- *
- * 2. <b>Request for online users</b><br/>
- * Format: <pre>2|pipename</pre>
- * @see print_online
- *
- * 3. <b>Redirect message from client</b><br/>
- * Format: <pre>3|from|to|message</pre>
- * Server sends message using function message_send() to client "to" of format "from" -> message
- *
- * 4. <b>Request for logout user</b><br/>
- * Format: <pre>4|username</pre>
- * Logout user with given username
- * @see user_logout
- *
- */
-
-void server_parse_input(char * message){
-
-    //if query is empty... do nothing
-    if(strlen(message)==0)return;
-    
-    //if query is type 1 - login user
-    if(message[0]=='1'){
-
-        //skip first 2 characters "1|"
-        message+=2;
-        
-        //alocate memory for user
-        user_t * user = malloc(sizeof(user_t));
-        
-        //copy username
-        char * separator = strchr(message,'|');
-        separator[0]='\0';
-        user->username = malloc((strlen(message)+1)*sizeof(char));
-        strcpy(user->username, message);
-
-        //erase copied characters from message
-        message = separator+1;
-
-        //copy password
-        user->password = malloc((strlen(message)+1)*sizeof(char));
-        strcpy(user->password, message);
-
-        //authentificate used
-        if(user_auth(user)){
-            //and log in
-            if(!user_login(user)){
-                message_send(user,"Server is full !!!\n");
-                free(user->username);
-                free(user->password);
-                free(user);
-            }
-        }
-        //wrong credentials
-        else{
-            message_send(user,"Login incorrect\n");
-            free(user->username);
-            free(user->password);
-            free(user);
-        }
-    }
-
-
-    //if query is of type 2 - send online users
-    else if(message[0]=='2'){
-        //print to server console
-        printf("Sending online users\n");
-
-        //skip first 2 characters - 2|
-        message+=2;
-        //call function with given name of named pipe
-        print_online(message);
-    }
-
-    //query is of type 3 - send message
-    //query format is 3|from|to|message
-    else if(message[0]=='3'){
-        
-        //skip first 2 characters - 3|
-        message+=2;
-
-        //copy "from"
-        char * separator = strchr(message,'|');
-         separator[0]='\0';
-        char * from = malloc((strlen(message)+1)*sizeof(char));
-        strcpy(from, message);
-
-        //erase copyied characters
-        message = separator+1;
-
-        //copy "to"
-        separator = strchr(message,'|');
-        separator[0]='\0';
-        char * to = malloc((strlen(message)+1)*sizeof(char));
-        strcpy(to, message);
-        //erase copied characters
-        message = separator+1;
-        
-        //find user "to"
-        user_t * user=NULL;
-        for(int i=0; i<SERVER_CAPACITY; i++){
-            if(users_logged[i] && !strcmp(users_logged[i]->username,to)){
-                user=users_logged[i];
-            }
-        }  
-
-        //if we have found user "to"
-        if(user){
-
-            //compose message
-            char tmp[BUFFER_SIZE];
-            tmp[0]='\0';
-            strcat(tmp,from);
-            strcat(tmp," -> ");
-            strcat(tmp,message);
-            strcat(tmp,"\n");
-            //send message to user "to"
-            message_send(user,tmp);
-
-            //print message to server console
-            printf("User %s sent a message to %s\n",from, to);
-        }
-
-        //free used memory
-        free(from);
-        free(to);
-
-    }
-
-    //query is of type 4 - logout user
-    else if(message[0]=='4'){
-
-        //erase first 2 characters - 4|
-        message+=2;
-        //logout user
-        user_logout(message);
-    }
-
-}
-
-/**
- * @brief Terminate server
- *
- * At first all logged users are logged out (commands to quit clients are included). Then frees all used memory, deletes all used files and terminates server.
- */
-void server_quit(){
-
-    for(int i=0; i<SERVER_CAPACITY; i++){
-        // is here is logged user
-        if(users_logged[i]){
-            //send message to him
-            message_send(users_logged[i],"Server terminated\n");
-            message_send(users_logged[i],"Logged out.");
-            
-            //free used memory for him
-            free(users_logged[i]->username);
-            free(users_logged[i]->password);
-            free(users_logged[i]);
-            users_logged[i]=NULL;
-        }
-    }
-    //wait for deliver all messages
-    sleep(1);
-    //destroy named pipe
-    if(in)
-        fclose(in);
-    unlink(inPipe);
-    remove(serverLock);
-    //exit program
-    exit(0);
-}
-
-
-/**
- *
- * @brief Initialize server
- *
- * Set terminate behaviour - when the server is asked to terminate, run server_quit() - for clean environment.<br/>
- * Create and open named pipe for server requests.<br/>
- * Prepare memory for logged users.
- *
- */
-void server_init(){
-    
-    //add signal for quit when q is pressed in the another process
-    signal(SIGTERM, server_quit);
-
-    //create named pipe for server input
-    mkfifo(inPipe,0666);
-
-    //open named pipe for input
-    in = fopen(inPipe, "r");
-    
-    //prepare memory for logged users
-    for(int i=0; i<SERVER_CAPACITY; i++){
-        users_logged[i] = NULL;
-    }
-}
-
-/**
- *
- * @brief Process all requests in input
- * 
- * Requests for server are written to named pipe "serverin" one per line. So server read input line by line and process using this way all requests.
- * Queries are processed by server_parse_input()
- */
-void server_run(){
-    //processign queries
-    char buffer[BUFFER_SIZE];
-    while(1){
-        if(fgets(buffer,BUFFER_SIZE,in)!=NULL){
-            server_parse_input(buffer);
-        }
-        //prevent for heavy use of CPU - optional
-        usleep(10000);
-    }
-}
-
-/**
- *
- * @brief Main function
- *
- * Server has 2 modes:
- * 1. <b>Registration mode</b><br/>
- * If server is run with exactly 2 arguments. Second argument is considered as username for register. At first server check if the username isn't already registered. If no, server asks for password 3 times using getpassword(). If passwords are equal server writes username and password to login file - each per line. So all odd lines contain usernames and even lines contain passwords - numbering from 1
- * 
- * 2. <b>Normal mode</b><br/>
- * At first server checks if there is no instance of server running. After server creates a file "server.lock" (used to prevent multiple instances of running servers) and server forks - parent process is waiting for commands from commandline, and the child process run server_init() and server_run()
- */
-
-
-
-int main(int argc, char ** argv){
-
-    //if is given parameters for add user
-    if(argc>2){
-
-        //check for username in login file
-        FILE * login_file = fopen("login","r");
-        if(login_file){
-            //find given username in login file
-            char username[BUFFER_SIZE],password[BUFFER_SIZE];
-            while(fgets(username,BUFFER_SIZE,login_file)!=NULL){
-                fgets(password,BUFFER_SIZE,login_file);
-                username[strlen(username)-1]='\0';
-                password[strlen(password)-1]='\0';
-
-                //if we found suitable username and password credentials are OK
-                if(!strcmp(argv[2],username)){
-                    printf("Username already exists !!!!\n");
-                    fclose(login_file);
-                    return 0;
-                }
-            }
-            fclose(login_file);
-        }
-
-        char password[BUFFER_SIZE],password1[BUFFER_SIZE];
-
-        //ask for password
-        getpassword("Password: ",password);
-        //ask for password again
-        getpassword("Retype password: ",password1);
-        
-        //if passwords are same
-        if(!strcmp(password,password1)){
-            //add username and password to login file
-            FILE * f = fopen("login","a");
-            fprintf(f,"%s\n",argv[2]);
-            fprintf(f,"%s\n",password);
-            fclose(f);
-        }
-        //passwords are not same
-        else
-            printf("Passwords are different!!!\n");
-
-        //exiting
-        return 0;
-    }
-
-    //check for running server
-    FILE * f = fopen(serverLock,"r");
-    if(f){
-        printf("Another instance of server is running !!!\n");
-        fclose(f);
-        return 0;
-    }
-
-    //create server.lock
-    f = fopen(serverLock,"w");
-    fclose(f);
-
-
-
-    //print message to server console
-    printf("To quit press q and then enter.\n");
-
-    //create child process for processing queries
-    int mypid = 0;
-    int pid = fork();
-    
-    if(pid > (pid_t)0){
-        //child process
-        mypid = pid;
-        server_init();
-        server_run();
-    }
-    else{
-        //main process
-        while(1){
-            char c;
-            scanf("%c",&c);
-            //if q is pressed terminate child process - processing queries
-            if(c=='q'){
-                printf("Are you sure you want to end the server?\n");
-                printf("Please confirm (y/n): ");
-                scanf("%s",&c);
-                if(c=='y'){
-                    kill(mypid,SIGTERM);
-                    exit(0);
-                }
-            }
-        }
-    }
-    //exit
-    return 0;
-
-}
+/**
+ * @file server.c
+ * @author Michal Korbela, Dvid Horov
+ * @date 13 May 2016
+ * @brief Implementation of server for SMS system
+ * @see https://github.com/kabell/SMSsystem
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <termios.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define SERVER_CAPACITY 1024    /**< Initial number of slots for users connected to the server - table grows when it is full */
+#define RATE_MESSAGES 100       /**< Default number of messages which one user can send per second */
+#define RATE_BYTES 1048576      /**< Default number of bytes of messages which one user can send per second */
+#define RATE_BURST 2            /**< Token bucket holds tokens for this number of seconds - user can send a burst after a pause */
+#define SCHEDULE_QUANTUM 2048   /**< Number of bytes of requests which every sender can get processed in one round of scheduler */
+#define SCHEDULE_QUEUE 65536    /**< Maximum number of bytes of requests waiting for scheduler per sender */
+#define SCHEDULE_BATCH 262144   /**< Number of bytes of requests processed by scheduler before new input is read */
+#define ONLINE_PAGE 100         /**< Maximum number of usernames in one answer to query for online users */
+#define BUFFER_SIZE 1000        /**< Maximum size of buffer for everything - messages, usernames, passwords, queries*/
+#define INPUT_BUFFER_SIZE 131072    /**< Size of buffer for reading requests from named pipe - one read can contain many requests */
+#define REQUEST_FIELDS 8        /**< Maximum number of fields of request */
+#define FRAME_MAGIC 0xFB        /**< First byte of binary frame - text request starts with digit */
+#define FRAME_VERSION 1         /**< Version of binary frame format */
+#define FRAME_HEADER 8          /**< Size of fixed part of frame header */
+#define FRAME_MAX 65536         /**< Maximum size of whole binary frame */
+#define FRAME_MESSAGE 100       /**< Type of frame with message for client - fields are sender, text and number of message with receipt (only for message with receipt) */
+#define FRAME_NOTICE 101        /**< Type of frame with notice from server for client - one field with text */
+#define FRAME_FILE 102          /**< Type of frame with large message - fields are sender and payload, payload is not limited by FRAME_MAX */
+#define TRANSFER_MAX (1 << 30)  /**< Maximum size of large message */
+#define TRANSFER_STEP (1 << 20) /**< Sender of large message is told about progress at most once per this number of bytes */
+#define MAX_EVENTS 64           /**< Maximum number of events returned by one call of epoll_wait() */
+#define MAX_WORKERS 64          /**< Maximum number of delivery threads */
+#define RING_ENTRIES 256        /**< Size of submission queue of io_uring of delivery thread - maximum number of writes in one batch */
+#define RING_IOV 4096           /**< Maximum number of messages in one batch of writes of delivery thread */
+#define INPUT_READ 1            /**< Identifier of read of server input submitted to io_uring */
+#define INPUT_CANCEL 2          /**< Identifier of cancel of read of server input */
+#define AUTH_THREADS 2          /**< Default number of threads checking credentials of logins */
+#define MAX_AUTH 16             /**< Maximum number of threads checking credentials */
+#define AUTH_QUEUE 1024         /**< Maximum number of logins waiting for authentication - more logins are refused */
+#define MAX_NODES 64            /**< Maximum node id in cluster */
+#define LINK_HELLO 110          /**< Link frame - the first frame of link, field is id of sending node */
+#define LINK_ONLINE 111         /**< Link frame - user logged in on sending node, field is username */
+#define LINK_OFFLINE 112        /**< Link frame - user logged out from sending node, field is username */
+#define LINK_MESSAGE 113        /**< Link frame - message for user logged in on receiving node, fields are from, to and text */
+#define LINK_RECEIPTED 114      /**< Link frame - message with receipt for user logged in on receiving node, fields are from, to and text */
+#define LINK_RECEIPT 115        /**< Link frame - receipt for user logged in on receiving node, fields are username and text of receipt */
+#define LINK_BUFFER (16 << 20)  /**< Maximum number of bytes waiting for link to other node - link is closed when it is full */
+#define LINK_RETRY 1            /**< Number of seconds between attempts to connect to other nodes */
+#define PACKET_MAX 65536        /**< Maximum size of packet written to client connected by socket - more messages are written in one packet */
+#define POOL_CLASSES 12        /**< Number of size classes of pooled messages - from 64 bytes to 128 KB, bigger messages are not pooled */
+#define ARENA_CHUNK 65536       /**< Size of chunk of arena */
+#define REQUEST_TYPES 32       /**< Request types are numbers from 1 to REQUEST_TYPES - 1 */
+#define HISTOGRAM_BITS 4        /**< Every power of 2 is split to 2^HISTOGRAM_BITS buckets of histogram */
+#define HISTOGRAM_SIZE ((65 - HISTOGRAM_BITS) << HISTOGRAM_BITS)  /**< Number of buckets of histogram - enough for any 64-bit value */
+#define STATS_INTERVAL 10       /**< Default number of seconds between writes of statistics file */
+#define OFFLINE_HEADER 32       /**< Size of header of record in offline store */
+#define OFFLINE_MESSAGE 1       /**< Record with message for offline user */
+#define OFFLINE_DRAIN 2         /**< Record saying that all older messages of user were delivered */
+#define OFFLINE_DELAYED 3       /**< Record with message delivered later - time of record is time of delivery */
+#define OFFLINE_FIRED 4         /**< Record saying that delayed message with the same sequence number was delivered */
+#define OFFLINE_RECEIPT 5       /**< Record with message with receipt - sender is followed by '#' and number of message in conversation */
+#define OFFLINE_PAIR 6          /**< Record with conversation in file of conversations - text is number of the last sent and the last acknowledged message */
+#define OFFLINE_INDEX_MAGIC 0x5844494F  /**< First 4 bytes of index file of segment ("OIDX") */
+#define OFFLINE_SEGMENT_SIZE (16 << 20) /**< Segment of offline store is sealed when it reaches this size */
+#define OFFLINE_SEGMENT_AGE 86400       /**< Segment of offline store is sealed when it is older than this number of seconds */
+#define OFFLINE_RETENTION 30    /**< Default number of days for which undelivered messages are kept */
+#define HISTORY_SEGMENT_SIZE (64 << 20) /**< Segment of history is sealed before it exceeds this size - whole segment is mapped to memory */
+#define HISTORY_SEGMENT_AGE 86400       /**< Segment of history is sealed when it is older than this number of seconds */
+#define HISTORY_RETENTION 90    /**< Default number of days for which history of messages is kept */
+#define HISTORY_PAGE 100        /**< Maximum number of messages in one answer to query for history */
+#define HISTORY_WORD 32         /**< Words are indexed by at most this number of bytes */
+#define HISTORY_WORDS 8         /**< Maximum number of words in one search */
+#define HISTORY_INDEX_MAGIC 0x58444948  /**< First 4 bytes of index file of history segment ("HIDX") */
+#define WHEEL_LEVELS 4          /**< Number of levels of timer wheel - levels of 256 seconds, 18 hours, 194 days and 136 years cover every 32-bit time */
+#define WHEEL_SLOTS 256         /**< Number of slots in every level of timer wheel */
+#define RECEIPT_WINDOW 1024     /**< Maximum number of unacknowledged messages with receipt from one sender to one recipient - more messages fail */
+#define DELAYED_COMPACT (1 << 20)   /**< Journal of delayed messages is rewritten when it is bigger than this and more than half of it are delivered messages */
+
+
+/**
+ * Descriptor watched by epoll - data.ptr of every epoll event points to this struct
+ */
+typedef struct watch {
+    int fd;                                             /**< Watched descriptor */
+    void (*handler)(struct watch * watch, uint32_t events);  /**< Function called when there are events on descriptor */
+} watch_t;
+
+/**
+ * Reference counted message - one message can wait in queues of many users
+ */
+typedef struct message {
+    int refs;                   /**< Number of references - message is returned to pool when it drops to 0 */
+    int pool;                   /**< Size class of message in pool, -1 for message which is not pooled */
+    struct message * nextFree;  /**< Next free message in pool */
+    struct transfer * transfer; /**< Large message whose payload follows this header, NULL for ordinary message */
+    size_t length;              /**< Length of data */
+    char data[];                /**< Message text */
+} message_t;
+
+/**
+ * Histogram of durations in nanoseconds with logarithmic buckets (like HDR histogram) - relative error of value is at most 1/2^HISTOGRAM_BITS
+ *
+ * Buckets are updated by atomic increments, so more threads can record to one histogram without locks.
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_SIZE];    /**< Number of values in every bucket */
+    uint64_t max;                       /**< The biggest recorded value */
+} histogram_t;
+
+/**
+ * Ring of io_uring - submission and completion queues shared with kernel, it is used by raw system calls without liburing
+ *
+ * Ring is used only by one thread. Entries are prepared by ring_sqe() and all of them are submitted together by ring_submit().
+ */
+typedef struct {
+    int fd;                         /**< Descriptor of io_uring, -1 if io_uring is not used */
+    unsigned * sqHead;              /**< Head of submission queue - moved by kernel */
+    unsigned * sqTail;              /**< Tail of submission queue - moved by ring_submit() */
+    unsigned * sqArray;             /**< Indexes of submitted entries */
+    unsigned sqMask;                /**< Mask of position in submission queue */
+    unsigned tail;                  /**< Tail of submission queue including prepared entries */
+    unsigned entries;               /**< Size of submission queue */
+    struct io_uring_sqe * sqes;     /**< Submission queue entries */
+    unsigned * cqHead;              /**< Head of completion queue - moved by ring_seen() */
+    unsigned * cqTail;              /**< Tail of completion queue - moved by kernel */
+    unsigned cqMask;                /**< Mask of position in completion queue */
+    struct io_uring_cqe * cqes;     /**< Completion queue entries */
+    void * queues;                  /**< Mapping of both queues */
+    size_t queuesSize;              /**< Size of mapping of queues */
+} ring_t;
+
+struct worker;
+
+/**
+ * Output channel to client - persistent write end of client's named pipe with queue of messages waiting for delivery
+ *
+ * Outbox is created by the server thread, but all its fields except worker are used only by its delivery thread.
+ */
+typedef struct outbox {
+    watch_t watch;              /**< Non-blocking write end of named pipe */
+    struct worker * worker;     /**< Delivery thread which writes to this outbox - chosen by hash of username */
+    int packet;                 /**< Outbox is a socket - one write is one packet, so it is limited to PACKET_MAX bytes */
+    message_t ** pending;       /**< Messages waiting for delivery */
+    uint64_t * queued;          /**< Times when pending messages were queued by server thread */
+    int count;                  /**< Number of messages in pending */
+    int capacity;               /**< Allocated size of pending */
+    size_t offset;              /**< Number of already written bytes of first pending message */
+    int writing;                /**< Number of messages in write submitted to io_uring, 0 if no write is in progress */
+    uint32_t events;            /**< Events watched by epoll of delivery thread */
+    int unwatched;              /**< Descriptor is removed from epoll because client closed its end of pipe */
+    int closing;                /**< Outbox is closed and freed when all pending messages are written */
+    int keep;                   /**< Descriptor is not closed with outbox - it is handed over to restarted server */
+    int splicing;               /**< Header of large message (the first pending message) is written, its payload is being moved */
+    int dirty;                  /**< Outbox is in the list of outboxes for flush */
+    struct outbox * nextDirty;  /**< Next outbox in the list of outboxes for flush */
+} outbox_t;
+
+/**
+ * Type of delivery command
+ */
+enum {
+    DELIVERY_OPEN,      /**< Start watching new outbox */
+    DELIVERY_MESSAGE,   /**< Queue message to outbox */
+    DELIVERY_CLOSE,     /**< Close outbox after all its messages are written */
+    DELIVERY_STOP,      /**< Deliver everything and stop thread */
+    DELIVERY_PROGRESS,  /**< Report of delivery thread - part of large message was written to recipient */
+    DELIVERY_FINISHED   /**< Report of delivery thread - large message was written to recipient or it failed */
+};
+
+/**
+ * Command for delivery thread - node of lock-free queue
+ */
+typedef struct delivery {
+    struct delivery * next;     /**< Next node in queue */
+    int type;                   /**< DELIVERY_OPEN, DELIVERY_MESSAGE, DELIVERY_CLOSE or DELIVERY_STOP, reports for server thread are DELIVERY_PROGRESS or DELIVERY_FINISHED */
+    outbox_t * outbox;          /**< Target outbox */
+    struct transfer * transfer; /**< Large message of report */
+    message_t * message;        /**< Message for DELIVERY_MESSAGE - delivery holds one reference */
+    uint64_t time;              /**< Time when message was queued */
+} delivery_t;
+
+/**
+ * Lock-free queue with many producers and one consumer (intrusive Vyukov queue)
+ */
+typedef struct {
+    delivery_t * head;          /**< Next node for consumer */
+    delivery_t * tail;          /**< Last pushed node - producers swap it atomically */
+    delivery_t stub;            /**< Node which is in queue when queue is empty */
+} mpsc_t;
+
+/**
+ * Delivery thread - it owns outboxes of users whose username hashes to it, so messages for one user are always written in order
+ */
+typedef struct worker {
+    pthread_t thread;           /**< Thread */
+    int epollFd;                /**< Epoll for outboxes of this thread */
+    watch_t wakeWatch;          /**< Eventfd - server thread writes to it after it pushes commands */
+    ring_t ring;                /**< io_uring for writes to outboxes, ring.fd is -1 when outboxes are written by writev() */
+    watch_t ringWatch;          /**< Descriptor of io_uring - it is readable when writes which waited in kernel are completed */
+    struct iovec * iov;         /**< Messages of writes submitted in one batch */
+    mpsc_t queue;               /**< Commands from server thread */
+    long depth;                 /**< Number of commands in queue */
+    long pending;               /**< Number of messages in outboxes of thread - read by server thread for statistics */
+    int wake;                   /**< Server thread pushed commands and it has not woken thread yet - used only by server thread */
+    outbox_t * dirty;           /**< Outboxes with new messages, they are flushed after queue is processed */
+    outbox_t * freed;           /**< Closed outboxes, they are freed after all events returned by epoll_wait() are handled */
+    struct transfer * finished; /**< Finished large messages, they are released after all events returned by epoll_wait() are handled */
+    int outboxes;               /**< Number of outboxes owned by thread */
+    int stopping;               /**< Thread received DELIVERY_STOP */
+} worker_t;
+
+/**
+ * State of large message
+ */
+enum {
+    TRANSFER_ACTIVE,    /**< Payload is being moved */
+    TRANSFER_DONE,      /**< Whole payload was written to recipient */
+    TRANSFER_FAILED     /**< Recipient is gone or sender closed upload pipe too early */
+};
+
+/**
+ * Large message - payload is moved from upload pipe of sender to recipient by splice(), it never passes through memory of server
+ *
+ * Transfer is created by server thread and moved by delivery thread of recipient, both of them hold a reference.
+ */
+typedef struct transfer {
+    int refs;                   /**< Number of references - transfer is freed when it drops to 0 */
+    watch_t watch;              /**< Read end of upload pipe, -1 when it is closed */
+    struct worker * worker;     /**< Delivery thread of recipient */
+    outbox_t * outbox;          /**< Outbox of recipient - valid while upload pipe is open */
+    int watching;               /**< Upload pipe is in epoll of delivery thread */
+    int state;                  /**< TRANSFER_ACTIVE, TRANSFER_DONE or TRANSFER_FAILED - set by delivery thread */
+    int padded;                 /**< Sender closed upload pipe too early, rest of payload was filled by zeros */
+    uint64_t size;              /**< Size of payload */
+    uint64_t moved;             /**< Number of bytes of payload written to recipient */
+    uint64_t reported;          /**< Value of moved in the last report */
+    struct transfer * next;     /**< Next transfer in the list of finished transfers of delivery thread */
+    char from[NAME_MAX + 1];    /**< Sender */
+    char to[NAME_MAX + 1];      /**< Recipient */
+} transfer_t;
+
+/**
+ * Token bucket - tokens are added at constant rate up to the size of bucket, every request takes some of them
+ */
+typedef struct {
+    double tokens;              /**< Available tokens */
+    uint64_t time;              /**< Time of the last refill in nanoseconds */
+} bucket_t;
+
+struct group;
+struct user;
+
+/**
+ * Chunk of arena
+ */
+typedef struct arena_chunk {
+    struct arena_chunk * next;  /**< Previous chunk */
+    size_t used;                /**< Number of used bytes of data */
+    size_t size;                /**< Size of data */
+    char data[];                /**< Allocated memory */
+} arena_chunk_t;
+
+/**
+ * Arena - many small allocations in big chunks, all of them are freed at once
+ */
+typedef struct {
+    arena_chunk_t * chunks;     /**< The newest chunk, new allocations are taken from it */
+} arena_t;
+
+/**
+ * Client connected by unix domain socket - one packet is one or more requests, answers and messages are sent back by the same socket
+ */
+typedef struct connection {
+    watch_t watch;              /**< Socket of client */
+    struct user * user;         /**< User logged in by this connection or NULL */
+    struct login * login;       /**< Login of this connection which is being authenticated or NULL */
+    struct connection * prev;   /**< Previous connection in list of all connections */
+    struct connection * next;   /**< Next connection in list of all connections */
+} connection_t;
+
+/**
+ * Login which is being authenticated by authentication thread
+ *
+ * Name and password are read by authentication thread, result is written by it. Other fields belong to server thread.
+ */
+typedef struct login {
+    struct login * next;        /**< Next login in queue of finished logins */
+    connection_t * connection;  /**< Connection which sent login, NULL for named pipe or closed connection */
+    int binary;                 /**< Login was received as binary frame */
+    int cancelled;              /**< Connection was closed before authentication finished */
+    int valid;                  /**< Credentials are valid - result of authentication */
+    uint64_t start;             /**< Time of login request in nanoseconds */
+    size_t nameLength;          /**< Length of username */
+    size_t passwordLength;      /**< Length of password */
+    char name[NAME_MAX + 1];    /**< Username terminated by zero */
+    char password[];            /**< Password, it is not terminated by zero */
+} login_t;
+
+/**
+ * Parsed request - fields point to the input buffer, they are valid only while request is processed
+ *
+ * Fields of text request are terminated by zero, fields of binary request are not - use length.
+ */
+typedef struct {
+    int type;                           /**< Type of request */
+    int binary;                         /**< Request was received as binary frame */
+    int failures;                       /**< Number of failures while request is processed (unknown recipient, wrong password,...) */
+    connection_t * connection;          /**< Connection which sent request, NULL for requests from named pipe */
+    int count;                          /**< Number of fields */
+    char * field[REQUEST_FIELDS];       /**< Fields of request */
+    size_t length[REQUEST_FIELDS];      /**< Lengths of fields */
+} request_t;
+
+/**
+ * Message from user which is delivered to one or more users - it is formatted only once for text clients and once for binary clients
+ */
+typedef struct {
+    const char * from;          /**< Sender */
+    size_t fromLength;          /**< Length of sender */
+    const char * text;          /**< Text of message */
+    size_t textLength;          /**< Length of text */
+    uint64_t seq;               /**< Number of message with receipt in conversation of sender with recipient, 0 for message without receipt */
+    message_t * formatted[2];   /**< Message for text and binary clients, composed when it is needed for the first time */
+} letter_t;
+
+/**
+ * Statistics of one request type
+ */
+typedef struct {
+    const char * name;          /**< Name of request type */
+    uint64_t requests;          /**< Number of handled requests */
+    uint64_t bytes;             /**< Size of fields of handled requests */
+    uint64_t failures;          /**< Number of failures - see request_t */
+    histogram_t latency;        /**< Time of processing of request */
+} request_stats_t;
+
+/**
+ * Growable buffer of bytes
+ */
+typedef struct {
+    char * data;        /**< Data */
+    size_t length;      /**< Number of used bytes */
+    size_t capacity;    /**< Allocated size */
+} bytes_t;
+
+/**
+ * Other node of cluster - messages for it are sent by outgoing link, which is connected by this node
+ */
+typedef struct {
+    watch_t watch;              /**< Socket of outgoing link, -1 if it is not connected */
+    int id;                     /**< Node id, 0 for unused entry */
+    int connected;              /**< Connect finished, frames can be queued */
+    struct sockaddr_storage address;    /**< Address of node */
+    socklen_t addressLength;    /**< Length of address */
+    bytes_t out;                /**< Frames waiting for write - all frames of one iteration of server loop are written together */
+    size_t outStart;            /**< Number of bytes of out which are already written */
+    struct link * link;         /**< Incoming link from this node or NULL */
+    struct remote * remotes;    /**< Users logged in on this node */
+} peer_t;
+
+/**
+ * Incoming link from other node - node tells about its users and sends messages for users of this node
+ */
+typedef struct link {
+    watch_t watch;              /**< Socket of link */
+    int node;                   /**< Id of node, 0 until LINK_HELLO is received */
+    bytes_t in;                 /**< Received data which do not contain complete frame yet */
+} link_t;
+
+/**
+ * User logged in on other node of cluster - entry of routing directory
+ */
+typedef struct remote {
+    int node;                   /**< Id of node */
+    struct remote * prev;       /**< Previous user of the same node */
+    struct remote * next;       /**< Next user of the same node */
+    char name[];                /**< Username */
+} remote_t;
+
+/**
+ * Segment of offline store - file with records appended one after another
+ */
+typedef struct {
+    uint32_t id;        /**< Number of segment, it is also name of its files */
+    int fd;             /**< Opened log file */
+    uint32_t size;      /**< Number of bytes written and synced to log file */
+    uint32_t records;   /**< Number of messages in segment */
+    uint32_t live;      /**< Number of messages which were not delivered yet */
+    uint32_t liveBytes; /**< Size of messages which were not delivered yet */
+    time_t opened;      /**< Time when segment was created */
+    time_t newest;      /**< Time of the newest message in segment */
+} segment_t;
+
+/**
+ * Position of undelivered message in offline store
+ */
+typedef struct {
+    uint64_t seq;       /**< Sequence number of message - messages are delivered in this order */
+    uint32_t segment;   /**< Id of segment */
+    uint32_t offset;    /**< Offset of record in segment */
+    uint32_t size;      /**< Size of record */
+} stored_t;
+
+/**
+ * Segment of history - file with records in format of offline store, mapped to memory for reading
+ */
+typedef struct {
+    uint32_t id;                /**< Number of segment, it is also name of its file */
+    int fd;                     /**< Opened log file */
+    uint32_t size;              /**< Number of bytes written to log file */
+    uint32_t first;             /**< Number of the first message in segment */
+    const unsigned char * map;  /**< Log file mapped to memory - HISTORY_SEGMENT_SIZE bytes, only written part can be read */
+    time_t opened;              /**< Time when segment was created */
+    time_t newest;              /**< Time of the newest message in segment */
+} volume_t;
+
+/**
+ * Messages of history ordered by number - messages of one conversation or messages containing one word
+ */
+typedef struct {
+    uint32_t * numbers; /**< Numbers of messages */
+    uint32_t count;     /**< Number of messages */
+    uint32_t capacity;  /**< Allocated size of numbers */
+    char key[];         /**< "user1/user2" (names in order) or "#group" for conversation, "owner/word" for word - owner is user or "#group" */
+} postings_t;
+
+/**
+ * Message waiting in timer wheel for time of its delivery
+ */
+typedef struct delayed {
+    struct delayed * next;  /**< Next message in the same slot of timer wheel */
+    uint64_t id;            /**< Number of message - sequence number of its record in journal */
+    uint32_t due;           /**< Unix time of delivery */
+    uint32_t fromLength;    /**< Length of sender */
+    uint32_t toLength;      /**< Length of recipient */
+    uint32_t textLength;    /**< Length of text */
+    char data[];            /**< Sender, recipient and text without separators */
+} delayed_t;
+
+/**
+ * Message with receipt which was sent to logged recipient and was not acknowledged yet
+ */
+typedef struct unacked {
+    struct unacked * next;  /**< Next message of the same conversation */
+    uint64_t seq;           /**< Number of message in conversation */
+    size_t length;          /**< Length of text */
+    char text[];            /**< Text of message */
+} unacked_t;
+
+/**
+ * Conversation of one sender with one recipient - numbers of its messages with receipt
+ */
+typedef struct pair {
+    struct pair * next;     /**< Next conversation in the list of logged recipient */
+    int listed;             /**< Conversation is in the list of logged recipient - it had unacknowledged messages */
+    uint64_t sent;          /**< Number of the last message - numbers of messages start by 1 */
+    uint64_t acked;         /**< Recipient acknowledged all messages up to this number */
+    unacked_t * head;       /**< The oldest unacknowledged message sent to logged recipient - they are stored for him when he logs out */
+    unacked_t * tail;       /**< The newest unacknowledged message sent to logged recipient */
+    int count;              /**< Number of unacknowledged messages in list - at most RECEIPT_WINDOW */
+    size_t toLength;        /**< Length of recipient at the beginning of key */
+    char key[];             /**< "to/from" */
+} pair_t;
+
+/**
+ * Undelivered messages of one user
+ */
+typedef struct {
+    char * username;    /**< Recipient */
+    stored_t * stored;  /**< Messages ordered by sequence number */
+    int count;          /**< Number of messages */
+    int capacity;       /**< Allocated size of stored */
+    uint64_t drained;   /**< Messages with lower sequence number were delivered - used only while store is loaded */
+} backlog_t;
+
+/**
+ * Struct for storing users in memory
+ */
+typedef struct user {
+    char * username;
+    char * password;            /**< Password of registered user, NULL for logged user */
+    outbox_t * outbox;          /**< Output channel to user, opened at login */
+    connection_t * connection;  /**< Connection of user if he is connected by socket, NULL if he uses named pipe */
+    int slot;                   /**< Index of user in users_logged */
+    int binary;                 /**< User logged in by binary frame, messages are sent to him as frames too */
+    struct group ** groups;     /**< Groups which user joined */
+    int groupCount;             /**< Number of groups in groups */
+    int groupCapacity;          /**< Allocated size of groups */
+    int watcher;                /**< Index of user in presenceWatchers, -1 if user is not subscribed to presence */
+    struct pair * pairs;        /**< Conversations in which user got messages with receipt and did not acknowledge all of them */
+    bucket_t messageBucket;     /**< Limit of number of sent messages */
+    bucket_t byteBucket;        /**< Limit of bytes of sent messages */
+    bytes_t queue;              /**< Requests of user waiting for scheduler - records scheduled_t followed by fields */
+    size_t queueStart;          /**< Offset of the first waiting request in queue */
+    size_t deficit;             /**< Number of bytes of requests which can be processed in this round of scheduler */
+    int scheduled;              /**< User is in the list of senders with waiting requests */
+    int throttled;              /**< User was told that his requests are refused, he is told again after some request is accepted */
+    struct user * prevScheduled; /**< Previous sender in the list of senders with waiting requests */
+    struct user * nextScheduled; /**< Next sender in the list of senders with waiting requests */
+} user_t;
+
+/**
+ * Request waiting for scheduler - fields follow the record, every field is terminated by zero
+ */
+typedef struct {
+    size_t size;                        /**< Size of record with fields, aligned to 8 bytes */
+    int type;                           /**< Type of request */
+    int binary;                         /**< Request was received as binary frame */
+    int count;                          /**< Number of fields */
+    connection_t * connection;          /**< Connection which sent request, NULL for requests from named pipe */
+    size_t length[REQUEST_FIELDS];      /**< Lengths of fields */
+} scheduled_t;
+
+/**
+ * Group of users - message posted to group is delivered to all members
+ */
+typedef struct group {
+    char * name;        /**< Name of group */
+    int * members;      /**< Slots of members in users_logged */
+    int count;          /**< Number of members */
+    int capacity;       /**< Allocated size of members */
+} group_t;
+
+/**
+ * Entry of hash map
+ */
+typedef struct {
+    const char * key;   /**< Key - map does not own it, it is usually stored in value; NULL for empty entry */
+    uint64_t hash;      /**< Hash of key */
+    void * value;       /**< Value */
+} strmap_entry_t;
+
+/**
+ * Hash map with string keys - open addressing with linear probing, it grows when it is half full
+ */
+typedef struct {
+    strmap_entry_t * entries;   /**< Table of entries, size is power of 2 */
+    size_t capacity;            /**< Size of table */
+    size_t count;               /**< Number of stored keys */
+} strmap_t;
+
+char * inPipe = "serverin";             /**< Name of named pipe for comunicating with server */
+
+int in = -1;                            /**< Named pipe for server input - non-blocking mode, but blocking when it is read by io_uring */
+
+int inKeepalive = -1;                   /**< Write end of server input kept open by server, so the pipe never reports end of file when clients close it */
+
+int epollFd = -1;                       /**< Epoll instance for waiting on server input, signals and client pipes */
+
+watch_t inWatch;                        /**< Watch for server input */
+
+ring_t inRing = {.fd = -1};             /**< io_uring reading server input to registered inBuffer, inRing.fd is -1 when input is read after epoll event */
+
+watch_t inRingWatch;                    /**< Descriptor of inRing - it is readable when read of server input is completed */
+
+int inReading = 0;                      /**< Read of server input is submitted to inRing and not completed yet */
+
+int uringOption = 1;                    /**< Server input and client pipes are used by io_uring if it is available, option -e uses only epoll */
+
+watch_t signalWatch;                    /**< Signals for terminating server are received through this descriptor */
+
+worker_t workers[MAX_WORKERS];          /**< Delivery threads */
+
+int workerCount = 0;                    /**< Number of running delivery threads */
+
+int workerOption = 0;                   /**< Number of delivery threads given by option -w, 0 means number of processors */
+
+char inBuffer[INPUT_BUFFER_SIZE];       /**< Data read from server input, which were not processed yet */
+
+size_t inLength = 0;                    /**< Number of bytes in inBuffer */
+
+int inDiscard = 0;                      /**< If set, request is longer than buffer and it is skipped till the end of line */
+
+char * serverLock = "server.lock";      /**< If exist file with this name, an instance of server is running */
+
+char * serverSocket = "server.sock";    /**< Name of unix domain socket for clients which do not use named pipes */
+
+watch_t listenWatch;                    /**< Listening socket */
+
+connection_t * connections = NULL;      /**< All connections of clients - they are handed over to restarted server */
+
+char packetBuffer[PACKET_MAX + 1];      /**< Buffer for packet received from connection */
+
+user_t ** users_logged = NULL;          /**< Array for storing logged users in memory - slots of logged out users are reused */
+
+int usersCapacity = 0;                  /**< Size of users_logged */
+
+int usersUsed = 0;                      /**< Number of slots in users_logged which were ever used - all higher slots are empty */
+
+int * freeSlots = NULL;                 /**< Stack of empty slots below usersUsed */
+
+int freeCount = 0;                      /**< Number of slots in freeSlots */
+
+strmap_t sessions;                      /**< Logged users indexed by username */
+
+char ** onlineIndex = NULL;             /**< Usernames of logged users in sorted order - names are owned by users */
+
+size_t onlineCount = 0;                 /**< Number of usernames in onlineIndex */
+
+size_t onlineCapacity = 0;              /**< Allocated size of onlineIndex */
+
+user_t ** presenceWatchers = NULL;      /**< Users subscribed to changes of presence */
+
+int watcherCount = 0;                   /**< Number of users in presenceWatchers */
+
+int watcherCapacity = 0;                /**< Allocated size of presenceWatchers */
+
+strmap_t groups;                        /**< Groups indexed by name */
+
+char * loginFile = "login";             /**< File with registered usernames and passwords */
+
+strmap_t credentials;                   /**< Registered users from login file indexed by username */
+
+arena_t credentialsArena;               /**< Memory for registered users and their names and passwords */
+
+message_t * messagePool[POOL_CLASSES];  /**< Free messages returned by any thread - lock-free stacks, server thread takes whole stack at once */
+
+message_t * messageCache[POOL_CLASSES]; /**< Free messages taken by server thread from messagePool */
+
+delivery_t * deliveryPool = NULL;       /**< Free delivery commands returned by delivery threads - lock-free stack */
+
+delivery_t * deliveryCache = NULL;      /**< Free delivery commands taken by server thread from deliveryPool */
+
+mpsc_t reports;                         /**< Reports of delivery threads about large messages for server thread */
+
+watch_t reportWatch;                    /**< Eventfd - delivery threads write to it after they push report */
+
+strmap_t uploads;                       /**< Large messages which are being sent indexed by sender - one at a time for every sender */
+
+uint64_t transferBytes = 0;             /**< Number of bytes of large messages written to recipients - updated by delivery threads */
+
+uint64_t ringWrites = 0;                /**< Number of writes to outboxes submitted to io_uring - updated by delivery threads */
+
+uint64_t ringCalls = 0;                 /**< Number of system calls which submitted writes to io_uring - updated by delivery threads */
+
+off_t credentialsOffset = 0;            /**< Number of bytes of login file which are already in credentials */
+
+ino_t credentialsInode = 0;             /**< Inode of login file which is loaded in credentials */
+
+watch_t credentialsWatch;               /**< Inotify watch for changes of login file */
+
+pthread_rwlock_t credentialsLock = PTHREAD_RWLOCK_INITIALIZER;  /**< Credentials are read by authentication threads, loading them needs write lock */
+
+int credentialsStale = 0;               /**< Login file was changed - credentials are loaded again by the next authentication */
+
+pthread_t authThreads[MAX_AUTH];        /**< Threads checking credentials */
+
+int authCount = 0;                      /**< Number of authentication threads, 0 means logins are authenticated by server thread */
+
+int authOption = AUTH_THREADS;          /**< Number of authentication threads given by option -a */
+
+pthread_mutex_t authLock = PTHREAD_MUTEX_INITIALIZER;  /**< Lock of queues of logins */
+
+pthread_cond_t authCond = PTHREAD_COND_INITIALIZER;    /**< Authentication threads wait for logins on it */
+
+login_t * authQueue[AUTH_QUEUE];        /**< Logins waiting for authentication - ring buffer */
+
+int authHead = 0;                       /**< Position of the first waiting login in authQueue */
+
+int authWaiting = 0;                    /**< Number of logins in authQueue */
+
+int authStopping = 0;                   /**< Authentication threads should finish */
+
+login_t * authDone = NULL;              /**< Authenticated logins for server thread - the oldest first */
+
+login_t * authDoneTail = NULL;          /**< The newest authenticated login */
+
+watch_t authWatch;                      /**< Eventfd - authentication threads write to it after they finish login */
+
+int nodeId = 0;                         /**< Id of this node in cluster given by option -n, 0 if server is not in cluster */
+
+char * clusterFile = NULL;              /**< File with nodes of cluster given by option -c - lines "id host port" */
+
+peer_t peers[MAX_NODES + 1];            /**< Other nodes of cluster indexed by id */
+
+strmap_t directory;                     /**< Users logged in on other nodes indexed by username - values are remote_t */
+
+watch_t clusterWatch;                   /**< Listening TCP socket for links from other nodes */
+
+watch_t clusterTimer;                   /**< Timer for connecting links to other nodes */
+
+uint64_t linkForwarded = 0;             /**< Number of messages forwarded to other nodes */
+
+uint64_t linkReceived = 0;              /**< Number of messages received from other nodes */
+
+char ** serverArgv = NULL;              /**< Arguments of server - restarted server is executed with the same arguments */
+
+int handoffFd = -1;                     /**< Socket with state of previous server process after restart, -1 for normal start */
+
+pid_t handoffPid = 0;                   /**< Process which sends state of previous server, it is waited for when it exits */
+
+int restartPending = 0;                 /**< Restart was requested, it waits until all large messages are finished */
+
+char * offlineDir = "offline";          /**< Directory with segments of offline store */
+
+segment_t * segments = NULL;            /**< Segments of offline store ordered by id - the last one is active, others are sealed */
+
+int segmentCount = 0;                   /**< Number of segments */
+
+uint64_t offlineSeq = 0;                /**< Sequence number of the last record in offline store */
+
+bytes_t offlinePending;                 /**< Records appended in this iteration of server loop - they are written and synced together by offline_commit() */
+
+bytes_t offlineIndex;                   /**< Index of active segment, it is written to index file when segment is sealed */
+
+bytes_t offlineRead;                    /**< Buffer for records read from segments */
+
+strmap_t backlogs;                      /**< Undelivered messages indexed by username of recipient */
+
+int offlineRetention = OFFLINE_RETENTION;  /**< Number of days for which undelivered messages are kept, set by option -r */
+
+char * historyDir = "history";          /**< Directory with segments of history */
+
+volume_t * volumes = NULL;              /**< Segments of history ordered by id - the last one is active, others are sealed */
+
+int volumeCount = 0;                    /**< Number of segments of history */
+
+uint32_t historyBase = 0;               /**< Number of the oldest message in history - older messages were deleted with their segments */
+
+uint32_t historyCount = 0;              /**< Number which gets the next message - numbers are given in order of messages and never reused */
+
+uint64_t * historyPositions = NULL;     /**< Positions of messages (id of segment << 32 | offset) indexed by number - historyBase */
+
+size_t historyCapacity = 0;             /**< Allocated size of historyPositions */
+
+bytes_t historyPending;                 /**< Records appended in this iteration of server loop - they are indexed and written together by history_commit() */
+
+uint32_t historyQueued = 0;             /**< Count of records in historyPending */
+
+strmap_t conversations;                 /**< Messages of conversations indexed by key - values are postings_t */
+
+strmap_t historyWords;                  /**< Messages containing word indexed by owner and word - values are postings_t */
+
+int historyRetention = HISTORY_RETENTION;  /**< Number of days for which history is kept, set by option -k - 0 turns history off */
+
+char * delayedFile = "delayed.log";     /**< Journal of delayed messages */
+
+char * delayedTemp = "delayed.tmp";     /**< New journal written by delayed_compact() */
+
+int delayedFd = -1;                     /**< Opened journal of delayed messages */
+
+size_t delayedSize = 0;                 /**< Number of bytes written to journal */
+
+size_t delayedLive = 0;                 /**< Number of bytes of records of messages which were not delivered yet */
+
+bytes_t delayedPending;                 /**< Records appended in this iteration of server loop - they are written and synced together by delayed_commit() */
+
+delayed_t * wheel[WHEEL_LEVELS][WHEEL_SLOTS];   /**< Hierarchical timer wheel - message is in the level of the highest byte in which its time differs from wheelTime */
+
+uint32_t wheelTime = 0;                 /**< Time of timer wheel - messages due at this time or earlier are in delayedDue */
+
+delayed_t * delayedDue = NULL;          /**< Messages due at wheelTime or earlier - they are delivered by delayed_fire() */
+
+size_t delayedCount = 0;                /**< Number of messages in timer wheel and in delayedDue */
+
+uint64_t delayedSeq = 0;                /**< Number of the last delayed message */
+
+uint64_t delayedFired = 0;              /**< Number of delivered delayed messages */
+
+watch_t delayedWatch;                   /**< Timer of timer wheel - it expires at every whole second while there are delayed messages */
+
+int delayedArmed = 0;                   /**< Timer of timer wheel is running */
+
+char * receiptsFile = "receipts";      /**< Conversations of messages with receipt written when server quits or restarts */
+
+char * receiptsTemp = "receipts.tmp";   /**< New file of conversations written by receipt_save() */
+
+strmap_t receipts;                      /**< Conversations with messages with receipt indexed by "to/from" - values are pair_t */
+
+uint64_t receiptsUnacked = 0;           /**< Number of messages with receipt sent to logged recipients and not acknowledged */
+
+uint64_t receiptsDelivered = 0;         /**< Number of messages with receipt acknowledged by recipients */
+
+uint64_t receiptsFailed = 0;            /**< Number of messages with receipt which could not be sent */
+
+uint64_t receiptsStored = 0;            /**< Number of unacknowledged messages stored for recipients who logged out - they are sent again at login */
+
+uint64_t receiptsDuplicates = 0;        /**< Number of acknowledgements and stored messages which were already acknowledged */
+
+request_stats_t requestStats[REQUEST_TYPES] = {     /**< Statistics of requests indexed by type */
+    [1] = {"login"}, [2] = {"online"}, [3] = {"message"}, [4] = {"logout"}, [5] = {"multicast"},
+    [6] = {"group_create"}, [7] = {"group_join"}, [8] = {"group_leave"}, [9] = {"group_post"}, [10] = {"stats"},
+    [11] = {"presence"}, [12] = {"subscribe"}, [13] = {"upload"}, [14] = {"history"}, [15] = {"search"}, [16] = {"delayed"},
+    [17] = {"receipted"}, [18] = {"ack"},
+};
+
+histogram_t deliveryLatency;            /**< Time from queueing message to its write to client - recorded by delivery threads */
+
+histogram_t loginLatency;               /**< Time from login request to its answer, including wait for authentication thread */
+
+uint64_t deliveryDropped = 0;           /**< Number of messages dropped because client did not read them - updated by delivery threads */
+
+uint64_t invalidRequests = 0;           /**< Number of requests with unknown type or wrong fields */
+
+uint64_t authFailures = 0;              /**< Number of logins with wrong password */
+
+uint64_t permissionDenied = 0;          /**< Number of requests sent by connection in the name of another user */
+
+uint64_t throttledRequests = 0;         /**< Number of requests refused because sender exceeded its rate or its queue is full */
+
+double rateMessages = RATE_MESSAGES;    /**< Number of messages per second which one user can send, 0 means no limit, set by option -m */
+
+double rateBytes = RATE_BYTES;          /**< Number of bytes of messages per second which one user can send, 0 means no limit, set by option -b */
+
+struct user * scheduleHead = NULL;      /**< The first sender with waiting requests - the next one in current round of scheduler */
+
+struct user * scheduleTail = NULL;      /**< The last sender with waiting requests */
+
+struct user * scheduledUser = NULL;     /**< Sender whose request is being processed by scheduler, it is cleared when the sender is removed */
+
+size_t scheduledSenders = 0;            /**< Number of senders with waiting requests */
+
+size_t scheduledBytes = 0;              /**< Number of bytes of requests waiting for scheduler */
+
+bytes_t scheduleScratch = {NULL, 0, 0}; /**< Copy of request processed by scheduler - queue of sender can be freed by its request */
+
+int consoleLog = 1;                     /**< Events of single requests are printed to console, option -q disables it */
+
+char * statsFile = "server.stats";      /**< File with statistics, it is rewritten periodically */
+
+int statsInterval = STATS_INTERVAL;     /**< Number of seconds between writes of statistics file, 0 disables it, set by option -i */
+
+watch_t statsWatch;                     /**< Timer for writing statistics file */
+
+time_t serverStart = 0;                 /**< Time when server started */
+
+/**
+ * @brief Read password from stanard input with prompt 
+ * @param message - Prompt
+ * @param password - String for storing password - memory must be allocated before
+ *
+ */
+void getpassword(char * message, char * password)
+{
+    printf("%s\n",message);
+    static struct termios oldt, newt;
+    int i = 0;
+    int c;
+
+    //saving the old settings of STDIN_FILENO and copy settings for reseting
+    tcgetattr( STDIN_FILENO, &oldt);
+    newt = oldt;
+
+    //setting the approriate bit in the termios struct
+    newt.c_lflag &= ~(ECHO);
+
+    //setting the new bits
+    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
+
+    //reading the password from the console
+    while ((c = getchar())!= '\n' && c != EOF && i < BUFFER_SIZE){
+        password[i++] = c;
+    }
+    password[i] = '\0';
+
+    /*reseting our old STDIN_FILENO*/
+    tcsetattr( STDIN_FILENO, TCSANOW, &oldt);
+
+}
+
+/**
+ * @brief Print event to server console
+ * @param format - Format of text, like printf()
+ *
+ * Events of single requests are printed only if console logging is enabled - printing every event is slow under load,
+ * with option -q server prints only errors and the state is watched by statistics (see stats_format()).
+ */
+void console(const char * format, ...){
+    if(!consoleLog)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Get current time
+ * @return Monotonic time in nanoseconds
+ */
+uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Record value to histogram
+ * @param histogram - Histogram
+ * @param value - Value
+ *
+ * Small values have their own buckets, bigger values are put to bucket by their highest bit and next HISTOGRAM_BITS bits.
+ */
+void histogram_record(histogram_t * histogram, uint64_t value){
+    int bucket = value;
+    if(value >= (1 << HISTOGRAM_BITS)){
+        int exponent = 63 - __builtin_clzll(value);
+        bucket = ((exponent - HISTOGRAM_BITS + 1) << HISTOGRAM_BITS) + ((value >> (exponent - HISTOGRAM_BITS)) & ((1 << HISTOGRAM_BITS) - 1));
+    }
+    __atomic_add_fetch(&histogram->counts[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Get the lowest value of bucket of histogram
+ * @param bucket - Index of bucket
+ * @return Value
+ */
+uint64_t histogram_value(int bucket){
+    if(bucket < (1 << HISTOGRAM_BITS))
+        return bucket;
+    int exponent = (bucket >> HISTOGRAM_BITS) + HISTOGRAM_BITS - 1;
+    return (uint64_t)((1 << HISTOGRAM_BITS) + (bucket & ((1 << HISTOGRAM_BITS) - 1))) << (exponent - HISTOGRAM_BITS);
+}
+
+/**
+ * @brief Get percentiles of histogram
+ * @param histogram - Histogram
+ * @param count - Number of percentiles
+ * @param percentile - Percentiles (0-100) in increasing order
+ * @param value - Output - the highest value of bucket where percentile is, in nanoseconds
+ * @return Number of values in histogram
+ *
+ * Histogram can be updated while it is read - result is approximate, but every bucket is read only once.
+ */
+uint64_t histogram_percentiles(histogram_t * histogram, int count, const double * percentile, uint64_t * value){
+    static uint64_t counts[HISTOGRAM_SIZE];
+    uint64_t total = 0;
+    for(int i=0; i<HISTOGRAM_SIZE; i++){
+        counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    uint64_t seen = 0;
+    int bucket = 0;
+    for(int i=0; i<count; i++){
+        uint64_t rank = (uint64_t)(percentile[i] / 100 * total);
+        while(bucket < HISTOGRAM_SIZE - 1 && seen + counts[bucket] <= rank)
+            seen += counts[bucket++];
+        value[i] = total ? histogram_value(bucket + 1) - 1 : 0;
+        if(value[i] > histogram->max)
+            value[i] = histogram->max;
+    }
+    return total;
+}
+
+/**
+ * @brief Compute hash of string - FNV-1a
+ * @param key - String
+ * @param length - Length of string
+ * @return Hash
+ */
+uint64_t strmap_hash(const char * key, size_t length){
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i=0; i<length; i++){
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find position of key in the table of map
+ * @param map - Map
+ * @param key - Key, does not have to be terminated by zero
+ * @param length - Length of key
+ * @param hash - Hash of key
+ * @return Index of entry with given key or index of empty entry where the key belongs
+ */
+size_t strmap_position(strmap_t * map, const char * key, size_t length, uint64_t hash){
+    size_t mask = map->capacity - 1;
+    size_t pos = hash & mask;
+    while(map->entries[pos].key){
+        strmap_entry_t * entry = &map->entries[pos];
+        if(entry->hash == hash && !strncmp(entry->key, key, length) && entry->key[length] == '\0')
+            return pos;
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+/**
+ * @brief Find value for given key
+ * @param map - Map
+ * @param key - Key, does not have to be terminated by zero
+ * @param length - Length of key
+ * @return Value or NULL if key is not in map
+ */
+void * strmap_find(strmap_t * map, const char * key, size_t length){
+    if(!map->count)
+        return NULL;
+    strmap_entry_t * entry = &map->entries[strmap_position(map, key, length, strmap_hash(key, length))];
+    return entry->key ? entry->value : NULL;
+}
+
+/**
+ * @brief Find value for given key
+ * @param map - Map
+ * @param key - Key
+ * @return Value or NULL if key is not in map
+ */
+void * strmap_get(strmap_t * map, const char * key){
+    return strmap_find(map, key, strlen(key));
+}
+
+/**
+ * @brief Insert or replace value for given key
+ * @param map - Map
+ * @param key - Key, it must be valid while it is in map
+ * @param value - Value
+ *
+ * When map is half full, table is doubled and all keys are moved to new table.
+ */
+void strmap_put(strmap_t * map, const char * key, void * value){
+    if(2 * (map->count + 1) > map->capacity){
+        strmap_entry_t * old = map->entries;
+        size_t oldCapacity = map->capacity;
+        map->capacity = oldCapacity ? 2 * oldCapacity : 64;
+        map->entries = calloc(map->capacity, sizeof(strmap_entry_t));
+        for(size_t i=0; i<oldCapacity; i++){
+            if(old[i].key){
+                size_t pos = old[i].hash & (map->capacity - 1);
+                while(map->entries[pos].key)
+                    pos = (pos + 1) & (map->capacity - 1);
+                map->entries[pos] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    size_t length = strlen(key);
+    uint64_t hash = strmap_hash(key, length);
+    size_t pos = strmap_position(map, key, length, hash);
+    if(!map->entries[pos].key)
+        map->count++;
+    map->entries[pos].key = key;
+    map->entries[pos].hash = hash;
+    map->entries[pos].value = value;
+}
+
+/**
+ * @brief Remove key from map
+ * @param map - Map
+ * @param key - Key
+ *
+ * Entries after removed one are shifted back, so there are no deleted markers in the table.
+ */
+void strmap_remove(strmap_t * map, const char * key){
+    if(!map->count)
+        return;
+    size_t length = strlen(key);
+    size_t mask = map->capacity - 1;
+    size_t pos = strmap_position(map, key, length, strmap_hash(key, length));
+    if(!map->entries[pos].key)
+        return;
+    map->entries[pos].key = NULL;
+    map->count--;
+
+    //move following entries to the free place if it is closer to their home position
+    size_t next = (pos + 1) & mask;
+    while(map->entries[next].key){
+        size_t home = map->entries[next].hash & mask;
+        if(((next - home) & mask) >= ((next - pos) & mask)){
+            map->entries[pos] = map->entries[next];
+            map->entries[next].key = NULL;
+            pos = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+/**
+ * @brief Free table of map
+ * @param map - Map
+ */
+void strmap_clear(strmap_t * map){
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+/**
+ * @brief Allocate memory in arena
+ * @param arena - Arena
+ * @param size - Size of memory
+ * @return Memory aligned to 8 bytes, it is freed by arena_free()
+ */
+void * arena_alloc(arena_t * arena, size_t size){
+    size = (size + 7) & ~(size_t)7;
+    arena_chunk_t * chunk = arena->chunks;
+    if(!chunk || chunk->used + size > chunk->size){
+        size_t chunkSize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(arena_chunk_t) + chunkSize);
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena->chunks = chunk;
+    }
+    void * memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+/**
+ * @brief Copy string to arena
+ * @param arena - Arena
+ * @param text - String, it does not have to be terminated by zero
+ * @param length - Length of string
+ * @return Copy terminated by zero
+ */
+char * arena_strndup(arena_t * arena, const char * text, size_t length){
+    char * copy = arena_alloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Free all memory of arena
+ * @param arena - Arena
+ */
+void arena_free(arena_t * arena){
+    while(arena->chunks){
+        arena_chunk_t * chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+}
+
+/**
+ * @brief Get empty message - called only by server thread
+ * @param length - Length of data
+ * @return Message with one reference
+ *
+ * Messages are taken from pool of their size class, so routing of message does not allocate memory in steady state.
+ * When the local cache of class is empty, all messages returned by delivery threads are taken at once by one atomic exchange.
+ */
+message_t * message_alloc(size_t length){
+    int pool = 0;
+    while(pool < POOL_CLASSES && (size_t)64 << pool < length)
+        pool++;
+
+    message_t * message = NULL;
+    if(pool < POOL_CLASSES){
+        if(!messageCache[pool])
+            messageCache[pool] = __atomic_exchange_n(&messagePool[pool], NULL, __ATOMIC_ACQUIRE);
+        message = messageCache[pool];
+        if(message)
+            messageCache[pool] = message->nextFree;
+        else
+            message = malloc(sizeof(message_t) + ((size_t)64 << pool));
+    }
+    else{
+        pool = -1;
+        message = malloc(sizeof(message_t) + length);
+    }
+    message->refs = 1;
+    message->pool = pool;
+    message->transfer = NULL;
+    message->length = length;
+    return message;
+}
+
+/**
+ * @brief Create new message
+ * @param text - Text of message
+ * @param length - Length of text
+ * @return Message with one reference
+ */
+message_t * message_new(const char * text, size_t length){
+    message_t * message = message_alloc(length);
+    memcpy(message->data, text, length);
+    return message;
+}
+
+/**
+ * @brief Add reference to message
+ * @param message - Message
+ */
+void message_retain(message_t * message){
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drop one reference to message, message is returned to pool when there is no reference
+ * @param message - Message
+ *
+ * Message can be shared by more delivery threads, so reference count is atomic. Any thread can push message to pool,
+ * only server thread takes messages from it (whole stack at once), so the stack does not suffer from ABA problem.
+ */
+void message_release(message_t * message){
+    if(__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if(message->pool < 0){
+        free(message);
+        return;
+    }
+    message_t ** pool = &messagePool[message->pool];
+    message->nextFree = __atomic_load_n(pool, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(pool, &message->nextFree, message, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Initialize empty queue
+ * @param queue - Queue
+ */
+void mpsc_init(mpsc_t * queue){
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/**
+ * @brief Push node to queue - can be called by any thread
+ * @param queue - Queue
+ * @param node - Node
+ */
+void mpsc_push(mpsc_t * queue, delivery_t * node){
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    delivery_t * prev = __atomic_exchange_n(&queue->tail, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Pop node from queue - can be called only by consumer thread
+ * @param queue - Queue
+ * @return Node or NULL if queue is empty (or producer has not finished push yet - consumer is woken again after push)
+ */
+delivery_t * mpsc_pop(mpsc_t * queue){
+    delivery_t * head = queue->head;
+    delivery_t * next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    //skip stub
+    if(head == &queue->stub){
+        if(!next)
+            return NULL;
+        queue->head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if(next){
+        queue->head = next;
+        return head;
+    }
+
+    //head is the last node - put stub behind it, so it can be taken
+    if(head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if(next){
+        queue->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Create io_uring and map its queues
+ * @param ring - Ring
+ * @param entries - Size of submission queue
+ * @return 1 if io_uring is ready, 0 if it is not available (old kernel, disabled by system) - ring.fd is -1 then
+ *
+ * Kernel must copy submitted entries and their vectors (IORING_FEAT_SUBMIT_STABLE) and it must not drop completions (IORING_FEAT_NODROP).
+ */
+int ring_init(ring_t * ring, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(ring_t));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+        return 0;
+
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_RW_CUR_POS;
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->queuesSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->queues = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    if((params.features & needed) == needed){
+        ring->queues = mmap(NULL, ring->queuesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    }
+    if(ring->queues == MAP_FAILED || ring->sqes == MAP_FAILED){
+        if(ring->queues != MAP_FAILED)
+            munmap(ring->queues, ring->queuesSize);
+        if(ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        close(ring->fd);
+        ring->fd = -1;
+        return 0;
+    }
+
+    char * p = ring->queues;
+    ring->sqHead = (unsigned *)(p + params.sq_off.head);
+    ring->sqTail = (unsigned *)(p + params.sq_off.tail);
+    ring->sqArray = (unsigned *)(p + params.sq_off.array);
+    ring->sqMask = *(unsigned *)(p + params.sq_off.ring_mask);
+    ring->cqHead = (unsigned *)(p + params.cq_off.head);
+    ring->cqTail = (unsigned *)(p + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(p + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(p + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->tail = *ring->sqTail;
+    return 1;
+}
+
+/**
+ * @brief Unmap queues and close io_uring - requests which were not completed yet are cancelled
+ * @param ring - Ring
+ */
+void ring_free(ring_t * ring){
+    if(ring->fd < 0)
+        return;
+    munmap(ring->queues, ring->queuesSize);
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * @brief Submit all prepared entries
+ * @param ring - Ring
+ * @param wait - Number of completions to wait for
+ *
+ * Requests which can be done without waiting (writes to non-blocking pipes) are completed before the call returns.
+ */
+void ring_submit(ring_t * ring, unsigned wait){
+    unsigned count = ring->tail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    while(count || wait){
+        int n = syscall(__NR_io_uring_enter, ring->fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            return;
+        }
+        count -= n;
+        wait = 0;
+    }
+}
+
+/**
+ * @brief Prepare new submission queue entry
+ * @param ring - Ring
+ * @return Cleared entry, it is submitted by the next ring_submit()
+ *
+ * If the submission queue is full, prepared entries are submitted first.
+ */
+struct io_uring_sqe * ring_sqe(ring_t * ring){
+    if(ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries)
+        ring_submit(ring, 0);
+    unsigned index = ring->tail++ & ring->sqMask;
+    ring->sqArray[index] = index;
+    memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[index];
+}
+
+/**
+ * @brief Get the oldest completion
+ * @param ring - Ring
+ * @return Completion queue entry or NULL if there is no completion - entry must be released by ring_seen()
+ */
+struct io_uring_cqe * ring_cqe(ring_t * ring){
+    unsigned head = *ring->cqHead;
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+/**
+ * @brief Release the oldest completion returned by ring_cqe()
+ * @param ring - Ring
+ */
+void ring_seen(ring_t * ring){
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Send command to delivery thread
+ * @param worker - Delivery thread
+ * @param type - Type of command
+ * @param outbox - Target outbox
+ * @param message - Message, command takes reference of caller
+ *
+ * Thread is not woken immediately - server_flush() wakes all threads with new commands at the end of iteration of server loop.
+ * Commands are reused - delivery threads return them to deliveryPool.
+ */
+void worker_post(worker_t * worker, int type, outbox_t * outbox, message_t * message){
+    if(!deliveryCache)
+        deliveryCache = __atomic_exchange_n(&deliveryPool, NULL, __ATOMIC_ACQUIRE);
+    delivery_t * delivery = deliveryCache;
+    if(delivery)
+        deliveryCache = delivery->next;
+    else
+        delivery = malloc(sizeof(delivery_t));
+    delivery->type = type;
+    delivery->outbox = outbox;
+    delivery->message = message;
+    delivery->time = message ? now_ns() : 0;
+    __atomic_add_fetch(&worker->depth, 1, __ATOMIC_RELAXED);
+    mpsc_push(&worker->queue, delivery);
+    worker->wake = 1;
+}
+
+/**
+ * @brief Send report about large message to server thread - called by delivery thread
+ * @param transfer - Large message
+ * @param type - DELIVERY_PROGRESS or DELIVERY_FINISHED
+ */
+void transfer_report(transfer_t * transfer, int type){
+    delivery_t * report = malloc(sizeof(delivery_t));
+    report->type = type;
+    report->outbox = NULL;
+    report->message = NULL;
+    report->transfer = transfer;
+    report->time = 0;
+    transfer->reported = transfer->moved;
+    mpsc_push(&reports, report);
+    uint64_t one = 1;
+    if(write(reportWatch.fd, &one, sizeof(one)) < 0)
+        perror("transfer_report");
+}
+
+/**
+ * @brief Drop one reference to large message
+ * @param transfer - Large message
+ */
+void transfer_release(transfer_t * transfer){
+    if(__atomic_sub_fetch(&transfer->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(transfer);
+}
+
+/**
+ * @brief Close upload pipe of large message and report result to server thread - called by delivery thread
+ * @param transfer - Large message
+ * @param state - TRANSFER_DONE or TRANSFER_FAILED
+ *
+ * Reference of delivery thread is dropped later by worker_run() - the same batch of epoll events can still contain an event of upload pipe.
+ */
+void transfer_finish(transfer_t * transfer, int state){
+    if(transfer->watch.fd >= 0){
+        if(transfer->watching)
+            epoll_ctl(transfer->worker->epollFd, EPOLL_CTL_DEL, transfer->watch.fd, NULL);
+        close(transfer->watch.fd);
+        transfer->watch.fd = -1;
+    }
+    __atomic_store_n(&transfer->state, state, __ATOMIC_RELEASE);
+    transfer_report(transfer, DELIVERY_FINISHED);
+    transfer->next = transfer->worker->finished;
+    transfer->worker->finished = transfer;
+}
+
+/**
+ * @brief Drop all pending messages of outbox - client does not read them anymore
+ * @param outbox - Outbox
+ *
+ * Large messages which were not written completely fail.
+ */
+void outbox_drop(outbox_t * outbox){
+    for(int i=0; i<outbox->count; i++){
+        if(outbox->pending[i]->transfer)
+            transfer_finish(outbox->pending[i]->transfer, TRANSFER_FAILED);
+        message_release(outbox->pending[i]);
+    }
+    __atomic_sub_fetch(&outbox->worker->pending, outbox->count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&deliveryDropped, outbox->count, __ATOMIC_RELAXED);
+    outbox->count = 0;
+    outbox->offset = 0;
+    outbox->splicing = 0;
+}
+
+/**
+ * @brief Close descriptor and free outbox with all pending messages
+ * @param outbox - Outbox
+ *
+ * Memory of outbox is freed later by worker_run() - the same batch of epoll events can still contain an event of this outbox.
+ */
+void outbox_free(outbox_t * outbox){
+    epoll_ctl(outbox->worker->epollFd, EPOLL_CTL_DEL, outbox->watch.fd, NULL);
+    if(!outbox->keep)
+        close(outbox->watch.fd);
+    outbox->watch.fd = -1;
+    outbox_drop(outbox);
+    free(outbox->pending);
+    free(outbox->queued);
+    outbox->worker->outboxes--;
+    outbox->nextDirty = outbox->worker->freed;
+    outbox->worker->freed = outbox;
+}
+
+/**
+ * @brief Wait for descriptor of outbox or upload pipe
+ * @param outbox - Outbox
+ * @param transfer - Large message whose payload is being moved, NULL if outbox does not wait for upload pipe
+ * @param events - EPOLLOUT if outbox waits until client reads its pipe, 0 otherwise
+ */
+void outbox_wait(outbox_t * outbox, transfer_t * transfer, uint32_t events){
+    struct epoll_event ev;
+    //epoll is changed only when outbox starts or stops waiting - not after every write
+    if(outbox->unwatched ? events != 0 : outbox->events != events){
+        ev.events = events;
+        ev.data.ptr = &outbox->watch;
+        epoll_ctl(outbox->worker->epollFd, outbox->unwatched ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, outbox->watch.fd, &ev);
+        outbox->events = events;
+        outbox->unwatched = 0;
+    }
+    if(transfer && transfer->watch.fd >= 0){
+        ev.events = events ? 0 : EPOLLIN;
+        ev.data.ptr = &transfer->watch;
+        epoll_ctl(transfer->worker->epollFd, transfer->watching ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, transfer->watch.fd, &ev);
+        transfer->watching = 1;
+    }
+}
+
+/**
+ * @brief Move payload of large message from upload pipe to client - called by delivery thread
+ * @param outbox - Outbox whose first pending message is header of large message
+ * @return 1 if whole payload is written, 0 if outbox waits for client or for sender, -1 if client is gone
+ *
+ * Payload is moved by splice(), so it is not copied to memory of server and memory use does not depend on its size.
+ * If sender closes upload pipe too early, the rest of payload is filled by zeros - client expects the announced number of bytes.
+ * Sender is told about progress at most 10 times.
+ */
+int transfer_splice(outbox_t * outbox){
+    static const char zeros[4096];
+    transfer_t * transfer = outbox->pending[0]->transfer;
+    uint64_t step = transfer->size / 10 > TRANSFER_STEP ? transfer->size / 10 : TRANSFER_STEP;
+
+    while(transfer->moved < transfer->size){
+        uint64_t chunk = transfer->size - transfer->moved;
+        if(chunk > PACKET_MAX)
+            chunk = PACKET_MAX;
+        ssize_t n;
+        if(transfer->watch.fd >= 0)
+            n = splice(transfer->watch.fd, NULL, outbox->watch.fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            n = write(outbox->watch.fd, zeros, chunk < sizeof(zeros) ? chunk : sizeof(zeros));
+
+        if(n > 0){
+            __atomic_store_n(&transfer->moved, transfer->moved + n, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&transferBytes, n, __ATOMIC_RELAXED);
+            if(transfer->moved < transfer->size && transfer->moved - transfer->reported >= step)
+                transfer_report(transfer, DELIVERY_PROGRESS);
+        }
+        //sender closed upload pipe
+        else if(n == 0){
+            if(transfer->watching)
+                epoll_ctl(transfer->worker->epollFd, EPOLL_CTL_DEL, transfer->watch.fd, NULL);
+            close(transfer->watch.fd);
+            transfer->watch.fd = -1;
+            transfer->padded = 1;
+        }
+        else if(errno == EINTR)
+            continue;
+        //empty upload pipe or full pipe of client
+        else if(errno == EAGAIN){
+            int available = 0;
+            int empty = transfer->watch.fd >= 0 && !ioctl(transfer->watch.fd, FIONREAD, &available) && available == 0;
+            outbox_wait(outbox, transfer, empty ? 0 : EPOLLOUT);
+            return 0;
+        }
+        else
+            return -1;
+    }
+    transfer_finish(transfer, transfer->padded ? TRANSFER_FAILED : TRANSFER_DONE);
+    return 1;
+}
+
+/**
+ * @brief Collect pending messages of outbox for one write
+ * @param outbox - Outbox
+ * @param iov - Vectors for messages
+ * @param max - Maximum number of vectors
+ * @return Number of messages in write - packet contains at least one message
+ *
+ * Header of large message is the last message of write, its payload is moved by transfer_splice() before next messages.
+ */
+int outbox_gather(outbox_t * outbox, struct iovec * iov, int max){
+    int n = 0;
+    size_t total = 0;
+    while(n < outbox->count && n < max){
+        if(outbox->packet && n && total + outbox->pending[n]->length > PACKET_MAX)
+            break;
+        iov[n].iov_base = outbox->pending[n]->data;
+        iov[n].iov_len = outbox->pending[n]->length;
+        total += iov[n].iov_len;
+        if(outbox->pending[n++]->transfer)
+            break;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + outbox->offset;
+    iov[0].iov_len -= outbox->offset;
+    return n;
+}
+
+/**
+ * @brief Remove written messages from queue of outbox
+ * @param outbox - Outbox
+ * @param n - Number of messages in write
+ * @param written - Number of written bytes or negative error number
+ * @return 1 if outbox can be written again, 0 if it waits until client reads its pipe
+ *
+ * If the client does not read its pipe anymore, pending messages are dropped.
+ */
+int outbox_written(outbox_t * outbox, int n, ssize_t written){
+    if(written < 0){
+        if(written == -EINTR)
+            return 1;
+        //pipe is full - wait until client reads it
+        if(written == -EAGAIN){
+            outbox_wait(outbox, NULL, EPOLLOUT);
+            return 0;
+        }
+        //client is gone - drop messages
+        outbox_drop(outbox);
+        return 1;
+    }
+
+    //remove written messages from queue
+    size_t left = written + outbox->offset;
+    uint64_t now = now_ns();
+    int done = 0;
+    while(done < n && left >= outbox->pending[done]->length){
+        left -= outbox->pending[done]->length;
+        //header of large message stays in queue until its payload is written
+        if(outbox->pending[done]->transfer){
+            outbox->splicing = 1;
+            break;
+        }
+        message_release(outbox->pending[done]);
+        histogram_record(&deliveryLatency, now - outbox->queued[done]);
+        done++;
+    }
+    outbox->count -= done;
+    __atomic_sub_fetch(&outbox->worker->pending, done, __ATOMIC_RELAXED);
+    memmove(outbox->pending, outbox->pending + done, outbox->count * sizeof(message_t *));
+    memmove(outbox->queued, outbox->queued + done, outbox->count * sizeof(uint64_t));
+    outbox->offset = left;
+    return 1;
+}
+
+/**
+ * @brief Write pending messages to client
+ * @param outbox - Outbox
+ *
+ * All pending messages are written by one writev(). If the pipe is full, the rest waits for EPOLLOUT.
+ * Header of large message is the last message of writev(), its payload is moved by transfer_splice() before next messages.
+ * If the client does not read its pipe anymore, pending messages are dropped.
+ * Closing outbox is freed after its last message is written.
+ * Outbox whose write was submitted to io_uring is flushed again after the write is completed.
+ */
+void outbox_flush(outbox_t * outbox){
+    if(outbox->writing)
+        return;
+    while(outbox->count > 0){
+
+        //payload of large message
+        if(outbox->splicing){
+            int status = transfer_splice(outbox);
+            if(status == 0)
+                return;
+            if(status < 0){
+                outbox_drop(outbox);
+                break;
+            }
+            outbox->splicing = 0;
+            message_release(outbox->pending[0]);
+            histogram_record(&deliveryLatency, now_ns() - outbox->queued[0]);
+            outbox->count--;
+            __atomic_sub_fetch(&outbox->worker->pending, 1, __ATOMIC_RELAXED);
+            memmove(outbox->pending, outbox->pending + 1, outbox->count * sizeof(message_t *));
+            memmove(outbox->queued, outbox->queued + 1, outbox->count * sizeof(uint64_t));
+            continue;
+        }
+
+        struct iovec iov[IOV_MAX];
+        int n = outbox_gather(outbox, iov, IOV_MAX);
+        ssize_t written = writev(outbox->watch.fd, iov, n);
+        if(!outbox_written(outbox, n, written < 0 ? -errno : written))
+            return;
+    }
+
+    //everything is written
+    if(outbox->closing){
+        outbox_free(outbox);
+        return;
+    }
+    outbox_wait(outbox, NULL, 0);
+}
+
+/**
+ * @brief Handle epoll event on client's pipe - pipe is writable again or client closed it
+ * @param watch - Watch of outbox
+ * @param events - Epoll events
+ */
+void outbox_event(watch_t * watch, uint32_t events){
+    outbox_t * outbox = (outbox_t *)((char *)watch - offsetof(outbox_t, watch));
+    if(outbox->watch.fd >= 0)
+        outbox_flush(outbox);
+    //epoll reports closed pipe even when no events are watched - outbox is removed from epoll until it has to wait for client again
+    if((events & (EPOLLERR | EPOLLHUP)) && outbox->watch.fd >= 0 && !outbox->count && !outbox->writing && !outbox->unwatched){
+        epoll_ctl(outbox->worker->epollFd, EPOLL_CTL_DEL, outbox->watch.fd, NULL);
+        outbox->events = 0;
+        outbox->unwatched = 1;
+    }
+}
+
+/**
+ * @brief Handle epoll event on upload pipe of large message - sender wrote more of payload
+ * @param watch - Watch of upload pipe
+ * @param events - Epoll events
+ *
+ * Upload pipe is watched only while its transfer is the first pending message of recipient's outbox.
+ */
+void transfer_event(watch_t * watch, uint32_t events){
+    (void)events;
+    transfer_t * transfer = (transfer_t *)((char *)watch - offsetof(transfer_t, watch));
+    if(transfer->watch.fd >= 0)
+        outbox_flush(transfer->outbox);
+}
+
+/**
+ * @brief Add message to pending messages of outbox - called by delivery thread
+ * @param outbox - Outbox
+ * @param message - Message, outbox takes reference of caller
+ * @param time - Time when message was queued by server thread
+ *
+ * Message is not written immediately. Outbox is added to the list of dirty outboxes and all messages received by thread in one batch are written together.
+ */
+void outbox_append(outbox_t * outbox, message_t * message, uint64_t time){
+    if(outbox->count == outbox->capacity){
+        outbox->capacity = outbox->capacity ? 2 * outbox->capacity : 8;
+        outbox->pending = realloc(outbox->pending, outbox->capacity * sizeof(message_t *));
+        outbox->queued = realloc(outbox->queued, outbox->capacity * sizeof(uint64_t));
+    }
+    outbox->queued[outbox->count] = time;
+    outbox->pending[outbox->count++] = message;
+    __atomic_add_fetch(&outbox->worker->pending, 1, __ATOMIC_RELAXED);
+
+    if(!outbox->dirty){
+        outbox->dirty = 1;
+        outbox->nextDirty = outbox->worker->dirty;
+        outbox->worker->dirty = outbox;
+    }
+}
+
+/**
+ * @brief Handle completed writes of delivery thread
+ * @param worker - Delivery thread
+ *
+ * Outbox with more messages than fit into one write is written again by the next batch, large message continues by outbox_flush().
+ */
+void worker_complete(worker_t * worker){
+    struct io_uring_cqe * cqe;
+    while((cqe = ring_cqe(&worker->ring)) != NULL){
+        outbox_t * outbox = (outbox_t *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        ring_seen(&worker->ring);
+        int n = outbox->writing;
+        outbox->writing = 0;
+        if(!outbox_written(outbox, n, result))
+            continue;
+        if(outbox->count && !outbox->splicing){
+            if(!outbox->dirty){
+                outbox->dirty = 1;
+                outbox->nextDirty = worker->dirty;
+                worker->dirty = outbox;
+            }
+        }
+        else
+            outbox_flush(outbox);
+    }
+}
+
+/**
+ * @brief Write all dirty outboxes by io_uring
+ * @param worker - Delivery thread
+ *
+ * Writes of all outboxes are submitted in one batch by one system call instead of one writev() per recipient.
+ * Pipes are non-blocking, so writes are completed immediately - full pipe completes with EAGAIN and outbox waits for EPOLLOUT like with writev().
+ */
+void worker_submit(worker_t * worker){
+    while(worker->dirty){
+        unsigned writes = 0;
+        int used = 0;
+        while(worker->dirty && used < RING_IOV && writes < worker->ring.entries){
+            outbox_t * outbox = worker->dirty;
+            worker->dirty = outbox->nextDirty;
+            outbox->dirty = 0;
+            if(outbox->writing)
+                continue;
+            if(outbox->splicing || !outbox->count){
+                outbox_flush(outbox);
+                continue;
+            }
+            int n = outbox_gather(outbox, worker->iov + used, RING_IOV - used < IOV_MAX ? RING_IOV - used : IOV_MAX);
+            struct io_uring_sqe * sqe = ring_sqe(&worker->ring);
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = outbox->watch.fd;
+            sqe->addr = (uintptr_t)(worker->iov + used);
+            sqe->len = n;
+            sqe->off = (uint64_t)-1;
+            sqe->user_data = (uintptr_t)outbox;
+            outbox->writing = n;
+            used += n;
+            writes++;
+        }
+        if(!writes)
+            break;
+        ring_submit(&worker->ring, 0);
+        __atomic_add_fetch(&ringWrites, writes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ringCalls, 1, __ATOMIC_RELAXED);
+        worker_complete(worker);
+    }
+}
+
+/**
+ * @brief Handle writes which were completed later than they were submitted
+ * @param watch - Watch of io_uring of delivery thread
+ * @param events - Epoll events
+ */
+void worker_ring_event(watch_t * watch, uint32_t events){
+    (void)events;
+    worker_t * worker = (worker_t *)((char *)watch - offsetof(worker_t, ringWatch));
+    worker_complete(worker);
+    worker_submit(worker);
+}
+
+/**
+ * @brief Process all commands in queue of delivery thread and write all messages
+ * @param watch - Watch of eventfd of thread
+ * @param events - Epoll events
+ */
+void worker_wake(watch_t * watch, uint32_t events){
+    (void)events;
+    worker_t * worker = (worker_t *)((char *)watch - offsetof(worker_t, wakeWatch));
+    uint64_t value;
+    if(read(watch->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("worker_wake");
+
+    delivery_t * delivery;
+    while((delivery = mpsc_pop(&worker->queue)) != NULL){
+        __atomic_sub_fetch(&worker->depth, 1, __ATOMIC_RELAXED);
+        outbox_t * outbox = delivery->outbox;
+        if(delivery->type == DELIVERY_OPEN){
+            //watch only errors for now, EPOLLOUT is added when pipe is full
+            struct epoll_event ev;
+            ev.events = 0;
+            ev.data.ptr = &outbox->watch;
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, outbox->watch.fd, &ev);
+            worker->outboxes++;
+        }
+        else if(delivery->type == DELIVERY_MESSAGE)
+            outbox_append(outbox, delivery->message, delivery->time);
+        else if(delivery->type == DELIVERY_CLOSE){
+            outbox->closing = 1;
+            if(!outbox->dirty)
+                outbox_flush(outbox);
+        }
+        else
+            worker->stopping = 1;
+
+        //return command to pool of server thread
+        delivery->next = __atomic_load_n(&deliveryPool, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&deliveryPool, &delivery->next, delivery, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    //write all new messages - all outboxes by one system call of io_uring, or every outbox by one system call
+    if(worker->ring.fd >= 0)
+        worker_submit(worker);
+    while(worker->dirty){
+        outbox_t * outbox = worker->dirty;
+        worker->dirty = outbox->nextDirty;
+        outbox->dirty = 0;
+        outbox_flush(outbox);
+    }
+}
+
+/**
+ * @brief Main loop of delivery thread
+ * @param arg - Delivery thread
+ * @return NULL
+ *
+ * Thread waits for commands and for pipes which are writable again. After DELIVERY_STOP it waits at most 1 second until all outboxes are closed.
+ */
+void * worker_run(void * arg){
+    worker_t * worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct timespec deadline = {0, 0};
+
+    while(!worker->stopping || worker->outboxes > 0){
+        int timeout = -1;
+        if(worker->stopping){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(!deadline.tv_sec){
+                deadline = now;
+                deadline.tv_sec++;
+            }
+            if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+                break;
+            timeout = 100;
+        }
+
+        int n = epoll_wait(worker->epollFd, events, MAX_EVENTS, timeout);
+        for(int i=0; i<n; i++){
+            watch_t * watch = events[i].data.ptr;
+            watch->handler(watch, events[i].events);
+        }
+
+        //outboxes closed and large messages finished while events were handled
+        while(worker->freed){
+            outbox_t * outbox = worker->freed;
+            worker->freed = outbox->nextDirty;
+            free(outbox);
+        }
+        while(worker->finished){
+            transfer_t * transfer = worker->finished;
+            worker->finished = transfer->next;
+            transfer_release(transfer);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start delivery threads
+ * @param count - Number of threads
+ *
+ * Every thread gets its own io_uring for writes if it is available.
+ */
+void workers_start(int count){
+    for(int i=0; i<count; i++){
+        worker_t * worker = &workers[i];
+        memset(worker, 0, sizeof(worker_t));
+        mpsc_init(&worker->queue);
+        worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wakeWatch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->wakeWatch.handler = worker_wake;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &worker->wakeWatch;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeWatch.fd, &ev);
+        worker->ring.fd = -1;
+        if(uringOption && ring_init(&worker->ring, RING_ENTRIES)){
+            worker->iov = malloc(RING_IOV * sizeof(struct iovec));
+            worker->ringWatch.fd = worker->ring.fd;
+            worker->ringWatch.handler = worker_ring_event;
+            ev.data.ptr = &worker->ringWatch;
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->ring.fd, &ev);
+        }
+        pthread_create(&worker->thread, NULL, worker_run, worker);
+    }
+    workerCount = count;
+}
+
+/**
+ * @brief Wake delivery threads which received commands in this iteration of server loop
+ */
+void server_flush(){
+    uint64_t one = 1;
+    for(int i=0; i<workerCount; i++){
+        if(workers[i].wake){
+            workers[i].wake = 0;
+            if(write(workers[i].wakeWatch.fd, &one, sizeof(one)) < 0)
+                perror("server_flush");
+        }
+    }
+}
+
+/**
+ * @brief Deliver all messages and stop delivery threads
+ */
+void workers_stop(){
+    for(int i=0; i<workerCount; i++)
+        worker_post(&workers[i], DELIVERY_STOP, NULL, NULL);
+    server_flush();
+    for(int i=0; i<workerCount; i++){
+        pthread_join(workers[i].thread, NULL);
+        ring_free(&workers[i].ring);
+        free(workers[i].iov);
+        close(workers[i].wakeWatch.fd);
+        close(workers[i].epollFd);
+    }
+    workerCount = 0;
+
+    //free pooled commands
+    while(deliveryCache){
+        delivery_t * delivery = deliveryCache;
+        deliveryCache = delivery->next;
+        free(delivery);
+    }
+    while(deliveryPool){
+        delivery_t * delivery = deliveryPool;
+        deliveryPool = delivery->next;
+        free(delivery);
+    }
+}
+
+/**
+ * @brief Create outbox for opened descriptor
+ * @param name - Username
+ * @param fd - Write end of named pipe or socket of client
+ * @param packet - Descriptor is socket
+ * @return Outbox handed over to delivery thread chosen by hash of username
+ */
+outbox_t * outbox_new(char * name, int fd, int packet){
+    outbox_t * outbox = calloc(1, sizeof(outbox_t));
+    outbox->packet = packet;
+    outbox->watch.fd = fd;
+    outbox->watch.handler = outbox_event;
+    outbox->worker = &workers[strmap_hash(name, strlen(name)) % workerCount];
+    worker_post(outbox->worker, DELIVERY_OPEN, outbox, NULL);
+    return outbox;
+}
+
+/**
+ * @brief Open client's named pipe for writing
+ * @param name - Name of named pipe
+ * @return Non-blocking descriptor, -1 if pipe has no reader or name is not a named pipe
+ *
+ * Names of pipes come from requests, so files and directories of server (login file, offline, history, ...) are never opened for writing.
+ */
+int pipe_open(char * name){
+    int fd = open(name, O_WRONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    if(fd < 0)
+        return -1;
+    struct stat info;
+    if(fstat(fd, &info) < 0 || !S_ISFIFO(info.st_mode)){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Open output channel to client
+ * @param name - Username - name of client's named pipe
+ * @param connection - Connection of client or NULL if client uses named pipe
+ * @return Outbox or NULL if client is not reading its named pipe
+ *
+ * Named pipe is opened only once per login, in non-blocking mode - slow client can not block the server.
+ * Client connected by socket gets duplicate of its socket - delivery thread closes it independently of connection.
+ * Outbox is handed over to delivery thread chosen by hash of username.
+ */
+outbox_t * outbox_open(char * name, connection_t * connection){
+    int fd = connection ? fcntl(connection->watch.fd, F_DUPFD_CLOEXEC, 0) : pipe_open(name);
+    if(fd < 0)
+        return NULL;
+    return outbox_new(name, fd, connection != NULL);
+}
+
+/**
+ * @brief Add message to queue of outbox
+ * @param outbox - Outbox
+ * @param message - Message, outbox takes its own reference
+ *
+ * Message is handed over to delivery thread of outbox. All messages queued in one iteration of server loop are written together.
+ */
+void outbox_queue(outbox_t * outbox, message_t * message){
+    message_retain(message);
+    worker_post(outbox->worker, DELIVERY_MESSAGE, outbox, message);
+}
+
+/**
+ * @brief Close outbox after all its messages are delivered
+ * @param outbox - Outbox, it must not be used after this call
+ */
+void outbox_close(outbox_t * outbox){
+    worker_post(outbox->worker, DELIVERY_CLOSE, outbox, NULL);
+}
+
+/**
+ * @brief Free outbox after all its messages are delivered, but keep its descriptor open
+ * @param outbox - Outbox, it must not be used after this call
+ * @return Descriptor of outbox
+ */
+int outbox_detach(outbox_t * outbox){
+    int fd = outbox->watch.fd;
+    outbox->keep = 1;
+    worker_post(outbox->worker, DELIVERY_CLOSE, outbox, NULL);
+    return fd;
+}
+
+/**
+ * @brief Compose message from user in format "from -> text" or "from #seq -> text" for message with receipt
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param text - Text of message
+ * @param textLength - Length of text
+ * @param seq - Number of message with receipt, 0 for message without receipt
+ * @return New message with one reference
+ *
+ * Text clients read messages line by line, so newlines and zeros in text (possible in binary requests) are replaced by spaces.
+ */
+message_t * message_format(const char * from, size_t fromLength, const char * text, size_t textLength, uint64_t seq){
+    char number[24];
+    int numberLength = seq ? snprintf(number, sizeof(number), " #%llu", (unsigned long long)seq) : 0;
+    message_t * message = message_alloc(fromLength + numberLength + textLength + 5);
+    memcpy(message->data, from, fromLength);
+    memcpy(message->data + fromLength, number, numberLength);
+    memcpy(message->data + fromLength + numberLength, " -> ", 4);
+    char * out = message->data + fromLength + numberLength + 4;
+    for(size_t i=0; i<textLength; i++)
+        out[i] = (text[i] == '\n' || text[i] == '\0') ? ' ' : text[i];
+    message->data[message->length - 1] = '\n';
+    return message;
+}
+
+/**
+ * @brief Store 32-bit number in little endian
+ * @param p - Output
+ * @param value - Number
+ */
+void le32_put(unsigned char * p, uint32_t value){
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/**
+ * @brief Load 32-bit number in little endian
+ * @param p - Input
+ * @return Number
+ */
+uint32_t le32_get(const unsigned char * p){
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * @brief Compose binary frame
+ * @param type - Type of frame
+ * @param count - Number of fields
+ * @param field - Fields
+ * @param length - Lengths of fields
+ * @return New message with one reference
+ *
+ * Frame format (all numbers are little endian):
+ * <pre>
+ * uint8  magic (0xFB)
+ * uint8  version (1)
+ * uint8  type
+ * uint8  count of fields
+ * uint32 length of payload
+ * uint32 end offset of every field in payload
+ * payload - fields without any separators
+ * </pre>
+ */
+message_t * frame_new(int type, int count, const char ** field, const size_t * length){
+    size_t payload = 0;
+    for(int i=0; i<count; i++)
+        payload += length[i];
+    size_t header = FRAME_HEADER + 4 * count;
+
+    message_t * message = message_alloc(header + payload);
+    unsigned char * p = (unsigned char *)message->data;
+    p[0] = FRAME_MAGIC;
+    p[1] = FRAME_VERSION;
+    p[2] = type;
+    p[3] = count;
+    le32_put(p + 4, payload);
+
+    size_t offset = 0;
+    for(int i=0; i<count; i++){
+        memcpy(p + header + offset, field[i], length[i]);
+        offset += length[i];
+        le32_put(p + FRAME_HEADER + 4 * i, offset);
+    }
+    return message;
+}
+
+/**
+ * @brief Get message from letter formatted for given client
+ * @param letter - Letter
+ * @param binary - Client uses binary frames
+ * @return Message owned by letter
+ *
+ * Frame of message with receipt has third field with number of message in decimal.
+ */
+message_t * letter_message(letter_t * letter, int binary){
+    if(!letter->formatted[binary]){
+        if(binary){
+            char number[24];
+            const char * field[3] = {letter->from, letter->text, number};
+            size_t length[3] = {letter->fromLength, letter->textLength, 0};
+            if(letter->seq)
+                length[2] = snprintf(number, sizeof(number), "%llu", (unsigned long long)letter->seq);
+            letter->formatted[1] = frame_new(FRAME_MESSAGE, letter->seq ? 3 : 2, field, length);
+        }
+        else
+            letter->formatted[0] = message_format(letter->from, letter->fromLength, letter->text, letter->textLength, letter->seq);
+    }
+    return letter->formatted[binary];
+}
+
+/**
+ * @brief Drop messages composed for letter
+ * @param letter - Letter
+ */
+void letter_release(letter_t * letter){
+    for(int i=0; i<2; i++)
+        if(letter->formatted[i])
+            message_release(letter->formatted[i]);
+}
+
+/**
+ * @brief Compose notice from server for client
+ * @param message - Text of notice, terminated by newline
+ * @param binary - Client uses binary frames
+ * @return New message with one reference
+ */
+message_t * message_notice(char * message, int binary){
+    if(!binary)
+        return message_new(message, strlen(message));
+    const char * field[1] = {message};
+    size_t length[1] = {strlen(message)};
+    return frame_new(FRAME_NOTICE, 1, field, length);
+}
+
+/**
+ *  @brief Send message to client
+ *  @param user - Message will be send to this user
+ *  @param message - Message
+ *
+ *  Message is queued to outbox of target client and written to its named pipe at the end of the server loop iteration. Name of the named pipe is same as username.
+ *  Binary client gets message as notice frame.
+ */
+void message_send(user_t * user, char * message){
+    if(!user->outbox)
+        return;
+    message_t * m = message_notice(message, user->binary);
+    outbox_queue(user->outbox, m);
+    message_release(m);
+}
+
+/**
+ * @brief Send one message to client which is not logged in
+ * @param name - Name of client's named pipe
+ * @param message - Message
+ * @param binary - Client uses binary frames
+ *
+ * Used for answers to unsuccessful logins - pipe is opened, message is written and pipe is closed immediately.
+ */
+void message_send_once(char * name, char * message, int binary){
+    int fd = pipe_open(name);
+    if(fd < 0)
+        return;
+    message_t * m = message_notice(message, binary);
+    if(write(fd, m->data, m->length) < 0)
+        perror("message_send_once");
+    message_release(m);
+    close(fd);
+}
+
+/**
+ * @brief Answer request of client which is not logged in
+ * @param request - Request
+ * @param name - Name of client's named pipe - used if request was not received by socket
+ * @param message - Message
+ *
+ * Client connected by socket gets answer by its connection, other clients by their named pipe.
+ */
+void message_reply(request_t * request, char * name, char * message){
+    if(!request->connection){
+        message_send_once(name, message, request->binary);
+        return;
+    }
+    message_t * m = message_notice(message, request->binary);
+    if(send(request->connection->watch.fd, m->data, m->length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        perror("message_reply");
+    message_release(m);
+}
+
+/**
+ * @brief Check if field can be a username - name of named pipe
+ * @param text - Field, it does not have to be terminated by zero
+ * @param length - Length of field
+ * @return 1 if field is not empty, it is not longer than NAME_MAX and it contains only letters and digits
+ */
+int is_name(const char * text, size_t length){
+    if(!length || length > NAME_MAX)
+        return 0;
+    for(size_t i=0; i<length; i++)
+        if(!isalnum((unsigned char)text[i]))
+            return 0;
+    return 1;
+}
+
+/**
+ * @brief Check if string contains only alphanumeric characters
+ * @param text - String
+ * @return 1 if string is not empty and contains only letters and digits
+ */
+int is_alphanumeric(char * text){
+    return is_name(text, strlen(text));
+}
+
+/**
+ * @brief Forget all loaded credentials
+ */
+void credentials_clear(){
+    strmap_clear(&credentials);
+    arena_free(&credentialsArena);
+    credentialsOffset = 0;
+}
+
+/**
+ * @brief Load new registered users from login file to memory
+ *
+ * Only the part of file which was appended since the last call is read - new users are added by appending username and password lines to the file.
+ * If the file was replaced or truncated, all credentials are loaded again. Incomplete pair of lines at the end of file (registration is just being written) is loaded next time.
+ */
+void credentials_load(){
+    int fd = open(loginFile, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        credentials_clear();
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    if(st.st_ino != credentialsInode || st.st_size < credentialsOffset){
+        credentials_clear();
+        credentialsInode = st.st_ino;
+    }
+
+    //read new part of file
+    size_t length = st.st_size - credentialsOffset;
+    char * data = malloc(length + 1);
+    ssize_t n = length ? pread(fd, data, length, credentialsOffset) : 0;
+    close(fd);
+    if(n < 0)
+        n = 0;
+
+    //every user is stored as 2 lines - username and password
+    char * line = data;
+    char * end = data + n;
+    while(1){
+        char * nameEnd = memchr(line, '\n', end - line);
+        if(!nameEnd)
+            break;
+        char * passwordEnd = memchr(nameEnd + 1, '\n', end - nameEnd - 1);
+        if(!passwordEnd)
+            break;
+        //first registration of username is valid
+        if(!strmap_find(&credentials, line, nameEnd - line)){
+            user_t * user = arena_alloc(&credentialsArena, sizeof(user_t));
+            memset(user, 0, sizeof(user_t));
+            user->username = arena_strndup(&credentialsArena, line, nameEnd - line);
+            user->password = arena_strndup(&credentialsArena, nameEnd + 1, passwordEnd - nameEnd - 1);
+            strmap_put(&credentials, user->username, user);
+        }
+        line = passwordEnd + 1;
+    }
+    credentialsOffset += line - data;
+    free(data);
+}
+
+/**
+ * @brief Check if login file was changed since it was loaded
+ * @return 1 if file has different size or it was replaced
+ */
+int credentials_changed(){
+    struct stat st;
+    if(stat(loginFile, &st))
+        return credentials.count > 0;
+    return st.st_ino != credentialsInode || st.st_size != credentialsOffset;
+}
+
+/**
+ * @brief Handle inotify event - mark credentials for reload if login file was changed
+ * @param watch - Watch of inotify descriptor
+ * @param events - Epoll events
+ */
+void credentials_event(watch_t * watch, uint32_t events){
+    (void)events;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+    while((n = read(watch->fd, buffer, sizeof(buffer))) > 0){
+        for(char * p = buffer; p < buffer + n; ){
+            struct inotify_event * event = (struct inotify_event *)p;
+            if(event->len && !strcmp(event->name, loginFile))
+                changed = 1;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    //file is read by authentication thread, not by server loop
+    if(changed)
+        __atomic_store_n(&credentialsStale, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Load credentials and start watching login file
+ *
+ * Working directory is watched (not the file itself), so creating and replacing of login file is noticed too.
+ */
+void credentials_init(){
+    credentials_load();
+
+    credentialsWatch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    credentialsWatch.handler = credentials_event;
+    if(credentialsWatch.fd < 0 || inotify_add_watch(credentialsWatch.fd, ".", IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_TO) < 0){
+        //without inotify user_auth() checks the file when it does not know the user
+        perror("inotify");
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &credentialsWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, credentialsWatch.fd, &ev);
+}
+
+/**
+ * @brief Check if given credentials are correct
+ * @param username - Username, it does not have to be terminated by zero
+ * @param usernameLen - Length of username
+ * @param password - Password, it does not have to be terminated by zero
+ * @param passwordLen - Length of password
+ * @return 1 if credentials are valid 0 otherwise
+ *
+ * Function finds given user in credentials loaded from login file by credentials_load(). If we find a user we check if the password is the same as password given at registration if yes returns 1 else 0.
+ * Credentials are loaded again when inotify reported change of login file. Unknown user could be registered just now and inotify event was not processed yet -
+ * in this case new part of login file is loaded immediately.
+ * It is called by authentication threads - credentials are shared under credentialsLock.
+ */
+int user_auth(const char * username, size_t usernameLen, const char * password, size_t passwordLen){
+    int valid = 0;
+    user_t * registered = NULL;
+    if(!__atomic_load_n(&credentialsStale, __ATOMIC_ACQUIRE)){
+        pthread_rwlock_rdlock(&credentialsLock);
+        registered = strmap_find(&credentials, username, usernameLen);
+        valid = registered && strlen(registered->password) == passwordLen && !memcmp(password, registered->password, passwordLen);
+        pthread_rwlock_unlock(&credentialsLock);
+        if(registered)
+            return valid;
+    }
+
+    //login file is read only by one thread at a time
+    pthread_rwlock_wrlock(&credentialsLock);
+    if(__atomic_exchange_n(&credentialsStale, 0, __ATOMIC_ACQ_REL) || credentials_changed())
+        credentials_load();
+    registered = strmap_find(&credentials, username, usernameLen);
+    valid = registered && strlen(registered->password) == passwordLen && !memcmp(password, registered->password, passwordLen);
+    pthread_rwlock_unlock(&credentialsLock);
+    return valid;
+}
+
+
+/**
+ * @brief Make sure that buffer has space for more bytes
+ * @param bytes - Buffer
+ * @param length - Number of bytes which will be appended
+ */
+void bytes_reserve(bytes_t * bytes, size_t length){
+    if(bytes->length + length <= bytes->capacity)
+        return;
+    size_t capacity = bytes->capacity ? bytes->capacity : 4096;
+    while(capacity < bytes->length + length)
+        capacity *= 2;
+    bytes->data = realloc(bytes->data, capacity);
+    bytes->capacity = capacity;
+}
+
+/**
+ * @brief Append bytes to buffer
+ * @param bytes - Buffer
+ * @param data - Data
+ * @param length - Length of data
+ */
+void bytes_append(bytes_t * bytes, const void * data, size_t length){
+    bytes_reserve(bytes, length);
+    memcpy(bytes->data + bytes->length, data, length);
+    bytes->length += length;
+}
+
+/**
+ * @brief Append formatted text to buffer
+ * @param bytes - Buffer
+ * @param format - Format of text, like printf()
+ */
+void bytes_printf(bytes_t * bytes, const char * format, ...){
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    bytes_reserve(bytes, length + 1);
+    va_start(args, format);
+    vsnprintf(bytes->data + bytes->length, length + 1, format, args);
+    va_end(args);
+    bytes->length += length;
+}
+
+/**
+ * @brief Find conversation of sender with recipient
+ * @param to - Recipient
+ * @param toLength - Length of recipient
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param create - Create conversation if it does not exist
+ * @return Conversation or NULL
+ */
+pair_t * receipt_pair(const char * to, size_t toLength, const char * from, size_t fromLength, int create){
+    if(toLength > NAME_MAX || fromLength > NAME_MAX)
+        return NULL;
+    char key[2 * NAME_MAX + 2];
+    memcpy(key, to, toLength);
+    key[toLength] = '/';
+    memcpy(key + toLength + 1, from, fromLength);
+    size_t length = toLength + 1 + fromLength;
+    pair_t * pair = strmap_find(&receipts, key, length);
+    if(!pair && create){
+        pair = calloc(1, sizeof(pair_t) + length + 1);
+        pair->toLength = toLength;
+        memcpy(pair->key, key, length);
+        strmap_put(&receipts, pair->key, pair);
+    }
+    return pair;
+}
+
+/**
+ * @brief Split sender "from#seq" of record OFFLINE_RECEIPT to sender and number of message
+ * @param letter - Letter read from record, its sender is shortened and number is stored to seq
+ * @return 1 on success, 0 if sender has no number
+ */
+int receipt_letter(letter_t * letter){
+    const char * hash = memchr(letter->from, '#', letter->fromLength);
+    if(!hash)
+        return 0;
+    const char * end = letter->from + letter->fromLength;
+    letter->fromLength = hash - letter->from;
+    letter->seq = 0;
+    for(const char * digit = hash + 1; digit < end; digit++)
+        letter->seq = letter->seq * 10 + *digit - '0';
+    return letter->seq != 0;
+}
+
+/**
+ * @brief Keep message with receipt sent to logged recipient until he acknowledges it
+ * @param user - Recipient
+ * @param pair - Conversation
+ * @param seq - Number of message
+ * @param text - Text of message
+ * @param length - Length of text
+ */
+void receipt_unacked(user_t * user, pair_t * pair, uint64_t seq, const char * text, size_t length){
+    unacked_t * message = malloc(sizeof(unacked_t) + length);
+    message->next = NULL;
+    message->seq = seq;
+    message->length = length;
+    memcpy(message->text, text, length);
+    if(pair->tail)
+        pair->tail->next = message;
+    else
+        pair->head = message;
+    pair->tail = message;
+    pair->count++;
+    receiptsUnacked++;
+    if(!pair->listed){
+        pair->listed = 1;
+        pair->next = user->pairs;
+        user->pairs = pair;
+    }
+}
+
+/**
+ * @brief Compose name of file of segment
+ * @param path - Output, PATH_MAX bytes
+ * @param id - Id of segment
+ * @param suffix - "log" for records, "idx" for index
+ */
+void offline_path(char * path, uint32_t id, const char * suffix){
+    snprintf(path, PATH_MAX, "%s/%08u.%s", offlineDir, id, suffix);
+}
+
+/**
+ * @brief Append record to buffer
+ * @param out - Buffer
+ * @param kind - OFFLINE_MESSAGE, OFFLINE_DRAIN or OFFLINE_RECEIPT, OFFLINE_DELAYED or OFFLINE_FIRED in journal of delayed messages, OFFLINE_RECEIPT or OFFLINE_PAIR in file of conversations
+ * @param seq - Sequence number
+ * @param when - Time of record, time of delivery for OFFLINE_DELAYED
+ * @param to - Recipient
+ * @param toLength - Length of recipient
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param text - Text of message
+ * @param textLength - Length of text
+ * @return Size of record
+ *
+ * Record format (all numbers are little endian):
+ * <pre>
+ * uint32 size of record
+ * uint32 checksum of the rest of record
+ * uint32 kind
+ * uint32 length of recipient
+ * uint32 length of sender
+ * uint32 time
+ * uint64 sequence number
+ * recipient, sender and text without any separators
+ * </pre>
+ */
+uint32_t offline_record(bytes_t * out, int kind, uint64_t seq, time_t when, const char * to, size_t toLength, const char * from, size_t fromLength, const char * text, size_t textLength){
+    size_t size = OFFLINE_HEADER + toLength + fromLength + textLength;
+    bytes_reserve(out, size);
+    unsigned char * p = (unsigned char *)out->data + out->length;
+    le32_put(p, size);
+    le32_put(p + 8, kind);
+    le32_put(p + 12, toLength);
+    le32_put(p + 16, fromLength);
+    le32_put(p + 20, when);
+    le32_put(p + 24, seq);
+    le32_put(p + 28, seq >> 32);
+    memcpy(p + OFFLINE_HEADER, to, toLength);
+    memcpy(p + OFFLINE_HEADER + toLength, from, fromLength);
+    memcpy(p + OFFLINE_HEADER + toLength + fromLength, text, textLength);
+    le32_put(p + 4, strmap_hash((char *)p + 8, size - 8));
+    out->length += size;
+    return size;
+}
+
+/**
+ * @brief Check record read from segment
+ * @param p - Record
+ * @param available - Number of bytes available at p
+ * @return Size of record or 0 if record is incomplete or damaged
+ */
+uint32_t offline_check(const unsigned char * p, size_t available){
+    if(available < OFFLINE_HEADER)
+        return 0;
+    uint32_t size = le32_get(p);
+    uint32_t kind = le32_get(p + 8);
+    if(size < OFFLINE_HEADER || size > available || kind < OFFLINE_MESSAGE || kind > OFFLINE_PAIR)
+        return 0;
+    if((uint64_t)le32_get(p + 12) + le32_get(p + 16) > size - OFFLINE_HEADER)
+        return 0;
+    if(le32_get(p + 4) != (uint32_t)strmap_hash((const char *)p + 8, size - 8))
+        return 0;
+    return size;
+}
+
+/**
+ * @brief Append entry of record to index of active segment
+ * @param offset - Offset of record in segment
+ * @param record - Record
+ *
+ * Entry is offset of record followed by header of record and recipient - index can be loaded without reading the whole segment.
+ */
+void offline_index_add(uint32_t offset, const unsigned char * record){
+    unsigned char number[4];
+    le32_put(number, offset);
+    bytes_append(&offlineIndex, number, 4);
+    bytes_append(&offlineIndex, record, OFFLINE_HEADER + le32_get(record + 12));
+}
+
+/**
+ * @brief Find segment
+ * @param id - Id of segment
+ * @return Segment or NULL if it was already deleted
+ */
+segment_t * offline_segment(uint32_t id){
+    int low = 0, high = segmentCount - 1;
+    while(low <= high){
+        int middle = (low + high) / 2;
+        if(segments[middle].id == id)
+            return &segments[middle];
+        if(segments[middle].id < id)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find undelivered messages of user
+ * @param name - Username
+ * @param length - Length of username
+ * @param create - Create empty backlog if user has none
+ * @return Backlog or NULL
+ */
+backlog_t * offline_backlog(const char * name, size_t length, int create){
+    backlog_t * backlog = strmap_find(&backlogs, name, length);
+    if(!backlog && create){
+        backlog = calloc(1, sizeof(backlog_t));
+        backlog->username = strndup(name, length);
+        strmap_put(&backlogs, backlog->username, backlog);
+    }
+    return backlog;
+}
+
+/**
+ * @brief Remove backlog of user
+ * @param backlog - Backlog, it is freed
+ */
+void offline_backlog_free(backlog_t * backlog){
+    strmap_remove(&backlogs, backlog->username);
+    free(backlog->username);
+    free(backlog->stored);
+    free(backlog);
+}
+
+/**
+ * @brief Add message to backlog of its recipient
+ * @param segment - Segment with record
+ * @param offset - Offset of record in segment
+ * @param record - Header of record followed by recipient
+ *
+ * Used when message is stored and when store is loaded. Drain records only move the boundary of delivered messages - see offline_load().
+ */
+void offline_apply(segment_t * segment, uint32_t offset, const unsigned char * record){
+    uint32_t size = le32_get(record);
+    uint64_t seq = le32_get(record + 24) | (uint64_t)le32_get(record + 28) << 32;
+    if(seq > offlineSeq)
+        offlineSeq = seq;
+
+    backlog_t * backlog = offline_backlog((const char *)record + OFFLINE_HEADER, le32_get(record + 12), 1);
+    if(le32_get(record + 8) == OFFLINE_DRAIN){
+        if(seq > backlog->drained)
+            backlog->drained = seq;
+        return;
+    }
+
+    if(backlog->count == backlog->capacity){
+        backlog->capacity = backlog->capacity ? 2 * backlog->capacity : 8;
+        backlog->stored = realloc(backlog->stored, backlog->capacity * sizeof(stored_t));
+    }
+    backlog->stored[backlog->count++] = (stored_t){seq, segment->id, offset, size};
+    segment->records++;
+    segment->live++;
+    segment->liveBytes += size;
+    if((time_t)le32_get(record + 20) > segment->newest)
+        segment->newest = le32_get(record + 20);
+}
+
+/**
+ * @brief Create new active segment
+ * @param id - Id of segment
+ * @return 0 on success, -1 on error
+ */
+int offline_open(uint32_t id){
+    char path[PATH_MAX];
+    offline_path(path, id, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0){
+        perror(path);
+        return -1;
+    }
+    segments = realloc(segments, (segmentCount + 1) * sizeof(segment_t));
+    segments[segmentCount++] = (segment_t){.id = id, .fd = fd, .opened = time(NULL)};
+    return 0;
+}
+
+/**
+ * @brief Write index of segment to its index file
+ * @param segment - Segment, its index is in offlineIndex
+ *
+ * Index is written to temporary file and renamed - index file is either complete or missing.
+ */
+void offline_write_index(segment_t * segment){
+    char path[PATH_MAX], temporary[PATH_MAX];
+    offline_path(path, segment->id, "idx");
+    offline_path(temporary, segment->id, "idx.tmp");
+
+    unsigned char header[8];
+    le32_put(header, OFFLINE_INDEX_MAGIC);
+    le32_put(header + 4, segment->size);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    struct iovec iov[2] = {{header, 8}, {offlineIndex.data, offlineIndex.length}};
+    if(fd < 0 || writev(fd, iov, 2) != (ssize_t)(8 + offlineIndex.length) || fdatasync(fd) || rename(temporary, path))
+        perror("offline_write_index");
+    if(fd >= 0)
+        close(fd);
+    offlineIndex.length = 0;
+}
+
+/**
+ * @brief Seal active segment and start new one
+ *
+ * Index of sealed segment is written to its index file, so the segment does not have to be read when server starts.
+ */
+void offline_seal(){
+    offline_write_index(&segments[segmentCount - 1]);
+    offline_open(segments[segmentCount - 1].id + 1);
+}
+
+/**
+ * @brief Remove delivered or deleted messages from backlogs
+ * @param id - Messages in segment with this id are removed, 0 means messages older than the last drain record of their recipient
+ *
+ * Backlogs which become empty are freed.
+ */
+void offline_filter(uint32_t id){
+    int empty = 0;
+    backlog_t ** remove = malloc((backlogs.count + 1) * sizeof(backlog_t *));
+    for(size_t i=0; i<backlogs.capacity; i++){
+        backlog_t * backlog = backlogs.entries[i].value;
+        if(!backlogs.entries[i].key)
+            continue;
+        int kept = 0;
+        for(int j=0; j<backlog->count; j++){
+            stored_t * stored = &backlog->stored[j];
+            if(id ? stored->segment != id : stored->seq > backlog->drained)
+                backlog->stored[kept++] = *stored;
+            else if(!id){
+                segment_t * segment = offline_segment(stored->segment);
+                segment->live--;
+                segment->liveBytes -= stored->size;
+            }
+        }
+        backlog->count = kept;
+        if(!kept)
+            remove[empty++] = backlog;
+    }
+    for(int i=0; i<empty; i++)
+        offline_backlog_free(remove[i]);
+    free(remove);
+}
+
+/**
+ * @brief Delete the oldest segment
+ *
+ * Messages which were not delivered yet are removed from backlogs.
+ */
+void offline_drop(){
+    segment_t * segment = &segments[0];
+    if(segment->live)
+        offline_filter(segment->id);
+
+    char path[PATH_MAX];
+    offline_path(path, segment->id, "log");
+    unlink(path);
+    offline_path(path, segment->id, "idx");
+    unlink(path);
+    close(segment->fd);
+    segmentCount--;
+    memmove(segments, segments + 1, segmentCount * sizeof(segment_t));
+}
+
+/**
+ * @brief Copy undelivered messages of the oldest segment to active segment
+ *
+ * Records are copied unchanged - they keep their sequence numbers, so they are still delivered before newer messages.
+ * Copied messages are counted in active segment, so the oldest segment has no live message after this call.
+ */
+void offline_compact(){
+    segment_t * old = &segments[0];
+    for(size_t i=0; i<backlogs.capacity && old->live; i++){
+        backlog_t * backlog = backlogs.entries[i].value;
+        if(!backlogs.entries[i].key)
+            continue;
+        for(int j=0; j<backlog->count; j++){
+            stored_t * stored = &backlog->stored[j];
+            if(stored->segment != old->id)
+                continue;
+            offlineRead.length = 0;
+            bytes_reserve(&offlineRead, stored->size);
+            if(pread(old->fd, offlineRead.data, stored->size, stored->offset) != stored->size)
+                continue;
+
+            segment_t * active = &segments[segmentCount - 1];
+            uint32_t offset = active->size + offlinePending.length;
+            bytes_append(&offlinePending, offlineRead.data, stored->size);
+            offline_index_add(offset, (unsigned char *)offlineRead.data);
+            stored->segment = active->id;
+            stored->offset = offset;
+            active->records++;
+            active->live++;
+            active->liveBytes += stored->size;
+            if(old->newest > active->newest)
+                active->newest = old->newest;
+            old->live--;
+            old->liveBytes -= stored->size;
+        }
+    }
+}
+
+/**
+ * @brief Write records appended in this iteration of server loop and sync them to disk
+ *
+ * This is group commit - one fdatasync() covers all messages stored in one iteration, called before messages are delivered by server_flush().
+ * Sealed segments are deleted from the oldest one: segment is deleted when all its messages were delivered or they are older than retention time.
+ * The oldest segment with only few undelivered messages is compacted - its messages are copied to active segment and it is deleted after the copy is synced.
+ * Segments are never deleted out of order, because drain record in newer segment hides delivered messages in older segments.
+ */
+void offline_commit(){
+    if(!segmentCount)
+        return;
+    time_t now = time(NULL);
+    int compacted = 0;
+    if(segmentCount > 1 && segments[0].live && segments[0].newest >= now - offlineRetention * 86400L && segments[0].liveBytes < OFFLINE_SEGMENT_SIZE / 4){
+        offline_compact();
+        compacted = 1;
+    }
+
+    segment_t * active = &segments[segmentCount - 1];
+    if(offlinePending.length){
+        size_t done = 0;
+        while(done < offlinePending.length){
+            ssize_t written = pwrite(active->fd, offlinePending.data + done, offlinePending.length - done, active->size + done);
+            if(written < 0){
+                if(errno == EINTR)
+                    continue;
+                perror("offline_commit");
+                break;
+            }
+            done += written;
+        }
+        if(fdatasync(active->fd))
+            perror("offline_commit");
+        active->size += done;
+        offlinePending.length = 0;
+    }
+
+    //start new segment when the active one is big or old enough
+    if(active->size >= OFFLINE_SEGMENT_SIZE || (active->records && active->opened < now - OFFLINE_SEGMENT_AGE))
+        offline_seal();
+
+    //delete delivered and expired segments
+    while(segmentCount > 1 && (!segments[0].live || segments[0].newest < now - offlineRetention * 86400L)){
+        if(segments[0].live)
+            printf("%u undelivered messages expired\n", segments[0].live);
+        offline_drop();
+        compacted = 0;
+    }
+    if(compacted)
+        printf("Offline store compacted\n");
+}
+
+/**
+ * @brief Store message for user who is not logged in
+ * @param to - Recipient
+ * @param toLength - Length of recipient
+ * @param letter - Message
+ *
+ * Record is only appended to memory, it is written by offline_commit() at the end of server loop iteration.
+ * Number of message with receipt is kept after sender in record OFFLINE_RECEIPT.
+ */
+void offline_store(const char * to, size_t toLength, letter_t * letter){
+    if(!segmentCount)
+        return;
+    segment_t * active = &segments[segmentCount - 1];
+    uint32_t offset = active->size + offlinePending.length;
+    size_t start = offlinePending.length;
+    if(letter->seq){
+        char from[NAME_MAX + 24];
+        int fromLength = snprintf(from, sizeof(from), "%.*s#%llu", (int)letter->fromLength, letter->from, (unsigned long long)letter->seq);
+        offline_record(&offlinePending, OFFLINE_RECEIPT, ++offlineSeq, time(NULL), to, toLength, from, fromLength, letter->text, letter->textLength);
+    }
+    else
+        offline_record(&offlinePending, OFFLINE_MESSAGE, ++offlineSeq, time(NULL), to, toLength, letter->from, letter->fromLength, letter->text, letter->textLength);
+    unsigned char * record = (unsigned char *)offlinePending.data + start;
+    offline_index_add(offset, record);
+    offline_apply(active, offset, record);
+}
+
+/**
+ * @brief Deliver messages which were stored while user was offline
+ * @param user - User who has just logged in
+ *
+ * Messages are read from segments and composed to batches as big as one packet, so the backlog is written by few large writes.
+ * Drain record is stored at the end - messages are not delivered again after restart of server.
+ * Messages with receipt which were already acknowledged are skipped, others wait for acknowledgement again - see receipt_unacked().
+ */
+void offline_deliver(user_t * user){
+    backlog_t * backlog = strmap_get(&backlogs, user->username);
+    if(!backlog)
+        return;
+
+    //messages of this iteration must be in segment before they are read
+    if(offlinePending.length)
+        offline_commit();
+
+    bytes_t batch = {NULL, 0, 0};
+    int delivered = 0;
+    for(int i=0; i<backlog->count; i++){
+        stored_t * stored = &backlog->stored[i];
+        segment_t * segment = offline_segment(stored->segment);
+        if(!segment)
+            continue;
+        segment->live--;
+        segment->liveBytes -= stored->size;
+
+        offlineRead.length = 0;
+        bytes_reserve(&offlineRead, stored->size);
+        const unsigned char * p = (unsigned char *)offlineRead.data;
+        if(pread(segment->fd, offlineRead.data, stored->size, stored->offset) != stored->size || !offline_check(p, stored->size))
+            continue;
+
+        uint32_t toLength = le32_get(p + 12), fromLength = le32_get(p + 16);
+        const char * from = (const char *)p + OFFLINE_HEADER + toLength;
+        letter_t letter = {from, fromLength, from + fromLength, stored->size - OFFLINE_HEADER - toLength - fromLength, 0, {NULL, NULL}};
+        if(le32_get(p + 8) == OFFLINE_RECEIPT){
+            if(!receipt_letter(&letter))
+                continue;
+            pair_t * pair = receipt_pair(user->username, strlen(user->username), from, letter.fromLength, 1);
+            if(!pair || letter.seq <= pair->acked){
+                receiptsDuplicates++;
+                continue;
+            }
+            if(letter.seq > pair->sent)
+                pair->sent = letter.seq;
+            receipt_unacked(user, pair, letter.seq, letter.text, letter.textLength);
+        }
+        message_t * message = letter_message(&letter, user->binary);
+        if(batch.length && batch.length + message->length > PACKET_MAX){
+            message_t * m = message_new(batch.data, batch.length);
+            outbox_queue(user->outbox, m);
+            message_release(m);
+            batch.length = 0;
+        }
+        bytes_append(&batch, message->data, message->length);
+        letter_release(&letter);
+        delivered++;
+    }
+    if(batch.length){
+        message_t * m = message_new(batch.data, batch.length);
+        outbox_queue(user->outbox, m);
+        message_release(m);
+    }
+    free(batch.data);
+
+    //remember that messages were delivered
+    segment_t * active = &segments[segmentCount - 1];
+    uint32_t offset = active->size + offlinePending.length;
+    size_t start = offlinePending.length;
+    offline_record(&offlinePending, OFFLINE_DRAIN, ++offlineSeq, time(NULL), user->username, strlen(user->username), NULL, 0, NULL, 0);
+    offline_index_add(offset, (unsigned char *)offlinePending.data + start);
+    offline_backlog_free(backlog);
+
+    console("%d offline messages delivered to %s\n", delivered, user->username);
+}
+
+/**
+ * @brief Load index of sealed segment from its index file
+ * @param segment - Segment
+ * @return 0 on success, -1 if index file is missing or it does not match the segment
+ */
+int offline_load_index(segment_t * segment){
+    char path[PATH_MAX];
+    offline_path(path, segment->id, "idx");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    struct stat st;
+    fstat(fd, &st);
+    offlineRead.length = 0;
+    bytes_reserve(&offlineRead, st.st_size);
+    ssize_t n = pread(fd, offlineRead.data, st.st_size, 0);
+    close(fd);
+    const unsigned char * p = (unsigned char *)offlineRead.data;
+    if(n != st.st_size || n < 8 || le32_get(p) != OFFLINE_INDEX_MAGIC || le32_get(p + 4) != segment->size)
+        return -1;
+
+    //check all entries first, index is used only if it is complete
+    for(int apply=0; apply<2; apply++){
+        for(ssize_t i=8; i<n; ){
+            if(n - i < 4 + OFFLINE_HEADER)
+                return -1;
+            uint32_t offset = le32_get(p + i);
+            uint32_t length = OFFLINE_HEADER + le32_get(p + i + 4 + 12);
+            if(length > n - i - 4 || offset > segment->size)
+                return -1;
+            if(apply)
+                offline_apply(segment, offset, p + i + 4);
+            i += 4 + length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Load segment by reading all its records
+ * @param segment - Segment
+ *
+ * Used when segment has no valid index - it was active when server stopped. Damaged end of segment (server crashed during write) is cut off.
+ * Index of segment is rebuilt to offlineIndex.
+ */
+void offline_scan(segment_t * segment){
+    bytes_t data = {NULL, 0, 0};
+    bytes_reserve(&data, segment->size);
+    ssize_t n = pread(segment->fd, data.data, segment->size, 0);
+    if(n < 0)
+        n = 0;
+
+    uint32_t offset = 0;
+    while(offset < n){
+        const unsigned char * p = (unsigned char *)data.data + offset;
+        uint32_t size = offline_check(p, n - offset);
+        if(!size || (le32_get(p + 8) != OFFLINE_MESSAGE && le32_get(p + 8) != OFFLINE_DRAIN && le32_get(p + 8) != OFFLINE_RECEIPT))
+            break;
+        offline_index_add(offset, p);
+        offline_apply(segment, offset, p);
+        offset += size;
+    }
+    if(offset < segment->size){
+        printf("Offline store: segment %u damaged at %u, cut off\n", segment->id, offset);
+        if(ftruncate(segment->fd, offset))
+            perror("offline_scan");
+        segment->size = offset;
+    }
+    free(data.data);
+}
+
+/**
+ * @brief Compare messages by sequence number
+ */
+int stored_compare(const void * a, const void * b){
+    uint64_t x = ((const stored_t *)a)->seq, y = ((const stored_t *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief List segments in directory of store
+ * @param path - Directory, it is created if it does not exist
+ * @param count - Output, number of segments or -1 if directory can not be read
+ * @return Ids of segments in ascending order - it must be freed
+ */
+uint32_t * segment_list(const char * path, int * count){
+    *count = -1;
+    mkdir(path, 0700);
+    DIR * dir = opendir(path);
+    if(!dir){
+        perror(path);
+        return NULL;
+    }
+    uint32_t * ids = NULL;
+    *count = 0;
+    struct dirent * entry;
+    while((entry = readdir(dir))){
+        unsigned id;
+        char suffix[4];
+        if(sscanf(entry->d_name, "%8u.%3s", &id, suffix) == 2 && !strcmp(suffix, "log")){
+            ids = realloc(ids, (*count + 1) * sizeof(uint32_t));
+            ids[(*count)++] = id;
+        }
+    }
+    closedir(dir);
+    for(int i=1; i<*count; i++)
+        for(int j=i; j>0 && ids[j-1] > ids[j]; j--){
+            uint32_t id = ids[j];
+            ids[j] = ids[j-1];
+            ids[j-1] = id;
+        }
+    return ids;
+}
+
+/**
+ * @brief Load offline store
+ *
+ * Segments are loaded from the oldest one - sealed segments from their index files, segments without index are read whole and sealed.
+ * Messages older than the last drain record of their recipient were delivered and they are skipped. New active segment is started.
+ */
+void offline_load(){
+    int count;
+    uint32_t * ids = segment_list(offlineDir, &count);
+    if(count < 0)
+        return;
+
+    for(int i=0; i<count; i++){
+        char path[PATH_MAX];
+        offline_path(path, ids[i], "log");
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if(fd < 0){
+            perror(path);
+            continue;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        segments = realloc(segments, (segmentCount + 1) * sizeof(segment_t));
+        segment_t * segment = &segments[segmentCount++];
+        *segment = (segment_t){.id = ids[i], .fd = fd, .size = st.st_size, .opened = st.st_mtime};
+        if(offline_load_index(segment)){
+            segment->records = segment->live = segment->liveBytes = segment->newest = 0;
+            offline_scan(segment);
+            offline_write_index(segment);
+        }
+    }
+    free(ids);
+
+    //drop delivered messages
+    offline_filter(0);
+    for(size_t i=0; i<backlogs.capacity; i++){
+        backlog_t * backlog = backlogs.entries[i].value;
+        if(backlogs.entries[i].key)
+            qsort(backlog->stored, backlog->count, sizeof(stored_t), stored_compare);
+    }
+
+    offline_open(segmentCount ? segments[segmentCount - 1].id + 1 : 1);
+    offline_commit();
+    printf("Offline store: %zu users have undelivered messages\n", backlogs.count);
+}
+
+/**
+ * @brief Compose name of file of history segment
+ * @param path - Output, PATH_MAX bytes
+ * @param id - Id of segment
+ * @param suffix - "log" for records, "idx" for index
+ */
+void history_path(char * path, uint32_t id, const char * suffix){
+    snprintf(path, PATH_MAX, "%s/%08u.%s", historyDir, id, suffix);
+}
+
+/**
+ * @brief Map segment of history to memory and add it after other segments
+ * @param id - Id of segment
+ * @param fd - Opened log file, it is closed on error
+ * @param size - Number of valid bytes in log file
+ * @return Segment or NULL on error
+ *
+ * Whole HISTORY_SEGMENT_SIZE is mapped at once, records appended later by history_commit() are visible in the same mapping.
+ */
+volume_t * history_map(uint32_t id, int fd, uint32_t size){
+    void * map = mmap(NULL, HISTORY_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        perror("history_map");
+        close(fd);
+        return NULL;
+    }
+    volumes = realloc(volumes, (volumeCount + 1) * sizeof(volume_t));
+    volume_t * volume = &volumes[volumeCount++];
+    *volume = (volume_t){.id = id, .fd = fd, .size = size, .first = historyCount, .map = map, .opened = time(NULL)};
+    return volume;
+}
+
+/**
+ * @brief Create new active segment of history
+ * @param id - Id of segment
+ * @return 0 on success, -1 on error
+ */
+int history_open(uint32_t id){
+    char path[PATH_MAX];
+    history_path(path, id, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0){
+        perror(path);
+        return -1;
+    }
+    return history_map(id, fd, 0) ? 0 : -1;
+}
+
+/**
+ * @brief Find segment of history
+ * @param id - Id of segment
+ * @return Segment or NULL if it was deleted
+ */
+volume_t * history_volume(uint32_t id){
+    int low = 0, high = volumeCount - 1;
+    while(low <= high){
+        int middle = (low + high) / 2;
+        if(volumes[middle].id == id)
+            return &volumes[middle];
+        if(volumes[middle].id < id)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find record of message in history
+ * @param number - Number of message, it must not be older than historyBase
+ * @return Record in mapped segment or NULL if it was not written
+ */
+const unsigned char * history_record(uint32_t number){
+    uint64_t position = historyPositions[number - historyBase];
+    volume_t * volume = history_volume(position >> 32);
+    uint32_t offset = position;
+    return volume && offset < volume->size ? volume->map + offset : NULL;
+}
+
+/**
+ * @brief Get time of message in history
+ * @param number - Number of message
+ * @return Time when message was sent
+ */
+time_t history_time(uint32_t number){
+    const unsigned char * record = history_record(number);
+    return record ? (time_t)le32_get(record + 20) : 0;
+}
+
+/**
+ * @brief Find list of messages
+ * @param map - Map of lists
+ * @param key - Key of list, it does not have to be terminated by zero
+ * @param length - Length of key
+ * @param more - Number of messages which will be added to list
+ * @return List with space for more messages, it is created if it does not exist
+ */
+postings_t * postings_get(strmap_t * map, const char * key, size_t length, uint32_t more){
+    postings_t * list = strmap_find(map, key, length);
+    if(!list){
+        list = calloc(1, sizeof(postings_t) + length + 1);
+        memcpy(list->key, key, length);
+        strmap_put(map, list->key, list);
+    }
+    if(list->count + more > list->capacity){
+        while(list->count + more > list->capacity)
+            list->capacity = list->capacity ? 2 * list->capacity : 4;
+        list->numbers = realloc(list->numbers, list->capacity * sizeof(uint32_t));
+    }
+    return list;
+}
+
+/**
+ * @brief Add message to list of messages
+ * @param map - Map of lists
+ * @param key - Key of list, it does not have to be terminated by zero
+ * @param length - Length of key
+ * @param number - Number of message, it is not smaller than numbers in the list
+ *
+ * List is created when the first message is added. Message is added only once, even if it contains the same word more times.
+ */
+void postings_add(strmap_t * map, const char * key, size_t length, uint32_t number){
+    postings_t * list = postings_get(map, key, length, 1);
+    if(!list->count || list->numbers[list->count - 1] != number)
+        list->numbers[list->count++] = number;
+}
+
+/**
+ * @brief Find position of message in list
+ * @param list - List of messages
+ * @param number - Number of message
+ * @return Index of the first message with the same or bigger number
+ */
+uint32_t postings_position(postings_t * list, uint32_t number){
+    uint32_t low = 0, high = list->count;
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        if(list->numbers[middle] < number)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * @brief Remove deleted messages from all lists of map
+ * @param map - Map of lists
+ *
+ * Numbers older than historyBase are at the beginning of every list. Lists which become empty are freed.
+ */
+void postings_trim(strmap_t * map){
+    size_t empty = 0;
+    postings_t ** remove = malloc((map->count + 1) * sizeof(postings_t *));
+    for(size_t i=0; i<map->capacity; i++){
+        postings_t * list = map->entries[i].value;
+        if(!map->entries[i].key)
+            continue;
+        uint32_t old = 0;
+        while(old < list->count && list->numbers[old] < historyBase)
+            old++;
+        list->count -= old;
+        memmove(list->numbers, list->numbers + old, list->count * sizeof(uint32_t));
+        if(!list->count)
+            remove[empty++] = list;
+    }
+    for(size_t i=0; i<empty; i++){
+        strmap_remove(map, remove[i]->key);
+        free(remove[i]->numbers);
+        free(remove[i]);
+    }
+    free(remove);
+}
+
+/**
+ * @brief Compose key of conversation of two users
+ * @param key - Output, 2 * NAME_MAX + 2 bytes
+ * @param a - Username
+ * @param aLength - Length of a
+ * @param b - Username
+ * @param bLength - Length of b
+ * @return Length of key
+ *
+ * Names are ordered, so both users find the same conversation.
+ */
+size_t history_pair(char * key, const char * a, size_t aLength, const char * b, size_t bLength){
+    int order = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if(order > 0 || (!order && aLength > bLength)){
+        const char * name = a;
+        size_t length = aLength;
+        a = b;
+        aLength = bLength;
+        b = name;
+        bLength = length;
+    }
+    memcpy(key, a, aLength);
+    key[aLength] = '/';
+    memcpy(key + aLength + 1, b, bLength);
+    return aLength + 1 + bLength;
+}
+
+/**
+ * @brief Read next word of text
+ * @param text - Text
+ * @param length - Length of text
+ * @param i - Position in text, it is moved after the word
+ * @param word - Output, HISTORY_WORD bytes
+ * @return Length of word, 0 at the end of text
+ *
+ * Word is a sequence of letters, digits and bytes of UTF-8 characters - words of any language are found, ASCII letters are converted to lower case.
+ * Longer words are cut to HISTORY_WORD bytes.
+ */
+size_t history_word(const char * text, size_t length, size_t * i, char * word){
+    size_t n = 0;
+    while(*i < length && !isalnum((unsigned char)text[*i]) && (unsigned char)text[*i] < 0x80)
+        (*i)++;
+    for(; *i < length && (isalnum((unsigned char)text[*i]) || (unsigned char)text[*i] >= 0x80); (*i)++)
+        if(n < HISTORY_WORD)
+            word[n++] = tolower((unsigned char)text[*i]);
+    return n;
+}
+
+/**
+ * @brief Add message to word index of its owner
+ * @param owner - User or "#group"
+ * @param ownerLength - Length of owner
+ * @param text - Text of message
+ * @param textLength - Length of text
+ * @param number - Number of message
+ */
+void history_words(const char * owner, size_t ownerLength, const char * text, size_t textLength, uint32_t number){
+    char key[NAME_MAX + HISTORY_WORD + 3];
+    memcpy(key, owner, ownerLength);
+    key[ownerLength] = '/';
+    size_t i = 0, length;
+    while((length = history_word(text, textLength, &i, key + ownerLength + 1)))
+        postings_add(&historyWords, key, ownerLength + 1 + length, number);
+}
+
+/**
+ * @brief Give number to message and add it to indexes
+ * @param volume - Segment with record
+ * @param offset - Offset of record in segment
+ * @param record - Record
+ *
+ * Used when message is added to history and when history is loaded, so indexes are built one message after another.
+ * Message is added to the list of its conversation and to word index of both users - message to group only to word index of the group.
+ */
+void history_index(volume_t * volume, uint32_t offset, const unsigned char * record){
+    if(historyCount - historyBase == historyCapacity){
+        historyCapacity = historyCapacity ? 2 * historyCapacity : 4096;
+        historyPositions = realloc(historyPositions, historyCapacity * sizeof(uint64_t));
+    }
+    uint32_t number = historyCount++;
+    historyPositions[number - historyBase] = (uint64_t)volume->id << 32 | offset;
+    if((time_t)le32_get(record + 20) > volume->newest)
+        volume->newest = le32_get(record + 20);
+
+    uint32_t toLength = le32_get(record + 12), fromLength = le32_get(record + 16);
+    const char * to = (const char *)record + OFFLINE_HEADER;
+    const char * from = to + toLength;
+    const char * text = from + fromLength;
+    size_t textLength = le32_get(record) - OFFLINE_HEADER - toLength - fromLength;
+    if(!toLength || toLength > NAME_MAX + 1 || !fromLength || fromLength > NAME_MAX)
+        return;
+
+    if(to[0] == '#'){
+        postings_add(&conversations, to, toLength, number);
+        history_words(to, toLength, text, textLength, number);
+        return;
+    }
+    char key[2 * NAME_MAX + 2];
+    postings_add(&conversations, key, history_pair(key, from, fromLength, to, toLength), number);
+    history_words(from, fromLength, text, textLength, number);
+    history_words(to, toLength, text, textLength, number);
+}
+
+/**
+ * @brief Delete the oldest segment of history
+ *
+ * Positions of its messages are removed and all lists are trimmed - numbers of other messages do not change.
+ */
+void history_drop(){
+    volume_t * volume = &volumes[0];
+    uint32_t base = volumes[1].first;
+    char path[PATH_MAX];
+    history_path(path, volume->id, "log");
+    unlink(path);
+    history_path(path, volume->id, "idx");
+    unlink(path);
+    munmap((void *)volume->map, HISTORY_SEGMENT_SIZE);
+    close(volume->fd);
+    volumeCount--;
+    memmove(volumes, volumes + 1, volumeCount * sizeof(volume_t));
+
+    memmove(historyPositions, historyPositions + (base - historyBase), (historyCount - base) * sizeof(uint64_t));
+    historyBase = base;
+    postings_trim(&conversations);
+    postings_trim(&historyWords);
+}
+
+/**
+ * @brief Append parts of lists which belong to segment to its index
+ * @param out - Index
+ * @param map - Map of lists
+ * @param kind - 0 for conversations, 1 for words
+ * @param first - Number of the first message of segment
+ * @param end - Number after the last message of segment
+ */
+void history_index_lists(bytes_t * out, strmap_t * map, int kind, uint32_t first, uint32_t end){
+    for(size_t i=0; i<map->capacity; i++){
+        postings_t * list = map->entries[i].value;
+        if(!map->entries[i].key)
+            continue;
+        uint32_t from = postings_position(list, first), to = postings_position(list, end);
+        if(from == to)
+            continue;
+        size_t length = strlen(list->key);
+        bytes_reserve(out, 8 + length + 4 * (to - from));
+        unsigned char * p = (unsigned char *)out->data + out->length;
+        le32_put(p, (uint32_t)kind << 24 | length);
+        memcpy(p + 4, list->key, length);
+        le32_put(p + 4 + length, to - from);
+        p += 8 + length;
+        for(uint32_t j=from; j<to; j++, p += 4)
+            le32_put(p, list->numbers[j] - first);
+        out->length = (char *)p - out->data;
+    }
+}
+
+/**
+ * @brief Write index of history segment to its index file
+ * @param volume - Segment, all its messages are written
+ *
+ * Index has positions of messages and parts of all lists which belong to the segment, so the segment does not have to be read when server starts.
+ * It is written to temporary file which is renamed - index file is either complete or missing.
+ * <pre>
+ * uint32 magic ("HIDX")
+ * uint32 size of segment
+ * uint32 number of messages
+ * uint32 time of the newest message
+ * uint32 offset of every message
+ * lists - uint32 kind << 24 | length of key, key, uint32 number of messages, uint32 numbers relative to the first message of segment
+ * </pre>
+ */
+void history_write_index(volume_t * volume){
+    uint32_t first = volume->first;
+    uint32_t end = volume < &volumes[volumeCount - 1] ? volume[1].first : historyCount;
+    bytes_t index = {NULL, 0, 0};
+    bytes_reserve(&index, 16 + 4 * (end - first));
+    unsigned char * p = (unsigned char *)index.data;
+    le32_put(p, HISTORY_INDEX_MAGIC);
+    le32_put(p + 4, volume->size);
+    le32_put(p + 8, end - first);
+    le32_put(p + 12, volume->newest);
+    for(uint32_t i=first; i<end; i++)
+        le32_put(p + 16 + 4 * (i - first), historyPositions[i - historyBase]);
+    index.length = 16 + 4 * (end - first);
+    history_index_lists(&index, &conversations, 0, first, end);
+    history_index_lists(&index, &historyWords, 1, first, end);
+
+    char path[PATH_MAX], temporary[PATH_MAX];
+    history_path(path, volume->id, "idx");
+    history_path(temporary, volume->id, "idx.tmp");
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    size_t done = 0;
+    while(fd >= 0 && done < index.length){
+        ssize_t written = write(fd, index.data + done, index.length - done);
+        if(written <= 0)
+            break;
+        done += written;
+    }
+    if(fd < 0 || done != index.length || rename(temporary, path))
+        perror("history_write_index");
+    if(fd >= 0)
+        close(fd);
+    free(index.data);
+}
+
+/**
+ * @brief Seal active segment of history and start new one
+ */
+void history_seal(){
+    history_write_index(&volumes[volumeCount - 1]);
+    history_open(volumes[volumeCount - 1].id + 1);
+}
+
+/**
+ * @brief Index and write records appended in this iteration of server loop
+ *
+ * History is not synced to disk like offline store - after crash of the machine the newest messages can be missing in history, but they were delivered.
+ * Active segment is sealed when it is older than HISTORY_SEGMENT_AGE, so history is deleted by whole days. Segments older than retention time are deleted from the oldest one.
+ */
+void history_commit(){
+    if(!volumeCount)
+        return;
+    volume_t * active = &volumes[volumeCount - 1];
+    if(historyPending.length){
+        for(size_t offset = 0; offset < historyPending.length; offset += le32_get((unsigned char *)historyPending.data + offset))
+            history_index(active, active->size + offset, (unsigned char *)historyPending.data + offset);
+        historyQueued = 0;
+
+        size_t done = 0;
+        while(done < historyPending.length){
+            ssize_t written = pwrite(active->fd, historyPending.data + done, historyPending.length - done, active->size + done);
+            if(written < 0){
+                if(errno == EINTR)
+                    continue;
+                perror("history_commit");
+                break;
+            }
+            done += written;
+        }
+        active->size += done;
+        historyPending.length = 0;
+    }
+
+    time_t now = time(NULL);
+    if(active->size && active->opened < now - HISTORY_SEGMENT_AGE)
+        history_seal();
+    while(volumeCount > 1 && volumes[0].newest < now - historyRetention * 86400L)
+        history_drop();
+}
+
+/**
+ * @brief Add message to history
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param to - Recipient, "#group" for message posted to group
+ * @param toLength - Length of recipient
+ * @param text - Text of message
+ * @param textLength - Length of text
+ *
+ * Record is only appended to memory, it is indexed and written by history_commit() after messages of server loop iteration are delivered.
+ */
+void history_add(const char * from, size_t fromLength, const char * to, size_t toLength, const char * text, size_t textLength){
+    if(!volumeCount)
+        return;
+    size_t size = OFFLINE_HEADER + toLength + fromLength + textLength;
+    volume_t * active = &volumes[volumeCount - 1];
+    if(active->size + historyPending.length + size > HISTORY_SEGMENT_SIZE){
+        history_commit();
+        active = &volumes[volumeCount - 1];
+        if(active->size + size > HISTORY_SEGMENT_SIZE){
+            history_seal();
+            if(volumes[volumeCount - 1].size)
+                return;
+            active = &volumes[volumeCount - 1];
+        }
+    }
+    offline_record(&historyPending, OFFLINE_MESSAGE, historyCount + historyQueued++, time(NULL), to, toLength, from, fromLength, text, textLength);
+}
+
+/**
+ * @brief Write history before server exits
+ *
+ * Index of active segment is written too - next server starts new active segment, so the index stays valid and the segment is not read again.
+ */
+void history_close(){
+    history_commit();
+    if(volumeCount && volumes[volumeCount - 1].size)
+        history_write_index(&volumes[volumeCount - 1]);
+}
+
+/**
+ * @brief Index all messages of segment of history
+ * @param volume - Segment, it is mapped to memory
+ *
+ * Damaged end of segment (server crashed during write) is cut off.
+ */
+void history_scan(volume_t * volume){
+    uint32_t offset = 0;
+    while(offset < volume->size){
+        const unsigned char * p = volume->map + offset;
+        uint32_t size = offline_check(p, volume->size - offset);
+        if(!size || le32_get(p + 8) != OFFLINE_MESSAGE)
+            break;
+        history_index(volume, offset, p);
+        offset += size;
+    }
+    if(offset < volume->size){
+        printf("History: segment %u damaged at %u, cut off\n", volume->id, offset);
+        if(ftruncate(volume->fd, offset))
+            perror("history_scan");
+        volume->size = offset;
+    }
+}
+
+/**
+ * @brief Load indexes of history segment from its index file
+ * @param volume - Segment
+ * @return 0 on success, -1 if index file is missing or it does not match the segment
+ *
+ * Parts of lists are appended to lists of previous segments, no message is read. Index is checked first and it is used only if it is complete.
+ */
+int history_load_index(volume_t * volume){
+    char path[PATH_MAX];
+    history_path(path, volume->id, "idx");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    struct stat st;
+    fstat(fd, &st);
+    const unsigned char * p = st.st_size >= 16 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(p == MAP_FAILED)
+        return -1;
+
+    size_t n = st.st_size;
+    uint32_t records = le32_get(p + 8);
+    int valid = le32_get(p) == HISTORY_INDEX_MAGIC && le32_get(p + 4) == volume->size && (n - 16) / 4 >= records;
+    for(int apply=0; apply<2 && valid; apply++){
+        if(apply){
+            for(uint32_t i=0; i<records; i++){
+                if(historyCount - historyBase == historyCapacity){
+                    historyCapacity = historyCapacity ? 2 * historyCapacity : 4096;
+                    historyPositions = realloc(historyPositions, historyCapacity * sizeof(uint64_t));
+                }
+                historyPositions[historyCount++ - historyBase] = (uint64_t)volume->id << 32 | le32_get(p + 16 + 4 * i);
+            }
+            volume->newest = le32_get(p + 12);
+        }
+        for(size_t i = 16 + 4 * (size_t)records; i < n && valid; ){
+            uint32_t head = n - i >= 8 ? le32_get(p + i) : 0;
+            size_t length = head & 0xFFFFFF;
+            int kind = head >> 24;
+            uint32_t count = length && n - i - 8 >= length ? le32_get(p + i + 4 + length) : 0;
+            if(!count || kind > 1 || (n - i - 8 - length) / 4 < count){
+                valid = 0;
+                break;
+            }
+            const unsigned char * number = p + i + 8 + length;
+            if(!apply){
+                for(uint32_t j=0; j<count && valid; j++)
+                    valid = le32_get(number + 4 * j) < records;
+            }
+            else{
+                postings_t * list = postings_get(kind ? &historyWords : &conversations, (const char *)p + i + 4, length, count);
+                for(uint32_t j=0; j<count; j++)
+                    list->numbers[list->count++] = volume->first + le32_get(number + 4 * j);
+            }
+            i += 8 + length + 4 * (size_t)count;
+        }
+    }
+    munmap((void *)p, n);
+    return valid ? 0 : -1;
+}
+
+/**
+ * @brief Load history
+ *
+ * Segments are mapped to memory from the oldest one - messages get the same order as before. Indexes of sealed segments are loaded from their index files,
+ * segments without index are read whole and their index is written. New messages are written to new active segment, empty segment left by previous run is used again.
+ */
+void history_load(){
+    if(historyRetention <= 0)
+        return;
+    int count;
+    uint32_t * ids = segment_list(historyDir, &count);
+    if(count < 0)
+        return;
+
+    for(int i=0; i<count; i++){
+        char path[PATH_MAX];
+        history_path(path, ids[i], "log");
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if(fd < 0){
+            perror(path);
+            continue;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        volume_t * volume = history_map(ids[i], fd, st.st_size < HISTORY_SEGMENT_SIZE ? st.st_size : HISTORY_SEGMENT_SIZE);
+        if(volume){
+            volume->opened = st.st_mtime;
+            if(history_load_index(volume)){
+                history_scan(volume);
+                if(volume->size)
+                    history_write_index(volume);
+            }
+        }
+    }
+    free(ids);
+
+    if(!volumeCount || volumes[volumeCount - 1].size)
+        history_open(volumeCount ? volumes[volumeCount - 1].id + 1 : 1);
+    else
+        volumes[volumeCount - 1].opened = time(NULL);
+    history_commit();
+    printf("History: %u messages\n", historyCount - historyBase);
+}
+
+/**
+ * @brief Check if user is registered
+ * @param name - Username
+ * @param length - Length of username
+ * @return 1 if user is in login file, 0 otherwise
+ */
+int user_registered(const char * name, size_t length){
+    //credentials can be loaded by authentication thread at the same time
+    pthread_rwlock_rdlock(&credentialsLock);
+    int registered = strmap_find(&credentials, name, length) != NULL;
+    pthread_rwlock_unlock(&credentialsLock);
+    if(registered)
+        return 1;
+
+    pthread_rwlock_wrlock(&credentialsLock);
+    if(__atomic_exchange_n(&credentialsStale, 0, __ATOMIC_ACQ_REL) || credentials_changed())
+        credentials_load();
+    registered = strmap_find(&credentials, name, length) != NULL;
+    pthread_rwlock_unlock(&credentialsLock);
+    return registered;
+}
+
+/**
+ * @brief Find position of username in sorted index of online users
+ * @param name - Username, it does not have to be terminated by zero
+ * @param length - Length of username
+ * @return Position of the first username which is not less than name
+ */
+size_t online_position(const char * name, size_t length){
+    size_t low = 0, high = onlineCount;
+    while(low < high){
+        size_t middle = (low + high) / 2;
+        const char * other = onlineIndex[middle];
+        size_t otherLength = strlen(other);
+        int cmp = memcmp(other, name, otherLength < length ? otherLength : length);
+        if(cmp < 0 || (cmp == 0 && otherLength < length))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * @brief Add logged user to sorted index of online users
+ * @param user - User
+ */
+void online_add(user_t * user){
+    if(onlineCount == onlineCapacity){
+        onlineCapacity = onlineCapacity ? 2 * onlineCapacity : SERVER_CAPACITY;
+        onlineIndex = realloc(onlineIndex, onlineCapacity * sizeof(char *));
+    }
+    size_t pos = online_position(user->username, strlen(user->username));
+    memmove(onlineIndex + pos + 1, onlineIndex + pos, (onlineCount - pos) * sizeof(char *));
+    onlineIndex[pos] = user->username;
+    onlineCount++;
+}
+
+/**
+ * @brief Remove user from sorted index of online users
+ * @param user - User
+ */
+void online_remove(user_t * user){
+    size_t pos = online_position(user->username, strlen(user->username));
+    if(pos == onlineCount || onlineIndex[pos] != user->username)
+        return;
+    onlineCount--;
+    memmove(onlineIndex + pos, onlineIndex + pos + 1, (onlineCount - pos) * sizeof(char *));
+}
+
+/**
+ * @brief Tell all subscribed users that user went online or offline
+ * @param user - User who logged in or out
+ * @param online - 1 if user logged in, 0 if he logged out
+ *
+ * Notice is created at most once for text and once for binary clients and it is shared by all watchers.
+ */
+void presence_notify(user_t * user, int online){
+    if(!watcherCount)
+        return;
+    char text[NAME_MAX + 32];
+    snprintf(text, sizeof(text), "User %s is %s\n", user->username, online ? "online" : "offline");
+    message_t * notice[2] = {NULL, NULL};
+    for(int i=0; i<watcherCount; i++){
+        user_t * watcher = presenceWatchers[i];
+        if(watcher == user || !watcher->outbox)
+            continue;
+        if(!notice[watcher->binary])
+            notice[watcher->binary] = message_notice(text, watcher->binary);
+        outbox_queue(watcher->outbox, notice[watcher->binary]);
+    }
+    for(int i=0; i<2; i++)
+        if(notice[i])
+            message_release(notice[i]);
+}
+
+/**
+ * @brief Subscribe user to changes of presence or cancel subscription
+ * @param user - Logged user
+ * @param subscribe - 1 for subscription, 0 for cancel
+ */
+void presence_subscribe(user_t * user, int subscribe){
+    if(subscribe && user->watcher < 0){
+        if(watcherCount == watcherCapacity){
+            watcherCapacity = watcherCapacity ? 2 * watcherCapacity : 64;
+            presenceWatchers = realloc(presenceWatchers, watcherCapacity * sizeof(user_t *));
+        }
+        user->watcher = watcherCount;
+        presenceWatchers[watcherCount++] = user;
+    }
+    else if(!subscribe && user->watcher >= 0){
+        user_t * last = presenceWatchers[--watcherCount];
+        presenceWatchers[user->watcher] = last;
+        last->watcher = user->watcher;
+        user->watcher = -1;
+    }
+}
+
+/**
+ * @brief Queue frame for other node
+ * @param peer - Node
+ * @param type - Type of link frame
+ * @param count - Number of fields
+ * @param field - Fields
+ * @param length - Lengths of fields
+ * @return 1 if frame was queued, 0 if link is not connected, it is full or frame is too long
+ *
+ * Frames are written by cluster_flush() at the end of iteration of server loop.
+ */
+int peer_queue(peer_t * peer, int type, int count, const char ** field, const size_t * length){
+    size_t size = FRAME_HEADER + 4 * count;
+    for(int i=0; i<count; i++)
+        size += length[i];
+    if(!peer->connected || size > FRAME_MAX || peer->out.length - peer->outStart + size > LINK_BUFFER)
+        return 0;
+    message_t * frame = frame_new(type, count, field, length);
+    bytes_append(&peer->out, frame->data, frame->length);
+    message_release(frame);
+    return 1;
+}
+
+/**
+ * @brief Tell all other nodes that user logged in or out of this node
+ * @param user - User
+ * @param online - 1 if user logged in, 0 if he logged out
+ */
+void cluster_presence(user_t * user, int online){
+    if(!nodeId)
+        return;
+    const char * field[1] = {user->username};
+    size_t length[1] = {strlen(user->username)};
+    for(int i=1; i<=MAX_NODES; i++)
+        if(peers[i].id && i != nodeId)
+            peer_queue(&peers[i], online ? LINK_ONLINE : LINK_OFFLINE, 1, field, length);
+}
+
+/**
+ * @brief Find user logged in on other node
+ * @param name - Username, it does not have to be terminated by zero
+ * @param length - Length of username
+ * @return Entry of routing directory or NULL
+ */
+remote_t * remote_find(const char * name, size_t length){
+    return strmap_find(&directory, name, length);
+}
+
+/**
+ * @brief Remove user of other node from routing directory
+ * @param remote - Entry of directory
+ */
+void remote_remove(remote_t * remote){
+    if(remote->prev)
+        remote->prev->next = remote->next;
+    else
+        peers[remote->node].remotes = remote->next;
+    if(remote->next)
+        remote->next->prev = remote->prev;
+    strmap_remove(&directory, remote->name);
+    free(remote);
+}
+
+/**
+ * @brief Add user logged in on other node to routing directory
+ * @param node - Id of node
+ * @param name - Username, it does not have to be terminated by zero
+ * @param length - Length of username
+ *
+ * User who was known on another node is moved - the newest login wins.
+ */
+void remote_add(int node, const char * name, size_t length){
+    remote_t * remote = remote_find(name, length);
+    if(remote)
+        remote_remove(remote);
+    remote = malloc(sizeof(remote_t) + length + 1);
+    memcpy(remote->name, name, length);
+    remote->name[length] = '\0';
+    remote->node = node;
+    remote->prev = NULL;
+    remote->next = peers[node].remotes;
+    if(remote->next)
+        remote->next->prev = remote;
+    peers[node].remotes = remote;
+    strmap_put(&directory, remote->name, remote);
+}
+
+/**
+ * @brief Remove all users of node from routing directory - link from the node was closed
+ * @param node - Id of node
+ */
+void remote_clear(int node){
+    while(peers[node].remotes)
+        remote_remove(peers[node].remotes);
+}
+
+/**
+ * @brief Close outgoing link to other node - frames which were not written are dropped, link is connected again by cluster_timer()
+ * @param peer - Node
+ */
+void peer_close(peer_t * peer){
+    if(peer->watch.fd >= 0){
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, peer->watch.fd, NULL);
+        close(peer->watch.fd);
+    }
+    peer->watch.fd = -1;
+    peer->connected = 0;
+    peer->out.length = peer->outStart = 0;
+}
+
+/**
+ * @brief Write queued frames to outgoing link
+ * @param peer - Node
+ *
+ * If socket is full, the rest is written when epoll reports that it is writable again.
+ */
+void peer_flush(peer_t * peer){
+    while(peer->outStart < peer->out.length){
+        ssize_t n = send(peer->watch.fd, peer->out.data + peer->outStart, peer->out.length - peer->outStart, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN){
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.ptr = &peer->watch;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, peer->watch.fd, &ev);
+            return;
+        }
+        if(n < 0){
+            perror("peer_flush");
+            peer_close(peer);
+            return;
+        }
+        peer->outStart += n;
+    }
+    peer->out.length = peer->outStart = 0;
+}
+
+/**
+ * @brief Write frames queued in this iteration of server loop to all other nodes
+ */
+void cluster_flush(){
+    if(!nodeId)
+        return;
+    for(int i=1; i<=MAX_NODES; i++)
+        if(peers[i].connected && peers[i].out.length)
+            peer_flush(&peers[i]);
+}
+
+/**
+ * @brief Find logged user
+ * @param name - Username
+ * @return User or NULL if user is not logged in
+ */
+user_t * user_find(char * name){
+    return strmap_get(&sessions, name);
+}
+
+/**
+ * @brief Find logged user by field of request
+ * @param request - Request
+ * @param i - Index of field with username
+ * @return User or NULL if user is not logged in
+ */
+user_t * user_find_field(request_t * request, int i){
+    return strmap_find(&sessions, request->field[i], request->length[i]);
+}
+
+/**
+ * @brief Make sure that there is a free slot for logged user
+ * @return 1 if there is a free slot, 0 if the array of users is full and it can not grow
+ */
+int users_reserve(){
+    if(freeCount || usersUsed < usersCapacity)
+        return 1;
+    int capacity = 2 * usersCapacity;
+    user_t ** users = realloc(users_logged, capacity * sizeof(user_t *));
+    int * slots = realloc(freeSlots, capacity * sizeof(int));
+    if(users)
+        users_logged = users;
+    if(slots)
+        freeSlots = slots;
+    if(!users || !slots)
+        return 0;
+    memset(users_logged + usersCapacity, 0, (capacity - usersCapacity) * sizeof(user_t *));
+    usersCapacity = capacity;
+    return 1;
+}
+
+/**
+ * @brief Put user with opened outbox to the table of logged users
+ * @param user - User, there must be a free slot - see users_reserve()
+ */
+void user_attach(user_t * user){
+    user->slot = freeCount ? freeSlots[--freeCount] : usersUsed++;
+    users_logged[user->slot] = user;
+    strmap_put(&sessions, user->username, user);
+    online_add(user);
+    if(user->connection)
+        user->connection->user = user;
+}
+
+/**
+ * @brief Login user to server
+ * @param user - User to be logged
+ * @return 1 if login was successful, 0 otherwise (user is already logged in, there is no memory for more users or client's named pipe can not be opened)
+ *
+ * User is put to the last freed slot in the array of users structures. If there is no freed slot, the first never used slot is taken and the array is doubled when it is full.
+ * User is also indexed by username in sessions map.
+ * Named pipe of user (or duplicate of his socket) is opened here and it stays open until logout - see outbox_open().
+ *
+ */
+
+//login user - add user to list of logged in users
+int user_login(user_t * user){
+
+    //user can be logged in only once
+    if(user_find(user->username) || !users_reserve())
+        return 0;
+
+    //open persistent output channel to user, client must be already reading its named pipe
+    user->outbox = outbox_open(user->username, user->connection);
+    if(!user->outbox)
+        return 0;
+
+    user_attach(user);
+    presence_notify(user, 1);
+    cluster_presence(user, 1);
+
+    //print message in server console
+    console("user %s logged in.\n",user->username);
+
+    //send message to user - login OK
+    message_send(user,"Login OK\n");
+
+    //messages received while user was offline
+    offline_deliver(user);
+    return 1;
+
+}
+
+/**
+ * @brief Find group
+ * @param name - Name of group
+ * @param length - Length of name
+ * @return Group or NULL if it does not exist
+ */
+group_t * group_find(const char * name, size_t length){
+    return strmap_find(&groups, name, length);
+}
+
+/**
+ * @brief Check if user is member of group
+ * @param group - Group
+ * @param user - Logged user
+ * @return 1 if user is member of group
+ */
+int group_is_member(group_t * group, user_t * user){
+    for(int i=0; i<user->groupCount; i++)
+        if(user->groups[i] == group)
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief Add user to group
+ * @param group - Group
+ * @param user - Logged user, it must not be member of group
+ *
+ * Group stores only slot of user, user stores pointer to group - it is needed for leaving all groups at logout.
+ */
+void group_join(group_t * group, user_t * user){
+    if(group->count == group->capacity){
+        group->capacity = group->capacity ? 2 * group->capacity : 8;
+        group->members = realloc(group->members, group->capacity * sizeof(int));
+    }
+    group->members[group->count++] = user->slot;
+
+    if(user->groupCount == user->groupCapacity){
+        user->groupCapacity = user->groupCapacity ? 2 * user->groupCapacity : 4;
+        user->groups = realloc(user->groups, user->groupCapacity * sizeof(group_t *));
+    }
+    user->groups[user->groupCount++] = group;
+}
+
+/**
+ * @brief Create new group
+ * @param name - Name of group
+ * @param length - Length of name
+ * @return New group without members
+ */
+group_t * group_create(const char * name, size_t length){
+    group_t * group = calloc(1, sizeof(group_t));
+    group->name = strndup(name, length);
+    strmap_put(&groups, group->name, group);
+    return group;
+}
+
+/**
+ * @brief Remove user from group
+ * @param group - Group
+ * @param user - Logged user, member of group
+ *
+ * Last member of group is moved to the place of removed member. Group without members is deleted.
+ */
+void group_leave(group_t * group, user_t * user){
+    for(int i=0; i<group->count; i++){
+        if(group->members[i] == user->slot){
+            group->members[i] = group->members[--group->count];
+            break;
+        }
+    }
+    for(int i=0; i<user->groupCount; i++){
+        if(user->groups[i] == group){
+            user->groups[i] = user->groups[--user->groupCount];
+            break;
+        }
+    }
+
+    //delete empty group
+    if(!group->count){
+        strmap_remove(&groups, group->name);
+        free(group->name);
+        free(group->members);
+        free(group);
+    }
+}
+
+/**
+ * @brief Send message to all members of group
+ * @param group - Group
+ * @param letter - Message, every member gets reference to message formatted for its protocol
+ * @return Number of members
+ */
+int group_post(group_t * group, letter_t * letter){
+    for(int i=0; i<group->count; i++){
+        user_t * user = users_logged[group->members[i]];
+        outbox_queue(user->outbox, letter_message(letter, user->binary));
+    }
+    return group->count;
+}
+
+/**
+ * @brief Allocate logged user
+ * @param name - Username
+ * @param length - Length of username
+ * @return User with username stored in the same memory block - it is freed by free()
+ */
+user_t * user_new(const char * name, size_t length){
+    user_t * user = calloc(1, sizeof(user_t) + length + 1);
+    user->username = (char *)(user + 1);
+    memcpy(user->username, name, length);
+    user->watcher = -1;
+    return user;
+}
+
+/**
+ * @brief Remove sender from list of senders with waiting requests
+ * @param user - Sender
+ */
+void schedule_unlink(user_t * user){
+    if(!user->scheduled)
+        return;
+    if(user->prevScheduled)
+        user->prevScheduled->nextScheduled = user->nextScheduled;
+    else
+        scheduleHead = user->nextScheduled;
+    if(user->nextScheduled)
+        user->nextScheduled->prevScheduled = user->prevScheduled;
+    else
+        scheduleTail = user->prevScheduled;
+    user->prevScheduled = user->nextScheduled = NULL;
+    user->scheduled = 0;
+    scheduledSenders--;
+}
+
+/**
+ * @brief Append sender to the end of list of senders with waiting requests
+ * @param user - Sender
+ */
+void schedule_link(user_t * user){
+    user->scheduled = 1;
+    user->prevScheduled = scheduleTail;
+    if(scheduleTail)
+        scheduleTail->nextScheduled = user;
+    else
+        scheduleHead = user;
+    scheduleTail = user;
+    scheduledSenders++;
+}
+
+/**
+ * @brief Send receipt to sender of message with receipt
+ * @param from - Sender, it does not have to be terminated by zero
+ * @param fromLength - Length of sender
+ * @param text - Receipt terminated by newline
+ *
+ * Sender logged in on other node gets receipt by link to his node, receipt for sender who is not logged in is dropped.
+ */
+void receipt_notify(const char * from, size_t fromLength, char * text){
+    user_t * user = strmap_find(&sessions, from, fromLength);
+    if(user){
+        message_send(user, text);
+        return;
+    }
+    remote_t * remote = nodeId ? remote_find(from, fromLength) : NULL;
+    if(remote){
+        const char * field[2] = {from, text};
+        size_t length[2] = {fromLength, strlen(text)};
+        peer_queue(&peers[remote->node], LINK_RECEIPT, 2, field, length);
+    }
+}
+
+/**
+ * @brief Tell sender that message with receipt failed
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param to - Recipient
+ * @param toLength - Length of recipient
+ * @param seq - Number of message, 0 if message did not get number
+ * @param reason - Reason of failure
+ */
+void receipt_failed(const char * from, size_t fromLength, const char * to, size_t toLength, uint64_t seq, const char * reason){
+    char text[BUFFER_SIZE];
+    int nameLength = toLength > NAME_MAX ? NAME_MAX : toLength;
+    if(seq)
+        snprintf(text, BUFFER_SIZE, "Message #%llu to %.*s failed: %s\n", (unsigned long long)seq, nameLength, to, reason);
+    else
+        snprintf(text, BUFFER_SIZE, "Message to %.*s failed: %s\n", nameLength, to, reason);
+    receiptsFailed++;
+    receipt_notify(from, fromLength, text);
+}
+
+/**
+ * @brief Store unacknowledged messages with receipt for recipient who logs out
+ * @param user - Recipient
+ *
+ * Messages could be lost in outbox or in closed connection, so they are sent again when recipient logs in - see offline_deliver().
+ * Without offline store senders are told that messages failed.
+ */
+void receipt_store(user_t * user){
+    size_t toLength = strlen(user->username);
+    for(pair_t * pair = user->pairs; pair; pair = pair->next){
+        const char * from = pair->key + pair->toLength + 1;
+        size_t fromLength = strlen(from);
+        while(pair->head){
+            unacked_t * message = pair->head;
+            pair->head = message->next;
+            if(segmentCount){
+                letter_t letter = {from, fromLength, message->text, message->length, message->seq, {NULL, NULL}};
+                offline_store(user->username, toLength, &letter);
+                receiptsStored++;
+            }
+            else
+                receipt_failed(from, fromLength, user->username, toLength, message->seq, "recipient logged out");
+            receiptsUnacked--;
+            free(message);
+        }
+        pair->tail = NULL;
+        pair->count = 0;
+        pair->listed = 0;
+    }
+    user->pairs = NULL;
+}
+
+/**
+ * @brief Remove user from table of logged users and free its memory
+ * @param user - Logged user
+ *
+ * Messages with receipt which user did not acknowledge are stored for him - see receipt_store().
+ */
+void user_remove(user_t * user){
+    receipt_store(user);
+    //waiting requests of user are dropped
+    schedule_unlink(user);
+    scheduledBytes -= user->queue.length - user->queueStart;
+    free(user->queue.data);
+    if(scheduledUser == user)
+        scheduledUser = NULL;
+    while(user->groupCount)
+        group_leave(user->groups[0], user);
+    free(user->groups);
+    if(user->connection)
+        user->connection->user = NULL;
+    strmap_remove(&sessions, user->username);
+    online_remove(user);
+    presence_subscribe(user, 0);
+    presence_notify(user, 0);
+    cluster_presence(user, 0);
+    users_logged[user->slot] = NULL;
+    freeSlots[freeCount++] = user->slot;
+    free(user);
+}
+
+/**
+ * @brief Logout user from server
+ * @param name - Username for logout
+ *
+ * Function finds a user which is given as name in the sessions map and then it deletes user from the array of users structures and frees all allocated memory.
+ * After successful logout, send message to client. Message is "Logged out.".
+ *
+ */
+void user_logout(char * name){
+
+    user_t * user = user_find(name);
+    if(!user)
+        return;
+
+    //send message to client - logged out, named pipe is closed after the message is delivered
+    message_send(user,"Logged out.\n");
+    outbox_close(user->outbox);
+
+    //write message to server console
+    console("User %s logged out.\n",name);
+
+    //free used memory and delete user from list of logged in users
+    user_remove(user);
+}
+
+/**
+ * @brief - Send all online users to client
+ * @param pipename - Name of named pipe for output
+ *
+ * Write all online users to given named pipe. Pipe is named by pid of client process - which is unique. Usernames are separated by | (pipe) and added "- " before every username - for better reading at client side.
+ * Answer is written by message_send_once() - pipe without reader or full pipe can not block the server, such client gets nothing or only a part of the answer.
+ */
+void print_online(char * pipename){
+    bytes_t text = {NULL, 0, 0};
+
+    //list all logged in users in alphabetical order
+    for(size_t i=0; i<onlineCount; i++)
+        bytes_printf(&text, "|- %s", onlineIndex[i]);
+    bytes_printf(&text, "\n");
+
+    message_send_once(pipename, text.data, 0);
+    free(text.data);
+}
+
+/**
+ * @brief Finish authenticated login - called by server thread
+ * @param login - Login with result of authentication, it is freed
+ *
+ * User with valid credentials is logged in via user_login(). Memory for logged user is allocated only when credentials are valid.<br/>
+ * If credentials are invalid, or login was unsuccessful - client recieves a message about it by function message_reply().
+ * Login of closed connection is only freed.
+ */
+void login_finish(login_t * login){
+    histogram_record(&loginLatency, now_ns() - login->start);
+    if(login->connection)
+        login->connection->login = NULL;
+    if(login->cancelled){
+        free(login);
+        return;
+    }
+
+    request_t request;
+    request.type = 1;
+    request.binary = login->binary;
+    request.failures = 0;
+    request.connection = login->connection;
+    request.count = 0;
+    if(login->valid && remote_find(login->name, login->nameLength))
+        message_reply(&request,login->name,"User already logged in on another server\n");
+    else if(login->valid){
+        user_t * user = user_new(login->name, login->nameLength);
+        user->binary = login->binary;
+        user->connection = login->connection;
+        if(user_login(user)){
+            free(login);
+            return;
+        }
+        free(user);
+        message_reply(&request,login->name,user_find(login->name) ? "User already logged in\n" : "Server is full !!!\n");
+    }
+    //wrong credentials
+    else{
+        authFailures++;
+        message_reply(&request,login->name,"Login incorrect\n");
+    }
+    requestStats[1].failures++;
+    free(login);
+}
+
+/**
+ * @brief Authentication thread
+ * @param arg - Unused
+ * @return NULL
+ *
+ * Thread takes logins from authQueue, checks their credentials by user_auth() and gives them back to server thread through authDone and authWatch.
+ * Server loop is not blocked by reading of login file, so messages are routed also during a storm of logins.
+ */
+void * auth_run(void * arg){
+    (void)arg;
+    pthread_mutex_lock(&authLock);
+    while(1){
+        while(!authWaiting && !authStopping)
+            pthread_cond_wait(&authCond, &authLock);
+        if(authStopping)
+            break;
+        login_t * login = authQueue[authHead];
+        authHead = (authHead + 1) % AUTH_QUEUE;
+        authWaiting--;
+        pthread_mutex_unlock(&authLock);
+
+        login->valid = user_auth(login->name, login->nameLength, login->password, login->passwordLength);
+
+        pthread_mutex_lock(&authLock);
+        login->next = NULL;
+        if(authDoneTail)
+            authDoneTail->next = login;
+        else
+            authDone = login;
+        authDoneTail = login;
+        uint64_t one = 1;
+        if(write(authWatch.fd, &one, sizeof(one)) < 0)
+            perror("auth_run");
+    }
+    pthread_mutex_unlock(&authLock);
+    return NULL;
+}
+
+/**
+ * @brief Handle logins finished by authentication threads
+ * @param watch - Watch of eventfd
+ * @param events - Epoll events
+ */
+void auth_event(watch_t * watch, uint32_t events){
+    (void)events;
+    uint64_t value;
+    if(read(watch->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("auth_event");
+
+    pthread_mutex_lock(&authLock);
+    login_t * login = authDone;
+    authDone = authDoneTail = NULL;
+    pthread_mutex_unlock(&authLock);
+    while(login){
+        login_t * next = login->next;
+        login_finish(login);
+        login = next;
+    }
+}
+
+/**
+ * @brief Start authentication threads
+ *
+ * If they can not be started, logins are authenticated by server thread.
+ */
+void auth_init(){
+    authWatch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    authWatch.handler = auth_event;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &authWatch;
+    if(authWatch.fd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, authWatch.fd, &ev)){
+        perror("auth_init");
+        return;
+    }
+    int count = authOption > MAX_AUTH ? MAX_AUTH : authOption;
+    for(authCount = 0; authCount < count; authCount++)
+        if(pthread_create(&authThreads[authCount], NULL, auth_run, NULL))
+            break;
+}
+
+/**
+ * @brief Stop authentication threads
+ * @param finish - 1 if logins which were not answered yet are finished by server thread (before restart), 0 if they are dropped
+ */
+void auth_stop(int finish){
+    pthread_mutex_lock(&authLock);
+    authStopping = 1;
+    pthread_cond_broadcast(&authCond);
+    pthread_mutex_unlock(&authLock);
+    for(int i=0; i<authCount; i++)
+        pthread_join(authThreads[i], NULL);
+    authCount = 0;
+    while(authDone){
+        login_t * next = authDone->next;
+        if(finish)
+            login_finish(authDone);
+        else
+            free(authDone);
+        authDone = next;
+    }
+    for(; authWaiting; authWaiting--, authHead = (authHead + 1) % AUTH_QUEUE){
+        login_t * login = authQueue[authHead];
+        if(finish){
+            login->valid = user_auth(login->name, login->nameLength, login->password, login->passwordLength);
+            login_finish(login);
+        }
+        else
+            free(login);
+    }
+}
+
+/**
+ * @brief Login request
+ * @param request - Request with fields username and password
+ *
+ * Credentials are checked by authentication thread via user_auth(), the answer is sent by login_finish() when it is done.<br/>
+ * If AUTH_QUEUE logins are already waiting, client is told that server is busy.
+ * Connection can be used only by one user at the same time and it can have only one login in progress.
+ */
+void request_login(request_t * request){
+
+    //username is name of named pipe - it must not contain anything else than letters and digits
+    request->failures++;
+    if(!is_name(request->field[0], request->length[0])){
+        console("Invalid username in login request\n");
+        return;
+    }
+    char name[NAME_MAX + 1];
+    memcpy(name, request->field[0], request->length[0]);
+    name[request->length[0]] = '\0';
+
+    if(request->connection && request->connection->user){
+        message_reply(request,name,"Connection is already used by another user\n");
+        return;
+    }
+    if(request->connection && request->connection->login){
+        message_reply(request,name,"Login is already in progress\n");
+        return;
+    }
+
+    login_t * login = malloc(sizeof(login_t) + request->length[1]);
+    login->connection = request->connection;
+    login->binary = request->binary;
+    login->cancelled = 0;
+    login->start = now_ns();
+    login->nameLength = request->length[0];
+    memcpy(login->name, name, request->length[0] + 1);
+    login->passwordLength = request->length[1];
+    memcpy(login->password, request->field[1], request->length[1]);
+    request->failures--;
+
+    //without authentication threads login is finished immediately
+    if(!authCount){
+        login->valid = user_auth(login->name, login->nameLength, login->password, login->passwordLength);
+        login_finish(login);
+        return;
+    }
+
+    pthread_mutex_lock(&authLock);
+    int queued = authWaiting < AUTH_QUEUE;
+    if(queued){
+        authQueue[(authHead + authWaiting) % AUTH_QUEUE] = login;
+        authWaiting++;
+        pthread_cond_signal(&authCond);
+    }
+    pthread_mutex_unlock(&authLock);
+    if(!queued){
+        free(login);
+        request->failures++;
+        message_reply(request,name,"Server is busy, try to login later\n");
+        return;
+    }
+    if(request->connection)
+        request->connection->login = login;
+}
+
+/**
+ * @brief Send one page of online users to client as one message
+ * @param request - Request
+ * @param user - Logged user who asked, or NULL for connection which is not logged in
+ * @param prefix - Only usernames starting by prefix are listed
+ * @param prefixLength - Length of prefix
+ * @param after - Only usernames after this one are listed, empty for the first page
+ * @param afterLength - Length of after
+ *
+ * Users are sent as one message "Online users:" followed by one username per line in alphabetical order, at most ONLINE_PAGE users.
+ * If there are more users, the last line is "More users after NAME" - the next page is asked by the same prefix and this name.
+ * Users are found in the sorted index by binary search, so a page costs the same for any number of logged users.
+ * Message for logged user goes through its outbox, so it is not mixed with other messages for the user.
+ */
+void print_online_message(request_t * request, user_t * user, const char * prefix, size_t prefixLength, const char * after, size_t afterLength){
+    size_t pos = online_position(prefix, prefixLength);
+    if(afterLength){
+        size_t next = online_position(after, afterLength);
+        if(next < onlineCount && strlen(onlineIndex[next]) == afterLength && !memcmp(onlineIndex[next], after, afterLength))
+            next++;
+        if(next > pos)
+            pos = next;
+    }
+
+    bytes_t text = {NULL, 0, 0};
+    bytes_printf(&text, "Online users:\n");
+    int count = 0;
+    for(; pos < onlineCount && !strncmp(onlineIndex[pos], prefix, prefixLength); pos++){
+        if(count == ONLINE_PAGE){
+            bytes_printf(&text, "More users after %s\n", onlineIndex[pos - 1]);
+            break;
+        }
+        bytes_printf(&text, "- %s\n", onlineIndex[pos]);
+        count++;
+    }
+
+    if(user)
+        message_send(user, text.data);
+    else
+        message_reply(request, NULL, text.data);
+    free(text.data);
+}
+
+/**
+ * @brief Request for online users
+ * @param request - Request with name of named pipe for answer (it is ignored for clients connected by socket)
+ * @see print_online
+ *
+ * If the name of named pipe is name of logged user, answer is sent to the user's inbox as the first page of online users - client does not need another pipe.
+ */
+void request_online(request_t * request){
+    //print to server console
+    console("Sending online users\n");
+
+    if(request->connection){
+        print_online_message(request, request->connection->user, "", 0, "", 0);
+        return;
+    }
+    user_t * user = user_find_field(request, 0);
+    if(user){
+        print_online_message(request, user, "", 0, "", 0);
+        return;
+    }
+
+    char pipename[BUFFER_SIZE];
+    snprintf(pipename,BUFFER_SIZE,"%.*s",(int)request->length[0],request->field[0]);
+    if(!is_alphanumeric(pipename))
+        return;
+    //call function with given name of named pipe
+    print_online(pipename);
+}
+
+/**
+ * @brief Request for page of online users filtered by prefix
+ * @param request - Request with fields username (or "-" for client connected by socket), prefix and the last username of previous page
+ * @see print_online_message
+ */
+void request_presence(request_t * request){
+    user_t * user = request->connection ? request->connection->user : user_find_field(request, 0);
+    if(!user && !request->connection){
+        request->failures++;
+        return;
+    }
+    print_online_message(request, user, request->field[1], request->length[1], request->field[2], request->length[2]);
+}
+
+/**
+ * @brief Request for subscription to changes of presence
+ * @param request - Request with fields username and 1 for subscription or 0 for cancel
+ *
+ * Subscribed user gets message "User NAME is online" or "User NAME is offline" whenever another user logs in or out, so he does not need to ask for online users repeatedly.
+ * Subscription ends at logout.
+ */
+void request_subscribe(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user || request->length[1] != 1 || (request->field[1][0] != '0' && request->field[1][0] != '1')){
+        request->failures++;
+        return;
+    }
+    int subscribe = request->field[1][0] == '1';
+    presence_subscribe(user, subscribe);
+    message_send(user, subscribe ? "Subscribed to presence of users\n" : "Subscription to presence cancelled\n");
+}
+
+/**
+ * @brief Compose header of large message for recipient
+ * @param transfer - Large message
+ * @param binary - Recipient uses binary frames
+ * @return Message with one reference - payload is written after it by delivery thread
+ *
+ * Text client gets line "from => size" followed by size bytes of payload. Binary client gets frame FRAME_FILE with fields sender and payload,
+ * only the part of frame before payload is in the message.
+ */
+message_t * transfer_header(transfer_t * transfer, int binary){
+    size_t fromLength = strlen(transfer->from);
+    message_t * message;
+    if(!binary){
+        char line[NAME_MAX + 32];
+        int length = snprintf(line, sizeof(line), "%s => %llu\n", transfer->from, (unsigned long long)transfer->size);
+        message = message_new(line, length);
+    }
+    else{
+        message = message_alloc(FRAME_HEADER + 8 + fromLength);
+        unsigned char * p = (unsigned char *)message->data;
+        p[0] = FRAME_MAGIC;
+        p[1] = FRAME_VERSION;
+        p[2] = FRAME_FILE;
+        p[3] = 2;
+        le32_put(p + 4, fromLength + transfer->size);
+        le32_put(p + FRAME_HEADER, fromLength);
+        le32_put(p + FRAME_HEADER + 4, fromLength + transfer->size);
+        memcpy(p + FRAME_HEADER + 8, transfer->from, fromLength);
+    }
+    message->transfer = transfer;
+    return message;
+}
+
+/**
+ * @brief Request for sending large message
+ * @param request - Request with fields from, to and size of payload
+ *
+ * Sender writes payload to its upload pipe "from.upload" - named pipe created by client before request. Payload is moved from the pipe
+ * to the recipient by his delivery thread (see transfer_splice()), so it can be much bigger than any buffer of server.
+ * Sender gets messages "Upload to NAME ..." about start, progress and result. Recipient must be online, every sender can send one large message at a time.
+ */
+void request_upload(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    user_t * to = user_find_field(request, 1);
+
+    //size of payload
+    uint64_t size = 0;
+    size_t i = 0;
+    for(; i < request->length[2] && isdigit((unsigned char)request->field[2][i]) && size <= TRANSFER_MAX; i++)
+        size = size * 10 + request->field[2][i] - '0';
+
+    const char * error = NULL;
+    int fd = -1;
+    if(reportWatch.fd < 0)
+        error = "large messages are not available";
+    else if(restartPending)
+        error = "server is restarting";
+    else if(!to)
+        error = "user is not online";
+    else if(!size || size > TRANSFER_MAX || i != request->length[2])
+        error = "invalid size";
+    else if(strmap_get(&uploads, user->username))
+        error = "another upload is in progress";
+    else{
+        char path[NAME_MAX + 16];
+        snprintf(path, sizeof(path), "%s.upload", user->username);
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if(fd < 0)
+            error = "upload pipe can not be opened";
+    }
+    if(error){
+        request->failures++;
+        char reply[BUFFER_SIZE];
+        snprintf(reply, BUFFER_SIZE, "Upload to %.*s failed: %s\n", (int)(request->length[1] > NAME_MAX ? NAME_MAX : request->length[1]), request->field[1], error);
+        message_send(user, reply);
+        return;
+    }
+
+    //references of server thread and of delivery thread
+    transfer_t * transfer = calloc(1, sizeof(transfer_t));
+    transfer->refs = 2;
+    transfer->watch.fd = fd;
+    transfer->watch.handler = transfer_event;
+    transfer->worker = to->outbox->worker;
+    transfer->outbox = to->outbox;
+    transfer->size = size;
+    snprintf(transfer->from, sizeof(transfer->from), "%s", user->username);
+    snprintf(transfer->to, sizeof(transfer->to), "%s", to->username);
+    strmap_put(&uploads, transfer->from, transfer);
+
+    message_t * header = transfer_header(transfer, to->binary);
+    outbox_queue(to->outbox, header);
+    message_release(header);
+
+    char reply[BUFFER_SIZE];
+    snprintf(reply, BUFFER_SIZE, "Upload to %s started (%llu bytes)\n", to->username, (unsigned long long)size);
+    message_send(user, reply);
+    console("User %s sends %llu bytes to %s\n", user->username, (unsigned long long)size, to->username);
+}
+
+/**
+ * @brief Handle reports of delivery threads about large messages
+ * @param watch - Watch of eventfd
+ * @param events - Epoll events
+ *
+ * Sender is told about progress and result. If sender closed upload pipe too early, recipient is told that the payload he got is incomplete.
+ */
+void transfer_reports(watch_t * watch, uint32_t events){
+    (void)events;
+    uint64_t value;
+    if(read(watch->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("transfer_reports");
+
+    delivery_t * report;
+    while((report = mpsc_pop(&reports)) != NULL){
+        transfer_t * transfer = report->transfer;
+        user_t * sender = user_find(transfer->from);
+        char text[BUFFER_SIZE];
+        if(report->type == DELIVERY_PROGRESS){
+            snprintf(text, BUFFER_SIZE, "Upload to %s: %llu of %llu bytes\n", transfer->to,
+                     (unsigned long long)__atomic_load_n(&transfer->moved, __ATOMIC_RELAXED), (unsigned long long)transfer->size);
+        }
+        else{
+            int done = __atomic_load_n(&transfer->state, __ATOMIC_ACQUIRE) == TRANSFER_DONE;
+            snprintf(text, BUFFER_SIZE, "Upload to %s %s\n", transfer->to, done ? "complete" : "failed");
+            user_t * recipient = user_find(transfer->to);
+            if(transfer->padded && recipient){
+                char notice[BUFFER_SIZE];
+                snprintf(notice, BUFFER_SIZE, "File from %s is incomplete\n", transfer->from);
+                message_send(recipient, notice);
+            }
+            console("Upload of user %s to %s %s\n", transfer->from, transfer->to, done ? "complete" : "failed");
+            strmap_remove(&uploads, transfer->from);
+            transfer_release(transfer);
+        }
+        if(sender)
+            message_send(sender, text);
+
+        //node is reused by worker_post()
+        report->next = deliveryCache;
+        deliveryCache = report;
+    }
+}
+
+/**
+ * @brief Start receiving reports of delivery threads
+ */
+void transfer_init(){
+    mpsc_init(&reports);
+    reportWatch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reportWatch.handler = transfer_reports;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reportWatch;
+    if(reportWatch.fd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, reportWatch.fd, &ev)){
+        //large messages are refused without reports
+        perror("transfer_init");
+        if(reportWatch.fd >= 0)
+            close(reportWatch.fd);
+        reportWatch.fd = -1;
+    }
+}
+
+/**
+ * @brief Request for sending message to one user
+ * @param request - Request with fields from, to and message
+ *
+ * Server sends message to client "to" of format "from" -> message. If "to" is logged in on other node of cluster, request is forwarded to that node.
+ */
+void request_message(request_t * request){
+    //find user "to"
+    user_t * user = user_find_field(request, 1);
+
+    //user logged in on other node gets message by link to his node
+    remote_t * remote = !user && nodeId ? remote_find(request->field[1], request->length[1]) : NULL;
+    if(remote){
+        if(peer_queue(&peers[remote->node], LINK_MESSAGE, 3, (const char **)request->field, request->length)){
+            linkForwarded++;
+            history_add(request->field[0], request->length[0], request->field[1], request->length[1], request->field[2], request->length[2]);
+            console("User %.*s sent a message to %s on node %d\n",(int)request->length[0],request->field[0],remote->name,remote->node);
+        }
+        else
+            request->failures++;
+        return;
+    }
+
+    //if we have found user "to"
+    if(user){
+        //compose message and send it to user "to"
+        letter_t letter = {request->field[0], request->length[0], request->field[2], request->length[2], 0, {NULL, NULL}};
+        outbox_queue(user->outbox, letter_message(&letter, user->binary));
+        letter_release(&letter);
+        history_add(request->field[0], request->length[0], user->username, strlen(user->username), request->field[2], request->length[2]);
+
+        //print message to server console
+        console("User %.*s sent a message to %s\n",(int)request->length[0],request->field[0],user->username);
+    }
+    //registered user who is offline gets message when he logs in
+    else if(user_registered(request->field[1], request->length[1])){
+        letter_t letter = {request->field[0], request->length[0], request->field[2], request->length[2], 0, {NULL, NULL}};
+        offline_store(request->field[1], request->length[1], &letter);
+        history_add(request->field[0], request->length[0], request->field[1], request->length[1], request->field[2], request->length[2]);
+        console("User %.*s sent a message to offline user %.*s\n",(int)request->length[0],request->field[0],(int)request->length[1],request->field[1]);
+    }
+    else
+        request->failures++;
+}
+
+/**
+ * @brief Request for logout
+ * @param request - Request with username
+ * @see user_logout
+ */
+void request_logout(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(user)
+        user_logout(user->username);
+    else
+        request->failures++;
+}
+
+/**
+ * @brief Request for sending message to more users
+ * @param request - Request with fields from, list of recipients separated by spaces and message
+ *
+ * Message "from -> message" is composed only once and the same reference counted message is queued to all recipients, which are logged in.
+ */
+void request_multicast(request_t * request){
+    letter_t letter = {request->field[0], request->length[0], request->field[2], request->length[2], 0, {NULL, NULL}};
+    int delivered = 0, stored = 0;
+
+    //split list of recipients
+    char * name = request->field[1];
+    char * end = name + request->length[1];
+    while(name < end){
+        char * space = memchr(name, ' ', end - name);
+        if(!space)
+            space = end;
+        user_t * user = strmap_find(&sessions, name, space - name);
+        if(user){
+            outbox_queue(user->outbox, letter_message(&letter, user->binary));
+            delivered++;
+        }
+        else if(space > name && user_registered(name, space - name)){
+            offline_store(name, space - name, &letter);
+            stored++;
+        }
+        else{
+            request->failures++;
+            name = space + 1;
+            continue;
+        }
+        history_add(letter.from, letter.fromLength, name, space - name, letter.text, letter.textLength);
+        name = space + 1;
+    }
+    letter_release(&letter);
+
+    //print message to server console
+    console("User %.*s sent a message to %d users (%d offline)\n",(int)request->length[0],request->field[0],delivered + stored,stored);
+}
+
+/**
+ * @brief Request for creating, joining or leaving group
+ * @param request - Request with fields username and group
+ */
+void request_group(request_t * request){
+
+    //only logged users can be members of groups
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    char * name = request->field[1];
+    int length = request->length[1];
+    group_t * group = group_find(name, length);
+    char reply[BUFFER_SIZE];
+
+    if(request->type==6){
+        if(group){
+            snprintf(reply,BUFFER_SIZE,"Group %.*s already exists\n",length,name);
+            request->failures++;
+        }
+        else{
+            group_join(group_create(name, length), user);
+            snprintf(reply,BUFFER_SIZE,"Group %.*s created\n",length,name);
+        }
+    }
+    else if(!group){
+        snprintf(reply,BUFFER_SIZE,"Group %.*s does not exist\n",length,name);
+        request->failures++;
+    }
+    else if(request->type==7){
+        if(!group_is_member(group, user))
+            group_join(group, user);
+        snprintf(reply,BUFFER_SIZE,"Joined group %.*s\n",length,name);
+    }
+    else{
+        if(group_is_member(group, user))
+            group_leave(group, user);
+        snprintf(reply,BUFFER_SIZE,"Left group %.*s\n",length,name);
+    }
+    message_send(user,reply);
+}
+
+/**
+ * @brief Request for posting message to group
+ * @param request - Request with fields from, group and message
+ *
+ * Message "group/from -> message" is delivered to all members of group, sender must be a member.
+ */
+void request_group_post(request_t * request){
+
+    //only members can post to group
+    user_t * user = user_find_field(request, 0);
+    group_t * group = group_find(request->field[1], request->length[1]);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    if(!group || !group_is_member(group, user)){
+        request->failures++;
+        char reply[BUFFER_SIZE];
+        snprintf(reply,BUFFER_SIZE,"You are not member of group %.*s\n",(int)request->length[1],request->field[1]);
+        message_send(user,reply);
+        return;
+    }
+
+    //compose message once in format "group/from -> message" and deliver it to all members
+    char sender[BUFFER_SIZE];
+    int senderLength = snprintf(sender,BUFFER_SIZE,"%s/%s",group->name,user->username);
+    letter_t letter = {sender, senderLength, request->field[2], request->length[2], 0, {NULL, NULL}};
+    int delivered = group_post(group, &letter);
+    letter_release(&letter);
+    char to[BUFFER_SIZE];
+    int toLength = snprintf(to,BUFFER_SIZE,"#%s",group->name);
+    history_add(user->username, strlen(user->username), to, toLength, request->field[2], request->length[2]);
+
+    //print message to server console
+    console("User %s sent a message to group %s (%d members)\n",user->username, group->name, delivered);
+}
+
+/**
+ * @brief Parse number in field of request
+ * @param request - Request
+ * @param i - Index of field
+ * @param value - Output, 0 for empty field
+ * @return 1 if field contains only digits, 0 otherwise
+ */
+int field_number(request_t * request, int i, uint64_t * value){
+    *value = 0;
+    for(size_t j=0; j<request->length[i]; j++){
+        if(!isdigit((unsigned char)request->field[i][j]) || *value > UINT32_MAX)
+            return 0;
+        *value = *value * 10 + request->field[i][j] - '0';
+    }
+    return 1;
+}
+
+/**
+ * @brief Parse position in history from field of request
+ * @param request - Request
+ * @param i - Index of field
+ * @param time - Output, time or 0
+ * @param number - Output, number of message or 0
+ * @return 1 if field is empty, time or "#" followed by number of message, 0 otherwise
+ *
+ * Number of message is given in answers which have more pages, time can be given by user.
+ */
+int history_cursor(request_t * request, int i, uint64_t * time, uint64_t * number){
+    *time = *number = 0;
+    size_t mark = request->length[i] && request->field[i][0] == '#';
+    uint64_t * value = mark ? number : time;
+    for(size_t j=mark; j<request->length[i]; j++){
+        if(!isdigit((unsigned char)request->field[i][j]) || *value > UINT32_MAX)
+            return 0;
+        *value = *value * 10 + request->field[i][j] - '0';
+    }
+    return !mark || request->length[i] > 1;
+}
+
+/**
+ * @brief Find the first message which was not sent before given time
+ * @param numbers - Numbers of messages in ascending order, NULL for all messages in history
+ * @param count - Number of messages
+ * @param before - Time
+ * @return Index of the first message sent at time before or later, count if all messages are older
+ *
+ * This is the time index of history - messages get numbers in order of time, so every list of messages is ordered by time and binary search reads only few records.
+ */
+uint32_t history_find(const uint32_t * numbers, uint32_t count, time_t before){
+    uint32_t low = 0, high = count;
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        if(history_time(numbers ? numbers[middle] : historyBase + middle) < before)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * @brief Find the newest messages of owner containing all words
+ * @param owner - Owner of word index - username or "#group"
+ * @param ownerLength - Length of owner
+ * @param word - Words
+ * @param wordLength - Lengths of words
+ * @param count - Number of words
+ * @param end - Only messages with smaller number are found
+ * @param max - Maximum number of found messages
+ * @param found - Output, numbers of found messages from the newest one
+ * @return Number of found messages
+ *
+ * The shortest list of words is read from the end and its messages are looked up in other lists by binary search.
+ */
+uint32_t history_match(const char * owner, size_t ownerLength, char word[][HISTORY_WORD], const size_t * wordLength, int count, uint32_t end, uint32_t max, uint32_t * found){
+    postings_t * list[HISTORY_WORDS];
+    char key[NAME_MAX + HISTORY_WORD + 3];
+    memcpy(key, owner, ownerLength);
+    key[ownerLength] = '/';
+    int shortest = 0;
+    for(int i=0; i<count; i++){
+        memcpy(key + ownerLength + 1, word[i], wordLength[i]);
+        list[i] = strmap_find(&historyWords, key, ownerLength + 1 + wordLength[i]);
+        if(!list[i])
+            return 0;
+        if(list[i]->count < list[shortest]->count)
+            shortest = i;
+    }
+
+    uint32_t n = 0;
+    for(uint32_t j = postings_position(list[shortest], end); j > 0 && n < max; j--){
+        uint32_t number = list[shortest]->numbers[j - 1];
+        int all = 1;
+        for(int i=0; i<count && all; i++){
+            uint32_t position = postings_position(list[i], number);
+            all = position < list[i]->count && list[i]->numbers[position] == number;
+        }
+        if(all)
+            found[n++] = number;
+    }
+    return n;
+}
+
+/**
+ * @brief Compare numbers of messages
+ */
+int number_compare(const void * a, const void * b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Append message from history to answer
+ * @param out - Answer
+ * @param number - Number of message
+ * @param search - Recipient of message to user is shown too
+ *
+ * Line is "[time] from -> text", "[time] from -> to: text" in results of search and "[time] group/from -> text" for message posted to group.
+ */
+void history_format(bytes_t * out, uint32_t number, int search){
+    const unsigned char * p = history_record(number);
+    if(!p)
+        return;
+    uint32_t toLength = le32_get(p + 12), fromLength = le32_get(p + 16);
+    const char * to = (const char *)p + OFFLINE_HEADER;
+    const char * from = to + toLength;
+    const char * text = from + fromLength;
+    size_t textLength = le32_get(p) - OFFLINE_HEADER - toLength - fromLength;
+    time_t sent = le32_get(p + 20);
+    struct tm tm;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&sent, &tm));
+
+    if(toLength && to[0] == '#')
+        bytes_printf(out, "[%s] %.*s/%.*s -> ", stamp, (int)toLength - 1, to + 1, (int)fromLength, from);
+    else if(search)
+        bytes_printf(out, "[%s] %.*s -> %.*s: ", stamp, (int)fromLength, from, (int)toLength, to);
+    else
+        bytes_printf(out, "[%s] %.*s -> ", stamp, (int)fromLength, from);
+    bytes_reserve(out, textLength);
+    for(size_t i=0; i<textLength; i++)
+        out->data[out->length++] = (text[i] == '\n' || text[i] == '\0') ? ' ' : text[i];
+    bytes_printf(out, "\n");
+}
+
+/**
+ * @brief Send page of messages from history
+ * @param user - User who asked
+ * @param text - Answer with title, messages are appended to it
+ * @param numbers - Numbers of the newest messages which were found, in ascending order
+ * @param count - Number of messages
+ * @param more - There are older messages
+ * @param search - Answer to search - recipients are shown
+ *
+ * Messages are sent oldest first, page is cut to fit into one packet. If there are older messages, the line after title is "More messages before #NUMBER"
+ * and the next page is asked by "#NUMBER" instead of time.
+ */
+void history_answer(user_t * user, bytes_t * text, const uint32_t * numbers, uint32_t count, int more, int search){
+    uint32_t start = count;
+    size_t bytes = text->length;
+    while(start > 0){
+        const unsigned char * record = history_record(numbers[start - 1]);
+        bytes += record ? le32_get(record) + 64 : 0;
+        if(start < count && bytes > PACKET_MAX - BUFFER_SIZE)
+            break;
+        start--;
+    }
+    if((more || start) && start < count)
+        bytes_printf(text, "More messages before #%u\n", numbers[start]);
+    for(uint32_t i=start; i<count; i++)
+        history_format(text, numbers[i], search);
+    message_send(user, text->data);
+}
+
+/**
+ * @brief Request for history of conversation
+ * @param request - Request with fields username, peer (username or "#group"), number of messages (empty for HISTORY_PAGE) and time or "#number" (empty for the newest messages)
+ *
+ * Answer is one message "History with PEER:" followed by the newest messages sent before given time or message - see history_answer().
+ * Messages are taken from the list of conversation, so the answer costs the same for any size of history. History of group is available only to its members.
+ */
+void request_history(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    const char * peer = request->field[1];
+    size_t peerLength = request->length[1];
+    int group = peerLength && peer[0] == '#';
+    uint64_t limit, before, last;
+    char reply[BUFFER_SIZE];
+    if(!is_name(peer + group, peerLength - group) || !field_number(request, 2, &limit) || !history_cursor(request, 3, &before, &last)){
+        request->failures++;
+        message_send(user, "Invalid query for history\n");
+        return;
+    }
+    if(!volumeCount){
+        request->failures++;
+        message_send(user, "History is not kept\n");
+        return;
+    }
+    if(group){
+        group_t * g = group_find(peer + 1, peerLength - 1);
+        if(!g || !group_is_member(g, user)){
+            request->failures++;
+            snprintf(reply,BUFFER_SIZE,"You are not member of group %.*s\n",(int)peerLength - 1,peer + 1);
+            message_send(user,reply);
+            return;
+        }
+    }
+
+    //messages of this iteration must be in segments before they are read
+    history_commit();
+    char key[2 * NAME_MAX + 2];
+    size_t length = group ? peerLength : history_pair(key, user->username, strlen(user->username), peer, peerLength);
+    postings_t * list = strmap_find(&conversations, group ? peer : key, length);
+
+    if(!limit || limit > HISTORY_PAGE)
+        limit = HISTORY_PAGE;
+    uint32_t count = list ? list->count : 0;
+    uint32_t end = count;
+    if(list && before)
+        end = history_find(list->numbers, count, before);
+    else if(list && last)
+        end = postings_position(list, last);
+    uint32_t begin = end > limit ? end - limit : 0;
+    bytes_t text = {NULL, 0, 0};
+    bytes_printf(&text, "History with %.*s:\n", (int)peerLength, peer);
+    history_answer(user, &text, list ? list->numbers + begin : NULL, end - begin, begin > 0, 0);
+    free(text.data);
+
+    console("Sending history of %s with %.*s\n", user->username, (int)peerLength, peer);
+}
+
+/**
+ * @brief Request for messages containing words
+ * @param request - Request with fields username, words separated by spaces, number of messages (empty for HISTORY_PAGE) and time or "#number" (empty for the newest messages)
+ *
+ * Messages containing all words (at most HISTORY_WORDS) are searched in conversations of user and in groups which he is member of.
+ * Answer is one message "Search for WORDS:" followed by the newest messages found - see history_answer().
+ * Only word indexes are read to find messages, texts of messages are read only for the answer.
+ */
+void request_search(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    char word[HISTORY_WORDS][HISTORY_WORD];
+    size_t wordLength[HISTORY_WORDS];
+    int words = 0;
+    size_t i = 0;
+    while(words < HISTORY_WORDS && (wordLength[words] = history_word(request->field[1], request->length[1], &i, word[words])))
+        words++;
+    uint64_t limit, before, last;
+    if(!words || !field_number(request, 2, &limit) || !history_cursor(request, 3, &before, &last)){
+        request->failures++;
+        message_send(user, "Invalid query for history\n");
+        return;
+    }
+    if(!volumeCount){
+        request->failures++;
+        message_send(user, "History is not kept\n");
+        return;
+    }
+
+    //messages of this iteration must be in segments before they are read
+    history_commit();
+    if(!limit || limit > HISTORY_PAGE)
+        limit = HISTORY_PAGE;
+    uint32_t end = historyCount;
+    if(before)
+        end = historyBase + history_find(NULL, historyCount - historyBase, before);
+    else if(last && last < end)
+        end = last;
+
+    //the newest messages of every owner, one more than asked tells that there are older messages
+    uint32_t * found = malloc((user->groupCount + 1) * (limit + 1) * sizeof(uint32_t));
+    uint32_t count = history_match(user->username, strlen(user->username), word, wordLength, words, end, limit + 1, found);
+    for(int g=0; g<user->groupCount; g++){
+        char owner[NAME_MAX + 2];
+        int length = snprintf(owner, sizeof(owner), "#%s", user->groups[g]->name);
+        count += history_match(owner, length, word, wordLength, words, end, limit + 1, found + count);
+    }
+    qsort(found, count, sizeof(uint32_t), number_compare);
+
+    uint32_t take = count > limit ? limit : count;
+    bytes_t text = {NULL, 0, 0};
+    bytes_printf(&text, "Search for %.*s:\n", (int)request->length[1], request->field[1]);
+    history_answer(user, &text, found + count - take, take, count > take, 1);
+    free(text.data);
+    free(found);
+
+    console("Sending search results to %s\n", user->username);
+}
+
+/**
+ * @brief Put message to timer wheel
+ * @param message - Message
+ *
+ * Message is put to the level of the highest byte in which its time differs from wheelTime, so insert takes constant time for any delay.
+ * Message whose time has already come goes to delayedDue.
+ */
+void wheel_add(delayed_t * message){
+    if(message->due <= wheelTime){
+        message->next = delayedDue;
+        delayedDue = message;
+        return;
+    }
+    int level = (31 - __builtin_clz(message->due ^ wheelTime)) / 8;
+    delayed_t ** slot = &wheel[level][(message->due >> (8 * level)) & (WHEEL_SLOTS - 1)];
+    message->next = *slot;
+    *slot = message;
+}
+
+/**
+ * @brief Move timer wheel to given time
+ * @param now - Unix time
+ *
+ * Every second the slot of level 0 is moved to delayedDue. When lower bytes of time become zero, slots of higher levels whose time has come
+ * are spread to lower levels - every message is moved at most WHEEL_LEVELS times.
+ */
+void wheel_advance(uint32_t now){
+    if(!delayedCount){
+        wheelTime = now;
+        return;
+    }
+    while(wheelTime < now){
+        wheelTime++;
+        int level = 0;
+        while(level + 1 < WHEEL_LEVELS && !(wheelTime & ((1u << (8 * (level + 1))) - 1)))
+            level++;
+        for(; level > 0; level--){
+            delayed_t ** slot = &wheel[level][(wheelTime >> (8 * level)) & (WHEEL_SLOTS - 1)];
+            delayed_t * message = *slot;
+            *slot = NULL;
+            while(message){
+                delayed_t * next = message->next;
+                wheel_add(message);
+                message = next;
+            }
+        }
+        delayed_t ** slot = &wheel[0][wheelTime & (WHEEL_SLOTS - 1)];
+        while(*slot){
+            delayed_t * message = *slot;
+            *slot = message->next;
+            message->next = delayedDue;
+            delayedDue = message;
+        }
+    }
+}
+
+/**
+ * @brief Start timer of timer wheel when there are delayed messages, stop it when there are none
+ *
+ * Timer expires at every whole second, so messages due in the same second are delivered together.
+ */
+void delayed_arm(){
+    int armed = delayedCount > 0;
+    if(armed == delayedArmed || delayedWatch.fd < 0)
+        return;
+    struct itimerspec interval = {{armed, 0}, {armed ? time(NULL) + 1 : 0, 0}};
+    if(timerfd_settime(delayedWatch.fd, TFD_TIMER_ABSTIME, &interval, NULL))
+        perror("delayed_arm");
+    delayedArmed = armed;
+}
+
+/**
+ * @brief Append record of delayed message
+ * @param out - Buffer
+ * @param message - Message
+ * @return Size of record
+ */
+uint32_t delayed_record(bytes_t * out, delayed_t * message){
+    return offline_record(out, OFFLINE_DELAYED, message->id, message->due, message->data + message->fromLength, message->toLength,
+                          message->data, message->fromLength, message->data + message->fromLength + message->toLength, message->textLength);
+}
+
+/**
+ * @brief Create delayed message and put it to timer wheel
+ * @param id - Number of message
+ * @param due - Unix time of delivery
+ * @param from - Sender
+ * @param fromLength - Length of sender
+ * @param to - Recipient
+ * @param toLength - Length of recipient
+ * @param text - Text
+ * @param textLength - Length of text
+ * @return Message
+ */
+delayed_t * delayed_add(uint64_t id, uint32_t due, const char * from, size_t fromLength, const char * to, size_t toLength, const char * text, size_t textLength){
+    delayed_t * message = malloc(sizeof(delayed_t) + fromLength + toLength + textLength);
+    message->id = id;
+    message->due = due;
+    message->fromLength = fromLength;
+    message->toLength = toLength;
+    message->textLength = textLength;
+    memcpy(message->data, from, fromLength);
+    memcpy(message->data + fromLength, to, toLength);
+    memcpy(message->data + fromLength + toLength, text, textLength);
+    //empty wheel is not moved by timer - it starts at current time, so the next tick does not catch up the idle time
+    if(!delayedCount)
+        wheelTime = time(NULL);
+    wheel_add(message);
+    delayedCount++;
+    delayedLive += OFFLINE_HEADER + fromLength + toLength + textLength;
+    if(id > delayedSeq)
+        delayedSeq = id;
+    delayed_arm();
+    return message;
+}
+
+/**
+ * @brief Write data to journal
+ * @param fd - Journal
+ * @param data - Data
+ * @param length - Length of data
+ * @param offset - Offset in journal
+ * @return 1 if everything was written, 0 on error
+ */
+int delayed_write(int fd, const char * data, size_t length, size_t offset){
+    size_t done = 0;
+    while(done < length){
+        ssize_t written = pwrite(fd, data + done, length - done, offset + done);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            perror("delayed_write");
+            return 0;
+        }
+        done += written;
+    }
+    return 1;
+}
+
+/**
+ * @brief Write records of list of messages to new journal
+ * @param fd - New journal
+ * @param out - Buffer for records, it is written when it is full
+ * @param size - Number of bytes written to journal
+ * @param message - The first message of list
+ * @return 1 on success, 0 on error
+ */
+int delayed_write_list(int fd, bytes_t * out, size_t * size, delayed_t * message){
+    for(; message; message = message->next){
+        delayed_record(out, message);
+        if(out->length >= DELAYED_COMPACT){
+            if(!delayed_write(fd, out->data, out->length, *size))
+                return 0;
+            *size += out->length;
+            out->length = 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Rewrite journal with waiting messages only
+ *
+ * New journal is written to delayedTemp and renamed over the old one, so one of them is always complete.
+ */
+void delayed_compact(){
+    int fd = open(delayedTemp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0){
+        perror(delayedTemp);
+        return;
+    }
+    bytes_t out = {NULL, 0, 0};
+    size_t size = 0;
+    int ok = delayed_write_list(fd, &out, &size, delayedDue);
+    for(int level=0; level<WHEEL_LEVELS; level++)
+        for(int i=0; i<WHEEL_SLOTS; i++)
+            ok = ok && delayed_write_list(fd, &out, &size, wheel[level][i]);
+    ok = ok && delayed_write(fd, out.data, out.length, size) && !fdatasync(fd) && !rename(delayedTemp, delayedFile);
+    free(out.data);
+    if(!ok){
+        perror("delayed_compact");
+        close(fd);
+        unlink(delayedTemp);
+        return;
+    }
+    close(delayedFd);
+    delayedFd = fd;
+    delayedSize = delayedLive = size + out.length;
+}
+
+/**
+ * @brief Write and sync records appended in this iteration of server loop
+ *
+ * Called before messages are delivered, so the sender is told about delayed message only after it is on disk.
+ * Journal is compacted when more than half of it are delivered messages.
+ */
+void delayed_commit(){
+    if(delayedFd < 0 || !delayedPending.length)
+        return;
+    if(delayed_write(delayedFd, delayedPending.data, delayedPending.length, delayedSize)){
+        if(fdatasync(delayedFd))
+            perror("delayed_commit");
+        delayedSize += delayedPending.length;
+    }
+    delayedPending.length = 0;
+    if(delayedSize > DELAYED_COMPACT && delayedSize > 2 * delayedLive)
+        delayed_compact();
+}
+
+/**
+ * @brief Compare delayed messages by time of delivery and number
+ */
+int delayed_compare(const void * a, const void * b){
+    const delayed_t * x = *(delayed_t * const *)a, * y = *(delayed_t * const *)b;
+    if(x->due != y->due)
+        return x->due < y->due ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/**
+ * @brief Deliver all messages whose time has come
+ *
+ * Messages are delivered in order of time and number, like if their senders sent them now by request 3. They are written to clients
+ * together with all other messages at the end of iteration of server loop.
+ */
+void delayed_fire(){
+    wheel_advance(time(NULL));
+    size_t count = 0;
+    for(delayed_t * message = delayedDue; message; message = message->next)
+        count++;
+    if(!count)
+        return;
+
+    delayed_t ** batch = malloc(count * sizeof(delayed_t *));
+    count = 0;
+    for(delayed_t * message = delayedDue; message; message = message->next)
+        batch[count++] = message;
+    delayedDue = NULL;
+    qsort(batch, count, sizeof(delayed_t *), delayed_compare);
+
+    for(size_t i=0; i<count; i++){
+        delayed_t * message = batch[i];
+        request_t request = {3, 0, 0, NULL, 3, {message->data, message->data + message->fromLength, message->data + message->fromLength + message->toLength},
+                             {message->fromLength, message->toLength, message->textLength}};
+        request_message(&request);
+        offline_record(&delayedPending, OFFLINE_FIRED, message->id, time(NULL), NULL, 0, NULL, 0, NULL, 0);
+        delayedLive -= OFFLINE_HEADER + message->fromLength + message->toLength + message->textLength;
+        free(message);
+    }
+    free(batch);
+    delayedCount -= count;
+    delayedFired += count;
+    delayed_arm();
+}
+
+/**
+ * @brief Handle tick of timer wheel
+ * @param watch - Watch of timer
+ * @param events - Epoll events
+ */
+void delayed_event(watch_t * watch, uint32_t events){
+    (void)events;
+    uint64_t expirations;
+    if(read(watch->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        delayed_fire();
+}
+
+/**
+ * @brief Compare numbers of delayed messages
+ */
+int id_compare(const void * a, const void * b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Load delayed messages from journal and start timer of timer wheel
+ *
+ * Messages without record of delivery are put to timer wheel, messages whose time passed while server was not running are delivered by the first tick.
+ * Damaged end of journal (server crashed during write) is cut off.
+ */
+void delayed_load(){
+    delayedWatch.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    delayedWatch.handler = delayed_event;
+    delayedFd = open(delayedFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(delayedWatch.fd < 0 || delayedFd < 0){
+        perror("delayed_load");
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &delayedWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, delayedWatch.fd, &ev);
+
+    struct stat st;
+    fstat(delayedFd, &st);
+    bytes_t data = {NULL, 0, 0};
+    bytes_reserve(&data, st.st_size);
+    ssize_t n = pread(delayedFd, data.data, st.st_size, 0);
+    if(n < 0)
+        n = 0;
+
+    //numbers of delivered messages
+    uint64_t * fired = NULL;
+    size_t firedCount = 0, firedCapacity = 0, offset = 0;
+    while(offset < (size_t)n){
+        const unsigned char * p = (unsigned char *)data.data + offset;
+        uint32_t size = offline_check(p, n - offset);
+        if(!size || (le32_get(p + 8) != OFFLINE_DELAYED && le32_get(p + 8) != OFFLINE_FIRED))
+            break;
+        if(le32_get(p + 8) == OFFLINE_FIRED){
+            if(firedCount == firedCapacity){
+                firedCapacity = firedCapacity ? 2 * firedCapacity : 1024;
+                fired = realloc(fired, firedCapacity * sizeof(uint64_t));
+            }
+            fired[firedCount++] = le32_get(p + 24) | (uint64_t)le32_get(p + 28) << 32;
+        }
+        offset += size;
+    }
+    if(offset < (size_t)st.st_size){
+        printf("Delayed messages: journal damaged at %zu, cut off\n", offset);
+        if(ftruncate(delayedFd, offset))
+            perror("delayed_load");
+    }
+    delayedSize = offset;
+    if(firedCount)
+        qsort(fired, firedCount, sizeof(uint64_t), id_compare);
+
+    //waiting messages
+    wheelTime = time(NULL);
+    for(offset = 0; offset < delayedSize; offset += le32_get((unsigned char *)data.data + offset)){
+        const unsigned char * p = (unsigned char *)data.data + offset;
+        uint64_t id = le32_get(p + 24) | (uint64_t)le32_get(p + 28) << 32;
+        if(id > delayedSeq)
+            delayedSeq = id;
+        if(le32_get(p + 8) != OFFLINE_DELAYED || bsearch(&id, fired, firedCount, sizeof(uint64_t), id_compare))
+            continue;
+        uint32_t toLength = le32_get(p + 12), fromLength = le32_get(p + 16);
+        const char * to = (const char *)p + OFFLINE_HEADER;
+        delayed_add(id, le32_get(p + 20), to + toLength, fromLength, to, toLength, to + toLength + fromLength, le32_get(p) - OFFLINE_HEADER - toLength - fromLength);
+    }
+    free(fired);
+    free(data.data);
+    printf("Delayed messages: %zu waiting\n", delayedCount);
+    if(delayedSize > DELAYED_COMPACT && delayedSize > 2 * delayedLive)
+        delayed_compact();
+}
+
+/**
+ * @brief Request for message delivered later
+ * @param request - Request with sender, recipient, time of delivery and text
+ *
+ * Time is "+seconds" (send after) or unix time (send at), message whose time has already passed is delivered by the next tick of timer wheel.
+ * At its time the message is delivered like request 3 - it is stored for recipient who is offline then or forwarded to his node of cluster.
+ * Sender is told the number of message and its time of delivery.
+ */
+void request_delayed(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+
+    //time of delivery
+    size_t relative = request->length[2] && request->field[2][0] == '+';
+    uint64_t due = 0;
+    size_t i = relative;
+    for(; i < request->length[2] && isdigit((unsigned char)request->field[2][i]) && due <= UINT32_MAX; i++)
+        due = due * 10 + request->field[2][i] - '0';
+    if(relative)
+        due += time(NULL);
+
+    const char * error = NULL;
+    if(delayedFd < 0)
+        error = "delayed messages are not available";
+    else if(i == relative || i != request->length[2] || due > UINT32_MAX)
+        error = "invalid time, use +seconds or unix time";
+    else if(!user_registered(request->field[1], request->length[1]))
+        error = "user is not registered";
+    char reply[BUFFER_SIZE];
+    int nameLength = request->length[1] > NAME_MAX ? NAME_MAX : request->length[1];
+    if(error){
+        request->failures++;
+        snprintf(reply, BUFFER_SIZE, "Delayed message to %.*s failed: %s\n", nameLength, request->field[1], error);
+        message_send(user, reply);
+        return;
+    }
+
+    delayed_t * message = delayed_add(delayedSeq + 1, due, request->field[0], request->length[0], request->field[1], request->length[1],
+                                      request->field[3], request->length[3]);
+    delayed_record(&delayedPending, message);
+    time_t when = due;
+    struct tm tm;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &tm));
+    snprintf(reply, BUFFER_SIZE, "Message #%llu to %.*s will be delivered at %s\n", (unsigned long long)message->id, nameLength, request->field[1], stamp);
+    message_send(user, reply);
+    console("User %s delayed a message to %.*s till %s\n", user->username, nameLength, request->field[1], stamp);
+}
+
+/**
+ * @brief Request for sending message with receipt
+ * @param request - Request with fields from, to and message
+ *
+ * Message gets the next number in conversation of sender with recipient and it is sent as "from #seq -> message".
+ * Message for logged recipient is kept until he acknowledges it - see request_ack(), message for offline recipient is stored with its number.
+ * Sender gets receipt when message is acknowledged or when it fails. Recipient logged in on other node gets message by link to his node,
+ * which gives it the number.
+ */
+void request_receipted(request_t * request){
+    user_t * user = user_find_field(request, 1);
+
+    //user logged in on other node gets message by link to his node
+    remote_t * remote = !user && nodeId ? remote_find(request->field[1], request->length[1]) : NULL;
+    if(remote){
+        if(peer_queue(&peers[remote->node], LINK_RECEIPTED, 3, (const char **)request->field, request->length)){
+            linkForwarded++;
+            history_add(request->field[0], request->length[0], request->field[1], request->length[1], request->field[2], request->length[2]);
+            console("User %.*s sent a message with receipt to %s on node %d\n",(int)request->length[0],request->field[0],remote->name,remote->node);
+        }
+        else{
+            request->failures++;
+            receipt_failed(request->field[0], request->length[0], request->field[1], request->length[1], 0, "node of user is not connected");
+        }
+        return;
+    }
+
+    pair_t * pair = NULL;
+    const char * error = NULL;
+    if(!user && !user_registered(request->field[1], request->length[1]))
+        error = "user is not registered";
+    else if(!user && !segmentCount)
+        error = "messages for offline users are not stored";
+    else if(!(pair = receipt_pair(request->field[1], request->length[1], request->field[0], request->length[0], 1)))
+        error = "invalid sender";
+    else if(pair->count >= RECEIPT_WINDOW)
+        error = "too many unacknowledged messages";
+    if(error){
+        request->failures++;
+        receipt_failed(request->field[0], request->length[0], request->field[1], request->length[1], 0, error);
+        return;
+    }
+
+    letter_t letter = {request->field[0], request->length[0], request->field[2], request->length[2], ++pair->sent, {NULL, NULL}};
+    if(user){
+        outbox_queue(user->outbox, letter_message(&letter, user->binary));
+        receipt_unacked(user, pair, letter.seq, letter.text, letter.textLength);
+        console("User %.*s sent message #%llu to %s\n",(int)request->length[0],request->field[0],(unsigned long long)letter.seq,user->username);
+    }
+    else{
+        offline_store(request->field[1], request->length[1], &letter);
+        console("User %.*s sent message #%llu to offline user %.*s\n",(int)request->length[0],request->field[0],(unsigned long long)letter.seq,(int)request->length[1],request->field[1]);
+    }
+    letter_release(&letter);
+    history_add(request->field[0], request->length[0], request->field[1], request->length[1], request->field[2], request->length[2]);
+}
+
+/**
+ * @brief Request with acknowledgement of messages with receipt
+ * @param request - Request with fields username and list of senders with numbers of messages "from seq from seq ..."
+ *
+ * Number acknowledges all messages from the sender up to this number, so client sends one request for all messages which it has read.
+ * Every sender gets one receipt for all messages acknowledged by the request. Numbers which were already acknowledged are ignored.
+ */
+void request_ack(request_t * request){
+    user_t * user = user_find_field(request, 0);
+    if(!user){
+        request->failures++;
+        return;
+    }
+    size_t toLength = strlen(user->username);
+
+    //split list to senders and numbers
+    char * name = request->field[1];
+    char * end = name + request->length[1];
+    while(name < end){
+        char * space = memchr(name, ' ', end - name);
+        char * number = space ? space + 1 : end;
+        char * next = memchr(number, ' ', end - number);
+        if(!next)
+            next = end;
+        uint64_t seq = 0;
+        int valid = space && next > number && next - number < 20;
+        for(char * digit = number; valid && digit < next; digit++){
+            valid = isdigit((unsigned char)*digit);
+            seq = seq * 10 + *digit - '0';
+        }
+        pair_t * pair = valid ? receipt_pair(user->username, toLength, name, space - name, 0) : NULL;
+        size_t nameLength = valid ? (size_t)(space - name) : 0;
+        const char * from = name;
+        name = next + 1;
+        if(!pair || !seq || seq > pair->sent){
+            request->failures++;
+            continue;
+        }
+        if(seq <= pair->acked){
+            receiptsDuplicates++;
+            continue;
+        }
+
+        //acknowledged messages are not kept any more
+        uint64_t first = pair->acked + 1;
+        pair->acked = seq;
+        while(pair->head && pair->head->seq <= seq){
+            unacked_t * message = pair->head;
+            pair->head = message->next;
+            pair->count--;
+            receiptsUnacked--;
+            free(message);
+        }
+        if(!pair->head)
+            pair->tail = NULL;
+        receiptsDelivered += seq - first + 1;
+
+        char text[BUFFER_SIZE];
+        if(first == seq)
+            snprintf(text, BUFFER_SIZE, "Message #%llu to %s delivered\n", (unsigned long long)seq, user->username);
+        else
+            snprintf(text, BUFFER_SIZE, "Messages #%llu-#%llu to %s delivered\n", (unsigned long long)first, (unsigned long long)seq, user->username);
+        receipt_notify(from, nameLength, text);
+    }
+}
+
+/**
+ * @brief Write conversations of messages with receipt to file
+ *
+ * Called when server quits or restarts - numbers of messages continue after start and senders get receipts for messages sent before.
+ * Unacknowledged messages are written too, restarted server keeps them for users who are still logged in - see receipt_load().
+ * File is written to temporary file and renamed, so it is either complete or missing.
+ */
+void receipt_save(){
+    bytes_t out = {NULL, 0, 0};
+    for(size_t i=0; i<receipts.capacity; i++){
+        pair_t * pair = receipts.entries[i].value;
+        if(!receipts.entries[i].key)
+            continue;
+        const char * from = pair->key + pair->toLength + 1;
+        unsigned char numbers[16];
+        le32_put(numbers, pair->sent);
+        le32_put(numbers + 4, pair->sent >> 32);
+        le32_put(numbers + 8, pair->acked);
+        le32_put(numbers + 12, pair->acked >> 32);
+        offline_record(&out, OFFLINE_PAIR, 0, time(NULL), pair->key, pair->toLength, from, strlen(from), (char *)numbers, 16);
+        for(unacked_t * message = pair->head; message; message = message->next){
+            char sender[NAME_MAX + 24];
+            int senderLength = snprintf(sender, sizeof(sender), "%s#%llu", from, (unsigned long long)message->seq);
+            offline_record(&out, OFFLINE_RECEIPT, 0, time(NULL), pair->key, pair->toLength, sender, senderLength, message->text, message->length);
+        }
+    }
+    int fd = open(receiptsTemp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0 || write(fd, out.data, out.length) != (ssize_t)out.length || fdatasync(fd) || rename(receiptsTemp, receiptsFile))
+        perror("receipt_save");
+    if(fd >= 0)
+        close(fd);
+    free(out.data);
+}
+
+/**
+ * @brief Load conversations of messages with receipt written by receipt_save()
+ *
+ * Called at the end of server_init(), when users logged in before restart are already handed over - their unacknowledged messages are kept,
+ * messages of other users are stored for them. File is deleted, so state of the previous run is not loaded again after a crash.
+ */
+void receipt_load(){
+    int fd = open(receiptsFile, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return;
+    struct stat st;
+    fstat(fd, &st);
+    bytes_t data = {NULL, 0, 0};
+    bytes_reserve(&data, st.st_size);
+    ssize_t n = pread(fd, data.data, st.st_size, 0);
+    close(fd);
+    unlink(receiptsFile);
+
+    size_t offset = 0, pairs = 0;
+    while(n > 0 && offset < (size_t)n){
+        const unsigned char * p = (unsigned char *)data.data + offset;
+        uint32_t size = offline_check(p, n - offset);
+        if(!size)
+            break;
+        offset += size;
+        uint32_t toLength = le32_get(p + 12), fromLength = le32_get(p + 16);
+        const char * to = (const char *)p + OFFLINE_HEADER;
+        const char * from = to + toLength;
+        letter_t letter = {from, fromLength, from + fromLength, size - OFFLINE_HEADER - toLength - fromLength, 0, {NULL, NULL}};
+        if(le32_get(p + 8) == OFFLINE_PAIR && letter.textLength == 16){
+            pair_t * pair = receipt_pair(to, toLength, from, fromLength, 1);
+            if(!pair)
+                continue;
+            const unsigned char * numbers = (const unsigned char *)letter.text;
+            pair->sent = le32_get(numbers) | (uint64_t)le32_get(numbers + 4) << 32;
+            pair->acked = le32_get(numbers + 8) | (uint64_t)le32_get(numbers + 12) << 32;
+            pairs++;
+        }
+        else if(le32_get(p + 8) == OFFLINE_RECEIPT && receipt_letter(&letter)){
+            user_t * user = strmap_find(&sessions, to, toLength);
+            pair_t * pair = receipt_pair(to, toLength, letter.from, letter.fromLength, 1);
+            if(user && pair)
+                receipt_unacked(user, pair, letter.seq, letter.text, letter.textLength);
+            else
+                offline_store(to, toLength, &letter);
+        }
+    }
+    free(data.data);
+    printf("Receipts: %zu conversations, %llu unacknowledged messages\n", pairs, (unsigned long long)receiptsUnacked);
+}
+
+/**
+ * @brief Append percentiles of histogram to statistics
+ * @param out - Buffer
+ * @param histogram - Histogram
+ */
+void stats_histogram(bytes_t * out, histogram_t * histogram){
+    static const double percentile[3] = {50, 99, 99.9};
+    uint64_t value[3];
+    uint64_t count = histogram_percentiles(histogram, 3, percentile, value);
+    bytes_printf(out, " count %llu p50_us %.1f p99_us %.1f p999_us %.1f max_us %.1f\n", (unsigned long long)count,
+                 value[0] / 1e3, value[1] / 1e3, value[2] / 1e3, __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+/**
+ * @brief Compose statistics of server
+ * @param out - Buffer for statistics, they are appended to it
+ *
+ * Statistics are lines "name value" (request types, histograms and delivery threads have more values on one line):
+ * - counters of invalid requests, denied requests, wrong passwords and messages dropped because client did not read them
+ * - throttled requests, senders and bytes of requests waiting for scheduler
+ * - depths of queues - commands for delivery threads, messages waiting in outboxes, unprocessed input, messages for offline users
+ * - for every request type number of requests, size of their fields, failures and time of processing
+ * - time from queueing message to its write to client
+ * - time from login request to its answer and number of logins waiting for authentication
+ * - links to other nodes of cluster and users logged in on them
+ */
+void stats_format(bytes_t * out){
+    long commands = 0, pending = 0;
+    for(int i=0; i<workerCount; i++){
+        commands += __atomic_load_n(&workers[i].depth, __ATOMIC_RELAXED);
+        pending += __atomic_load_n(&workers[i].pending, __ATOMIC_RELAXED);
+    }
+    uint64_t stored = 0;
+    for(int i=0; i<segmentCount; i++)
+        stored += segments[i].live;
+
+    bytes_printf(out, "uptime_sec %ld\nusers_online %zu\ngroups %zu\n", (long)(time(NULL) - serverStart), sessions.count, groups.count);
+    bytes_printf(out, "invalid_requests %llu\npermission_denied %llu\nauth_failures %llu\ndelivery_dropped %llu\n",
+                 (unsigned long long)invalidRequests, (unsigned long long)permissionDenied, (unsigned long long)authFailures,
+                 (unsigned long long)__atomic_load_n(&deliveryDropped, __ATOMIC_RELAXED));
+    bytes_printf(out, "throttled %llu\nscheduled_senders %zu\nscheduled_bytes %zu\n", (unsigned long long)throttledRequests, scheduledSenders, scheduledBytes);
+    bytes_printf(out, "delayed_waiting %zu\ndelayed_delivered %llu\ndelayed_journal_bytes %zu\n", delayedCount, (unsigned long long)delayedFired, delayedSize);
+    bytes_printf(out, "receipts_conversations %zu\nreceipts_unacked %llu\nreceipts_delivered %llu\nreceipts_failed %llu\nreceipts_stored %llu\nreceipts_duplicates %llu\n",
+                 receipts.count, (unsigned long long)receiptsUnacked, (unsigned long long)receiptsDelivered, (unsigned long long)receiptsFailed,
+                 (unsigned long long)receiptsStored, (unsigned long long)receiptsDuplicates);
+    bytes_printf(out, "history_messages %u\nhistory_segments %d\nhistory_conversations %zu\nhistory_words %zu\n", historyCount - historyBase, volumeCount,
+                 conversations.count, historyWords.count);
+    pthread_mutex_lock(&authLock);
+    int logins = authWaiting;
+    pthread_mutex_unlock(&authLock);
+    bytes_printf(out, "auth_threads %d\nauth_queue %d\n", authCount, logins);
+    if(nodeId){
+        bytes_printf(out, "cluster_node %d\nremote_users %zu\nlink_forwarded %llu\nlink_received %llu\n", nodeId, directory.count,
+                     (unsigned long long)linkForwarded, (unsigned long long)linkReceived);
+        for(int i=1; i<=MAX_NODES; i++)
+            if(peers[i].id && i != nodeId)
+                bytes_printf(out, "node_%d connected %d incoming %d queued_bytes %zu\n", i, peers[i].connected, peers[i].link != NULL,
+                             peers[i].out.length - peers[i].outStart);
+    }
+    bytes_printf(out, "uploads %zu\ntransfer_bytes %llu\n", uploads.count, (unsigned long long)__atomic_load_n(&transferBytes, __ATOMIC_RELAXED));
+    bytes_printf(out, "io_uring_input %d\nio_uring_writes %llu\nio_uring_calls %llu\n", inRing.fd >= 0,
+                 (unsigned long long)__atomic_load_n(&ringWrites, __ATOMIC_RELAXED), (unsigned long long)__atomic_load_n(&ringCalls, __ATOMIC_RELAXED));
+    bytes_printf(out, "queue_commands %ld\nqueue_messages %ld\ninput_bytes %zu\noffline_users %zu\noffline_messages %llu\noffline_segments %d\n",
+                 commands, pending, inLength, backlogs.count, (unsigned long long)stored, segmentCount);
+    for(int i=1; i<REQUEST_TYPES; i++){
+        request_stats_t * stats = &requestStats[i];
+        if(!stats->name)
+            continue;
+        bytes_printf(out, "request_%s requests %llu bytes %llu failures %llu latency", stats->name, (unsigned long long)stats->requests,
+                     (unsigned long long)stats->bytes, (unsigned long long)stats->failures);
+        stats_histogram(out, &stats->latency);
+    }
+    bytes_printf(out, "delivery_latency");
+    stats_histogram(out, &deliveryLatency);
+    bytes_printf(out, "login_latency");
+    stats_histogram(out, &loginLatency);
+    for(int i=0; i<workerCount; i++)
+        bytes_printf(out, "worker_%d outboxes %d commands %ld messages %ld\n", i, __atomic_load_n(&workers[i].outboxes, __ATOMIC_RELAXED),
+                     __atomic_load_n(&workers[i].depth, __ATOMIC_RELAXED), __atomic_load_n(&workers[i].pending, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Request for statistics of server
+ * @param request - Request with name of named pipe for answer (it is ignored for clients connected by socket)
+ *
+ * Statistics are sent as one message "Server statistics:" followed by lines of stats_format(). Logged user gets them to his inbox like online users.
+ */
+void request_stats(request_t * request){
+    bytes_t text = {NULL, 0, 0};
+    bytes_printf(&text, "Server statistics:\n");
+    stats_format(&text);
+
+    user_t * user = request->connection ? request->connection->user : user_find_field(request, 0);
+    char pipename[BUFFER_SIZE];
+    snprintf(pipename,BUFFER_SIZE,"%.*s",(int)request->length[0],request->field[0]);
+    if(user)
+        message_send(user, text.data);
+    else if(request->connection || is_alphanumeric(pipename))
+        message_reply(request, pipename, text.data);
+    free(text.data);
+}
+
+/**
+ * @brief Write statistics to statistics file
+ *
+ * Statistics are written to temporary file which is renamed, so readers never see half written file.
+ */
+void stats_write(){
+    bytes_t text = {NULL, 0, 0};
+    stats_format(&text);
+    char temporary[PATH_MAX];
+    snprintf(temporary, PATH_MAX, "%s.tmp", statsFile);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || write(fd, text.data, text.length) != (ssize_t)text.length || rename(temporary, statsFile))
+        perror("stats_write");
+    if(fd >= 0)
+        close(fd);
+    free(text.data);
+}
+
+/**
+ * @brief Handle expiration of statistics timer
+ * @param watch - Watch of timer
+ * @param events - Epoll events
+ */
+void stats_event(watch_t * watch, uint32_t events){
+    (void)events;
+    uint64_t expirations;
+    if(read(watch->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        stats_write();
+}
+
+/**
+ * @brief Start periodic writing of statistics file
+ */
+void stats_init(){
+    if(!serverStart)
+        serverStart = time(NULL);
+    if(statsInterval <= 0)
+        return;
+    statsWatch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    statsWatch.handler = stats_event;
+    struct itimerspec interval = {{statsInterval, 0}, {statsInterval, 0}};
+    if(statsWatch.fd < 0 || timerfd_settime(statsWatch.fd, 0, &interval, NULL)){
+        perror("stats_init");
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &statsWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, statsWatch.fd, &ev);
+}
+
+/**
+ * Handler of request type
+ */
+typedef struct {
+    int fields;                                 /**< Number of fields of request */
+    void (*handler)(request_t * request);       /**< Function processing request */
+} request_type_t;
+
+/**
+ * Handlers of all request types indexed by type
+ */
+request_type_t requestTypes[] = {
+    [1] = {2, request_login},
+    [2] = {1, request_online},
+    [3] = {3, request_message},
+    [4] = {1, request_logout},
+    [5] = {3, request_multicast},
+    [6] = {2, request_group},
+    [7] = {2, request_group},
+    [8] = {2, request_group},
+    [9] = {3, request_group_post},
+    [10] = {1, request_stats},
+    [11] = {3, request_presence},
+    [12] = {2, request_subscribe},
+    [13] = {3, request_upload},
+    [14] = {4, request_history},
+    [15] = {4, request_search},
+    [16] = {4, request_delayed},
+    [17] = {3, request_receipted},
+    [18] = {2, request_ack},
+};
+
+/**
+ * @brief Process parsed request
+ * @param request - Request
+ *
+ * Request with unknown type or wrong number of fields is ignored.
+ * Requests from socket connection are checked that they are sent in the name of user logged in by the connection.
+ */
+void server_handle_request(request_t * request){
+    int types = sizeof(requestTypes) / sizeof(requestTypes[0]);
+    if(request->type <= 0 || request->type >= types || !requestTypes[request->type].handler
+        || requestTypes[request->type].fields != request->count){
+        invalidRequests++;
+        console("Invalid request of type %d\n", request->type);
+        return;
+    }
+    request_stats_t * stats = &requestStats[request->type];
+    stats->requests++;
+    for(int i=0; i<request->count; i++)
+        stats->bytes += request->length[i];
+
+    //client connected by socket can act only as the user logged in by its connection - first field is always the user
+    if(request->connection && request->type != 1 && request->type != 2 && request->type != 10 && request->type != 11){
+        user_t * user = request->connection->user;
+        if(!user || strlen(user->username) != request->length[0] || memcmp(user->username, request->field[0], request->length[0])){
+            permissionDenied++;
+            stats->failures++;
+            message_reply(request, NULL, "Permission denied\n");
+            return;
+        }
+    }
+    uint64_t start = now_ns();
+    requestTypes[request->type].handler(request);
+    histogram_record(&stats->latency, now_ns() - start);
+    stats->failures += request->failures;
+}
+
+/**
+ * @brief Take tokens from bucket
+ * @param bucket - Token bucket
+ * @param rate - Number of tokens added per second, 0 means no limit
+ * @param count - Number of tokens taken
+ * @param now - Current time in nanoseconds
+ * @return 1 if bucket has enough tokens, 0 otherwise (no tokens are taken)
+ *
+ * Bucket of new user is empty with time 0, so it is filled to its size by the first request.
+ */
+int bucket_take(bucket_t * bucket, double rate, double count, uint64_t now){
+    if(rate <= 0)
+        return 1;
+    bucket->tokens += (now - bucket->time) / 1e9 * rate;
+    if(bucket->tokens > rate * RATE_BURST)
+        bucket->tokens = rate * RATE_BURST;
+    bucket->time = now;
+    //message larger than bucket is accepted when bucket is full, so it can be sent at all
+    if(bucket->tokens < count && bucket->tokens < rate * RATE_BURST)
+        return 0;
+    bucket->tokens -= count;
+    return 1;
+}
+
+/**
+ * @brief Process parsed request or queue it for its sender
+ * @param request - Request
+ *
+ * Requests in the name of logged user (except login) are queued in the queue of user and processed by schedule_run(), so one user sending many
+ * requests can not delay requests of other users. Messages (types 3, 5, 9, 16 and 17) are limited by token buckets of sender - by count and by bytes.
+ * Requests over the limits or over the size of queue are refused, the first of them with message "Throttled".
+ * Request from socket which is not sent in the name of user of the connection is processed immediately - it is refused by server_handle_request().
+ */
+void server_dispatch(request_t * request){
+    user_t * user = request->type != 1 && request->count > 0 ? user_find_field(request, 0) : NULL;
+    if(!user || (request->connection && request->connection != user->connection)){
+        server_handle_request(request);
+        return;
+    }
+
+    size_t size = sizeof(scheduled_t);
+    for(int i=0; i<request->count; i++)
+        size += request->length[i] + 1;
+    size = (size + 7) & ~(size_t)7;
+    int message = request->type == 3 || request->type == 5 || request->type == 9 || request->type == 16 || request->type == 17;
+    int refused = user->queue.length - user->queueStart + size > SCHEDULE_QUEUE;
+    if(!refused && message){
+        uint64_t now = now_ns();
+        refused = !bucket_take(&user->messageBucket, rateMessages, 1, now)
+               || !bucket_take(&user->byteBucket, rateBytes, request->length[request->count - 1], now);
+    }
+    if(refused){
+        throttledRequests++;
+        if(!user->throttled)
+            message_send(user, "Throttled: you are sending too fast, requests are dropped\n");
+        user->throttled = 1;
+        return;
+    }
+    user->throttled = 0;
+
+    //processed requests are removed from queue before it grows
+    if(user->queueStart == user->queue.length)
+        user->queueStart = user->queue.length = 0;
+    else if(user->queueStart > user->queue.length / 2){
+        memmove(user->queue.data, user->queue.data + user->queueStart, user->queue.length - user->queueStart);
+        user->queue.length -= user->queueStart;
+        user->queueStart = 0;
+    }
+    bytes_reserve(&user->queue, size);
+    scheduled_t * record = (scheduled_t *)(user->queue.data + user->queue.length);
+    record->size = size;
+    record->type = request->type;
+    record->binary = request->binary;
+    record->count = request->count;
+    record->connection = request->connection;
+    char * field = (char *)(record + 1);
+    for(int i=0; i<request->count; i++){
+        record->length[i] = request->length[i];
+        memcpy(field, request->field[i], request->length[i]);
+        field[request->length[i]] = '\0';
+        field += request->length[i] + 1;
+    }
+    user->queue.length += size;
+    scheduledBytes += size;
+
+    if(!user->scheduled)
+        schedule_link(user);
+}
+
+/**
+ * @brief Process waiting requests - deficit round robin over senders
+ *
+ * In every round each sender with waiting requests gets SCHEDULE_QUANTUM bytes of deficit and its requests are processed while they fit into deficit.
+ * Sender without more requests is removed from list and its deficit is cleared, so idle sender can not save deficit for later.
+ * Rounds are repeated until about SCHEDULE_BATCH bytes are processed, then the rest waits for the next iteration of server loop.
+ * Request can log out its sender (or another user), removed users are unlinked by user_remove().
+ */
+void schedule_run(){
+    size_t processed = 0;
+    while(scheduleHead && processed < SCHEDULE_BATCH){
+        user_t * user = scheduleHead;
+        user->deficit += SCHEDULE_QUANTUM;
+        scheduledUser = user;
+        while(scheduledUser && user->queueStart < user->queue.length){
+            scheduled_t * record = (scheduled_t *)(user->queue.data + user->queueStart);
+            if(record->size > user->deficit)
+                break;
+            user->deficit -= record->size;
+            processed += record->size;
+            user->queueStart += record->size;
+            scheduledBytes -= record->size;
+
+            //handler gets a copy - it can free the queue
+            scheduleScratch.length = 0;
+            bytes_append(&scheduleScratch, record, record->size);
+            record = (scheduled_t *)scheduleScratch.data;
+            request_t request;
+            request.type = record->type;
+            request.binary = record->binary;
+            request.failures = 0;
+            request.connection = record->connection;
+            request.count = record->count;
+            char * field = (char *)(record + 1);
+            for(int i=0; i<record->count; i++){
+                request.field[i] = field;
+                request.length[i] = record->length[i];
+                field += record->length[i] + 1;
+            }
+            server_handle_request(&request);
+        }
+        //sender was logged out by its request, it is already unlinked
+        if(scheduledUser){
+            schedule_unlink(user);
+            //sender with more requests waits for the next round at the end of list
+            if(user->queueStart < user->queue.length)
+                schedule_link(user);
+            else
+                user->deficit = 0;
+        }
+    }
+    scheduledUser = NULL;
+}
+
+/**
+ * @brief Find the first of two bytes
+ * @param start - Beginning of data
+ * @param end - End of data
+ * @param a - The first byte
+ * @param b - The second byte
+ * @return Position of the first byte which is a or b, NULL if there is none
+ *
+ * With SSE2 data are compared by 16 bytes at once.
+ */
+char * scan_bytes(char * start, char * end, char a, char b){
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    while(end - start >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)start);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if(mask)
+            return start + __builtin_ctz(mask);
+        start += 16;
+    }
+#endif
+    for(; start < end; start++)
+        if(*start == a || *start == b)
+            return start;
+    return NULL;
+}
+
+/**
+ * @brief Request for server is parsed by this function
+ * @param message - Beginning of request
+ * @param end - End of data, there must be one more byte of space after data
+ * @param complete - Data end at the end of request even without newline (the last request in packet)
+ * @param connection - Connection which sent request, NULL for named pipe
+ * @return Beginning of the next request, NULL if request is not complete yet
+ *
+ * Request is one line of server input or of packet from socket.
+ * Fields are separated by | (pipe), but the last field of request can contain | too - it is split only to the number of fields of given type.
+ * Invalid request is ignored.
+ *
+ * Separators of fields and the newline are found in one pass over data. Fields are not copied - they point to the data
+ * and they are terminated by zero only when the whole request is there, so incomplete request can be parsed again after next read.
+ *
+ * There are 18 types of request
+ *
+ * 1. <b>Request for login</b><br/>
+ * Format: <pre>1|username|password</pre>
+ * @see request_login
+ *
+ * 2. <b>Request for online users</b><br/>
+ * Format: <pre>2|pipename</pre>
+ * @see print_online
+ *
+ * 3. <b>Redirect message from client</b><br/>
+ * Format: <pre>3|from|to|message</pre>
+ * Server sends message using function message_send() to client "to" of format "from" -> message
+ *
+ * 4. <b>Request for logout user</b><br/>
+ * Format: <pre>4|username</pre>
+ * Logout user with given username
+ * @see user_logout
+ *
+ * 5. <b>Send message to more users</b><br/>
+ * Format: <pre>5|from|to1 to2 to3|message</pre>
+ * @see request_multicast
+ *
+ * 6. <b>Create group</b><br/>
+ * Format: <pre>6|username|group</pre>
+ * Group is created and user becomes its first member.
+ *
+ * 7. <b>Join group</b><br/>
+ * Format: <pre>7|username|group</pre>
+ *
+ * 8. <b>Leave group</b><br/>
+ * Format: <pre>8|username|group</pre>
+ * Group is deleted when its last member leaves. User leaves all groups at logout.
+ *
+ * 9. <b>Post message to group</b><br/>
+ * Format: <pre>9|from|group|message</pre>
+ * @see request_group_post
+ *
+ * 10. <b>Request for statistics</b><br/>
+ * Format: <pre>10|pipename</pre>
+ * @see request_stats
+ *
+ * 11. <b>Request for page of online users</b><br/>
+ * Format: <pre>11|username|prefix|after</pre>
+ * @see request_presence
+ *
+ * 12. <b>Subscription to presence</b><br/>
+ * Format: <pre>12|username|1</pre> or <pre>12|username|0</pre> for cancel
+ * @see request_subscribe
+ *
+ * 13. <b>Large message</b><br/>
+ * Format: <pre>13|from|to|size</pre>
+ * @see request_upload
+ *
+ * 14. <b>Request for history of conversation</b><br/>
+ * Format: <pre>14|username|peer|count|before</pre>
+ * Peer is username or #group, count and before (time or #number of message) can be empty.
+ * @see request_history
+ *
+ * 15. <b>Search in history</b><br/>
+ * Format: <pre>15|username|words|count|before</pre>
+ * @see request_search
+ *
+ * 16. <b>Delayed message</b><br/>
+ * Format: <pre>16|from|to|time|message</pre>
+ * Time is +seconds or unix time.
+ * @see request_delayed
+ *
+ * 17. <b>Message with receipt</b><br/>
+ * Format: <pre>17|from|to|message</pre>
+ * @see request_receipted
+ *
+ * 18. <b>Acknowledgement of messages with receipt</b><br/>
+ * Format: <pre>18|username|from seq from seq ...</pre>
+ * @see request_ack
+ *
+ * The same requests can be sent as binary frames - see server_parse_frame().
+ */
+char * server_parse_input(char * message, char * end, int complete, connection_t * connection){
+    request_t request;
+    request.binary = 0;
+    request.failures = 0;
+    request.connection = connection;
+    request.count = 0;
+
+    //type of request
+    char * p = message;
+    request.type = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++)
+        if(request.type < 1000)
+            request.type = request.type * 10 + *p - '0';
+    int types = sizeof(requestTypes) / sizeof(requestTypes[0]);
+    int fields = request.type > 0 && request.type < types ? requestTypes[request.type].fields : 0;
+
+    //split fields, the last field can contain |
+    char * newline = NULL;
+    if(p < end && p[0] == '|'){
+        p++;
+        request.field[request.count++] = p;
+        while(request.count < fields){
+            char * separator = scan_bytes(p, end, '|', '\n');
+            if(!separator || separator[0] == '\n'){
+                newline = separator;
+                break;
+            }
+            request.length[request.count - 1] = separator - p;
+            p = separator + 1;
+            request.field[request.count++] = p;
+        }
+    }
+    if(!newline)
+        newline = memchr(p, '\n', end - p);
+    if(!newline){
+        if(!complete)
+            return NULL;
+        newline = end;
+    }
+    if(request.count)
+        request.length[request.count - 1] = newline - request.field[request.count - 1];
+    for(int i=0; i<request.count; i++)
+        request.field[i][request.length[i]] = '\0';
+
+    //if query is empty... do nothing
+    if(newline > message)
+        server_dispatch(&request);
+    return newline < end ? newline + 1 : end;
+}
+
+/**
+ * @brief Split binary frame to fields
+ * @param frame - Complete frame
+ * @param size - Size of frame
+ * @param request - Request for type and fields of frame, fields point to the frame
+ * @return 1 if frame is valid
+ */
+int frame_fields(char * frame, size_t size, request_t * request){
+    unsigned char * p = (unsigned char *)frame;
+    request->binary = 1;
+    request->failures = 0;
+    request->type = p[2];
+    request->count = p[3];
+    size_t header = FRAME_HEADER + 4 * request->count;
+
+    size_t start = 0;
+    for(int i=0; i<request->count; i++){
+        size_t end = le32_get(p + FRAME_HEADER + 4 * i);
+        if(end < start || header + end > size)
+            return 0;
+        request->field[i] = frame + header + start;
+        request->length[i] = end - start;
+        start = end;
+    }
+    return 1;
+}
+
+/**
+ * @brief Binary request is parsed by this function
+ * @param frame - Complete frame
+ * @param size - Size of frame
+ * @param connection - Connection which sent frame, NULL for named pipe
+ * @return 1 if frame is valid
+ *
+ * Frame has the same format as frames sent by server - see frame_new(). Type of frame is type of request and fields are in the same order as in text request.
+ * Fields are not copied - they are given to handler by offsets, so messages can contain any bytes.
+ */
+int server_parse_frame(char * frame, size_t size, connection_t * connection){
+    request_t request;
+    request.connection = connection;
+    if(!frame_fields(frame, size, &request))
+        return 0;
+    server_dispatch(&request);
+    return 1;
+}
+
+/**
+ * @brief Terminate server
+ *
+ * At first all logged users are logged out (commands to quit clients are included). Server waits until delivery threads write the messages (at most 1 second), then frees all used memory, deletes all used files and terminates server.
+ */
+void server_quit(){
+
+    for(int i=0; i<usersUsed; i++){
+        // is here is logged user
+        if(users_logged[i]){
+            //send message to him
+            message_send(users_logged[i],"Server terminated\n");
+            message_send(users_logged[i],"Logged out.\n");
+            outbox_close(users_logged[i]->outbox);
+
+            //free used memory for him
+            user_remove(users_logged[i]);
+        }
+    }
+    //other nodes are told about logouts
+    cluster_flush();
+    strmap_clear(&sessions);
+    //write stored messages
+    offline_commit();
+    delayed_commit();
+    receipt_save();
+    history_close();
+    //logins in progress are not answered
+    auth_stop(0);
+    //wait for deliver all messages - at most 1 second
+    workers_stop();
+    //destroy named pipe
+    if(in>=0)
+        close(in);
+    if(inKeepalive>=0)
+        close(inKeepalive);
+    unlink(inPipe);
+    unlink(serverSocket);
+    remove(serverLock);
+    //exit program
+    exit(0);
+}
+
+
+/**
+ * @brief Check size of binary frame at the beginning of data
+ * @param data - Data starting by FRAME_MAGIC
+ * @param length - Length of data
+ * @return Size of complete frame, 0 if frame is not complete yet, -1 if frame is invalid
+ */
+ssize_t frame_size(char * data, size_t length){
+    unsigned char * p = (unsigned char *)data;
+    if(length < FRAME_HEADER)
+        return 0;
+    if(p[1] != FRAME_VERSION || p[3] > REQUEST_FIELDS)
+        return -1;
+    size_t size = FRAME_HEADER + 4 * p[3] + le32_get(p + 4);
+    if(size > FRAME_MAX)
+        return -1;
+    return size <= length ? (ssize_t)size : 0;
+}
+
+/**
+ * @brief Process all complete requests in data
+ * @param start - Beginning of data
+ * @param end - End of data, there must be one more byte of space after data
+ * @param discard - Set if the data start inside of invalid or too long request, which is skipped till the next newline
+ * @param connection - Connection which sent data, NULL for named pipe
+ * @return Beginning of incomplete request at the end of data
+ *
+ * Text requests are separated by newline. Binary frame starts with FRAME_MAGIC and its size is in its header, so it is not scanned for newlines.
+ * Invalid frame is skipped till the next newline.
+ */
+char * server_process_data(char * start, char * end, int * discard, connection_t * connection){
+    while(start < end){
+        //binary frame
+        if((unsigned char)start[0] == FRAME_MAGIC && !*discard){
+            ssize_t size = frame_size(start, end - start);
+            if(size == 0)
+                break;
+            if(size > 0 && server_parse_frame(start, size, connection)){
+                start += size;
+                continue;
+            }
+            console("Invalid frame\n");
+            *discard = 1;
+        }
+
+        //rest of invalid request
+        if(*discard){
+            char * newline = memchr(start, '\n', end - start);
+            if(!newline)
+                break;
+            *discard = 0;
+            start = newline + 1;
+            continue;
+        }
+
+        //text request
+        char * next = server_parse_input(start, end, 0, connection);
+        if(!next)
+            break;
+        start = next;
+    }
+    return start;
+}
+
+/**
+ * @brief Process all complete requests in inBuffer
+ *
+ * Incomplete request at the end of buffer is moved to the beginning and waits for the rest of data.
+ * Text request longer than buffer is skipped.
+ */
+void server_process_buffer(){
+    char * end = inBuffer + inLength;
+    char * start = server_process_data(inBuffer, end, &inDiscard, NULL);
+
+    //keep incomplete request for next read
+    inLength = end - start;
+    if(inLength == INPUT_BUFFER_SIZE - 1){
+        //request does not fit into buffer - skip it
+        inDiscard = 1;
+        inLength = 0;
+    }
+    memmove(inBuffer, start, inLength);
+}
+
+/**
+ * @brief Read all available data from server input
+ *
+ * Pipe is non-blocking, so function reads until the pipe is empty and processes every complete request after each read.
+ * @param watch - Watch of server input
+ * @param events - Epoll events
+ */
+void server_read_input(watch_t * watch, uint32_t events){
+    (void)watch;
+    (void)events;
+    while(1){
+        ssize_t n = read(in, inBuffer + inLength, INPUT_BUFFER_SIZE - 1 - inLength);
+        if(n > 0){
+            inLength += n;
+            server_process_buffer();
+        }
+        else if(n < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+}
+
+/**
+ * @brief Submit read of server input to io_uring
+ *
+ * Data are read directly to the free end of inBuffer, which is registered in io_uring. Descriptor is blocking, so the read waits in kernel until a client writes.
+ */
+void input_submit(){
+    struct io_uring_sqe * sqe = ring_sqe(&inRing);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = in;
+    sqe->addr = (uintptr_t)(inBuffer + inLength);
+    sqe->len = INPUT_BUFFER_SIZE - 1 - inLength;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = INPUT_READ;
+    ring_submit(&inRing, 0);
+    inReading = 1;
+}
+
+/**
+ * @brief Read server input after epoll event instead of io_uring
+ *
+ * Used when io_uring is not available or when it fails.
+ */
+void input_epoll(){
+    fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &inWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, in, &ev);
+}
+
+/**
+ * @brief Handle completed read of server input and submit the next one
+ * @param watch - Watch of inRing
+ * @param events - Epoll events
+ *
+ * Completions of io_uring wake epoll of server loop like any other descriptor. Read which finds data in pipe is completed already by its submission,
+ * so function reads until the pipe is empty like server_read_input().
+ */
+void input_complete(watch_t * watch, uint32_t events){
+    (void)watch;
+    (void)events;
+    struct io_uring_cqe * cqe;
+    while((cqe = ring_cqe(&inRing)) != NULL){
+        int result = cqe->res;
+        uint64_t id = cqe->user_data;
+        ring_seen(&inRing);
+        if(id != INPUT_READ)
+            continue;
+        inReading = 0;
+        if(result > 0){
+            inLength += result;
+            server_process_buffer();
+        }
+        else if(result != -EINTR){
+            console("Reading of server input by io_uring failed (%s), using epoll\n", strerror(-result));
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, inRing.fd, NULL);
+            ring_free(&inRing);
+            input_epoll();
+            return;
+        }
+        input_submit();
+    }
+}
+
+/**
+ * @brief Start reading server input - by io_uring if it is available, otherwise after epoll events
+ *
+ * Descriptor of named pipe is shared with restarted server, so its mode is set again by every process.
+ */
+void input_start(){
+    if(uringOption && ring_init(&inRing, 4)){
+        struct iovec buffer = {inBuffer, INPUT_BUFFER_SIZE};
+        if(!syscall(__NR_io_uring_register, inRing.fd, IORING_REGISTER_BUFFERS, &buffer, 1)){
+            fcntl(in, F_SETFL, fcntl(in, F_GETFL) & ~O_NONBLOCK);
+            inRingWatch.fd = inRing.fd;
+            inRingWatch.handler = input_complete;
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &inRingWatch;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, inRing.fd, &ev);
+            input_submit();
+            return;
+        }
+        ring_free(&inRing);
+    }
+    input_epoll();
+}
+
+/**
+ * @brief Stop reading server input by io_uring before restart
+ *
+ * Read waiting in kernel is cancelled, so it can not take requests which belong to the next server. Data of read completed before the cancel are processed.
+ */
+void input_stop(){
+    if(inRing.fd < 0)
+        return;
+    if(inReading){
+        struct io_uring_sqe * sqe = ring_sqe(&inRing);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = INPUT_READ;
+        sqe->user_data = INPUT_CANCEL;
+        ring_submit(&inRing, 0);
+    }
+    while(inReading){
+        struct io_uring_cqe * cqe = ring_cqe(&inRing);
+        if(!cqe){
+            ring_submit(&inRing, 1);
+            continue;
+        }
+        int result = cqe->res;
+        uint64_t id = cqe->user_data;
+        ring_seen(&inRing);
+        if(id != INPUT_READ)
+            continue;
+        inReading = 0;
+        if(result > 0){
+            inLength += result;
+            server_process_buffer();
+        }
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, inRing.fd, NULL);
+    ring_free(&inRing);
+}
+
+/**
+ * @brief Close connection of client
+ * @param connection - Connection
+ *
+ * User logged in by connection is logged out, login of connection which is being authenticated is cancelled.
+ */
+void connection_close(connection_t * connection){
+    //login which is being authenticated is not answered
+    if(connection->login){
+        connection->login->cancelled = 1;
+        connection->login->connection = NULL;
+    }
+    if(connection->user)
+        user_logout(connection->user->username);
+    if(connection->prev)
+        connection->prev->next = connection->next;
+    else
+        connections = connection->next;
+    if(connection->next)
+        connection->next->prev = connection->prev;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->watch.fd, NULL);
+    close(connection->watch.fd);
+    free(connection);
+}
+
+/**
+ * @brief Read requests from connection of client
+ * @param watch - Watch of connection
+ * @param events - Epoll events
+ *
+ * Every packet contains whole requests - text request at the end of packet does not have to be terminated by newline. Packet longer than PACKET_MAX is ignored.
+ * Connection is closed when client closes its socket.
+ */
+void connection_event(watch_t * watch, uint32_t events){
+    connection_t * connection = (connection_t *)((char *)watch - offsetof(connection_t, watch));
+    while(1){
+        struct iovec iov = {packetBuffer, PACKET_MAX};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n = recvmsg(watch->fd, &msg, MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+            return;
+        if(n <= 0)
+            break;
+        if(msg.msg_flags & MSG_TRUNC){
+            console("Too long request\n");
+            continue;
+        }
+
+        int discard = 0;
+        char * end = packetBuffer + n;
+        char * rest = server_process_data(packetBuffer, end, &discard, connection);
+        if(rest < end && !discard)
+            server_parse_input(rest, end, 1, connection);
+    }
+    (void)events;
+    connection_close(connection);
+}
+
+/**
+ * @brief Start reading requests from connected client
+ * @param fd - Socket of client
+ * @return Connection
+ */
+connection_t * connection_new(int fd){
+    connection_t * connection = calloc(1, sizeof(connection_t));
+    connection->watch.fd = fd;
+    connection->watch.handler = connection_event;
+    connection->next = connections;
+    if(connections)
+        connections->prev = connection;
+    connections = connection;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &connection->watch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    return connection;
+}
+
+/**
+ * @brief Accept new connections of clients
+ * @param watch - Watch of listening socket
+ * @param events - Epoll events
+ */
+void connection_accept(watch_t * watch, uint32_t events){
+    (void)events;
+    int fd;
+    while((fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        connection_new(fd);
+}
+
+/**
+ * @brief Start listening on unix domain socket
+ *
+ * Socket is SOCK_SEQPACKET - connection is persistent and kernel keeps boundaries of packets.
+ */
+void connection_init(){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, serverSocket, sizeof(address.sun_path) - 1);
+
+    listenWatch.handler = connection_accept;
+    if(handoffFd < 0){
+        //socket from previous run - server.lock guarantees it is not used
+        unlink(serverSocket);
+        listenWatch.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listenWatch.fd < 0 || bind(listenWatch.fd, (struct sockaddr *)&address, sizeof(address)) || listen(listenWatch.fd, SOMAXCONN)){
+            perror(serverSocket);
+            listenWatch.fd = -1;
+            return;
+        }
+        chmod(serverSocket, 0666);
+    }
+    else if(listenWatch.fd < 0)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenWatch.fd, &ev);
+}
+
+/**
+ * @brief Close incoming link from other node - users of the node are removed from routing directory
+ * @param link - Link
+ */
+void link_close(link_t * link){
+    if(link->node && peers[link->node].link == link){
+        peers[link->node].link = NULL;
+        remote_clear(link->node);
+        console("Link from node %d closed\n", link->node);
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, link->watch.fd, NULL);
+    close(link->watch.fd);
+    free(link->in.data);
+    free(link);
+}
+
+/**
+ * @brief Process frame received by link from other node
+ * @param link - Link
+ * @param frame - Complete frame
+ * @param size - Size of frame
+ * @return 1 if frame is valid, 0 if link has to be closed
+ *
+ * The first frame must be LINK_HELLO with id of node from cluster file. Older link from the same node is closed - node was restarted.
+ * After it node sends LINK_ONLINE for all its users and then changes of presence and messages.
+ */
+int link_frame(link_t * link, char * frame, size_t size){
+    request_t request;
+    request.connection = NULL;
+    if(!frame_fields(frame, size, &request))
+        return 0;
+
+    if(!link->node){
+        char text[16];
+        if(request.type != LINK_HELLO || request.count != 1 || request.length[0] >= sizeof(text))
+            return 0;
+        memcpy(text, request.field[0], request.length[0]);
+        text[request.length[0]] = '\0';
+        int node = atoi(text);
+        if(node <= 0 || node > MAX_NODES || !peers[node].id || node == nodeId)
+            return 0;
+        if(peers[node].link)
+            link_close(peers[node].link);
+        link->node = node;
+        peers[node].link = link;
+        console("Link from node %d connected\n", node);
+        return 1;
+    }
+
+    if((request.type == LINK_ONLINE || request.type == LINK_OFFLINE) && request.count == 1 && is_name(request.field[0], request.length[0])){
+        remote_t * remote = remote_find(request.field[0], request.length[0]);
+        if(request.type == LINK_ONLINE)
+            remote_add(link->node, request.field[0], request.length[0]);
+        else if(remote && remote->node == link->node)
+            remote_remove(remote);
+        return 1;
+    }
+    if((request.type == LINK_MESSAGE || request.type == LINK_RECEIPTED) && request.count == 3){
+        //message is delivered here or stored for offline user - it is never forwarded again
+        request.type = request.type == LINK_MESSAGE ? 3 : 17;
+        request_stats_t * stats = &requestStats[request.type];
+        stats->requests++;
+        linkReceived++;
+        if(user_find_field(&request, 1) || !remote_find(request.field[1], request.length[1]))
+            requestTypes[request.type].handler(&request);
+        else{
+            request.failures++;
+            if(request.type == 17)
+                receipt_failed(request.field[0], request.length[0], request.field[1], request.length[1], 0, "user moved to other node");
+        }
+        stats->failures += request.failures;
+        return 1;
+    }
+    if(request.type == LINK_RECEIPT && request.count == 2 && request.length[1] < BUFFER_SIZE){
+        char text[BUFFER_SIZE];
+        memcpy(text, request.field[1], request.length[1]);
+        text[request.length[1]] = '\0';
+        user_t * user = strmap_find(&sessions, request.field[0], request.length[0]);
+        if(user)
+            message_send(user, text);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read frames from incoming link
+ * @param watch - Watch of link socket
+ * @param events - Epoll events
+ */
+void link_event(watch_t * watch, uint32_t events){
+    (void)events;
+    link_t * link = (link_t *)((char *)watch - offsetof(link_t, watch));
+    while(1){
+        bytes_reserve(&link->in, FRAME_MAX);
+        ssize_t n = recv(watch->fd, link->in.data + link->in.length, link->in.capacity - link->in.length, MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+            return;
+        if(n <= 0){
+            link_close(link);
+            return;
+        }
+        link->in.length += n;
+
+        //all complete frames are processed, the incomplete one is moved to the beginning
+        size_t start = 0;
+        while(start < link->in.length){
+            char * frame = link->in.data + start;
+            ssize_t size = (unsigned char)frame[0] == FRAME_MAGIC ? frame_size(frame, link->in.length - start) : -1;
+            if(size == 0)
+                break;
+            if(size < 0 || !link_frame(link, frame, size)){
+                console("Invalid frame from node %d\n", link->node);
+                link_close(link);
+                return;
+            }
+            start += size;
+        }
+        memmove(link->in.data, link->in.data + start, link->in.length - start);
+        link->in.length -= start;
+    }
+}
+
+/**
+ * @brief Accept links from other nodes
+ * @param watch - Watch of listening socket
+ * @param events - Epoll events
+ */
+void link_accept(watch_t * watch, uint32_t events){
+    (void)events;
+    int fd;
+    while((fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        link_t * link = calloc(1, sizeof(link_t));
+        link->watch.fd = fd;
+        link->watch.handler = link_event;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &link->watch;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/**
+ * @brief Handle events of outgoing link
+ * @param watch - Watch of link socket
+ * @param events - Epoll events
+ *
+ * When connect is finished, node gets LINK_HELLO and all users of this node. Other node never writes to this link, so readable socket means that it was closed.
+ */
+void peer_event(watch_t * watch, uint32_t events){
+    peer_t * peer = (peer_t *)((char *)watch - offsetof(peer_t, watch));
+    if(!peer->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if(getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &error, &length) || error){
+            peer_close(peer);
+            return;
+        }
+        peer->connected = 1;
+        console("Link to node %d connected\n", peer->id);
+
+        char text[16];
+        const char * field[1] = {text};
+        size_t fieldLength[1] = {(size_t)snprintf(text, sizeof(text), "%d", nodeId)};
+        peer_queue(peer, LINK_HELLO, 1, field, fieldLength);
+        for(size_t i=0; i<onlineCount; i++){
+            field[0] = onlineIndex[i];
+            fieldLength[0] = strlen(onlineIndex[i]);
+            peer_queue(peer, LINK_ONLINE, 1, field, fieldLength);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &peer->watch;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, watch->fd, &ev);
+        peer_flush(peer);
+        return;
+    }
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+        char buffer[256];
+        ssize_t n = recv(watch->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+            console("Link to node %d closed\n", peer->id);
+            peer_close(peer);
+            return;
+        }
+    }
+    if(events & EPOLLOUT){
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &peer->watch;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, watch->fd, &ev);
+        peer_flush(peer);
+    }
+}
+
+/**
+ * @brief Start connecting outgoing link to other node
+ * @param peer - Node
+ */
+void peer_connect(peer_t * peer){
+    peer->watch.fd = socket(peer->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    peer->watch.handler = peer_event;
+    if(peer->watch.fd < 0)
+        return;
+    int one = 1;
+    setsockopt(peer->watch.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(peer->watch.fd, (struct sockaddr *)&peer->address, peer->addressLength) && errno != EINPROGRESS){
+        peer_close(peer);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &peer->watch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, peer->watch.fd, &ev);
+}
+
+/**
+ * @brief Connect links to nodes which are not connected - called every LINK_RETRY seconds
+ * @param watch - Watch of timerfd
+ * @param events - Epoll events
+ */
+void cluster_timer(watch_t * watch, uint32_t events){
+    (void)events;
+    uint64_t expirations;
+    if(read(watch->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("cluster_timer");
+    for(int i=1; i<=MAX_NODES; i++)
+        if(peers[i].id && i != nodeId && peers[i].watch.fd < 0)
+            peer_connect(&peers[i]);
+}
+
+/**
+ * @brief Load nodes of cluster from cluster file
+ * @return 1 if file is valid and it contains this node
+ *
+ * Every line is "id host port", ids are from 1 to MAX_NODES. Host names are resolved only here.
+ */
+int cluster_load(){
+    FILE * f = fopen(clusterFile, "r");
+    if(!f){
+        perror(clusterFile);
+        return 0;
+    }
+    int id;
+    char host[256], port[16];
+    while(fscanf(f, "%d %255s %15s", &id, host, port) == 3){
+        struct addrinfo hints, * result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if(id <= 0 || id > MAX_NODES || peers[id].id || getaddrinfo(host, port, &hints, &result)){
+            fprintf(stderr, "%s: invalid node %d %s %s\n", clusterFile, id, host, port);
+            fclose(f);
+            return 0;
+        }
+        peer_t * peer = &peers[id];
+        peer->id = id;
+        peer->watch.fd = -1;
+        memcpy(&peer->address, result->ai_addr, result->ai_addrlen);
+        peer->addressLength = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+    fclose(f);
+    if(!peers[nodeId].id){
+        fprintf(stderr, "%s: node %d is not in cluster\n", clusterFile, nodeId);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Join cluster - listen for links from other nodes and connect links to them
+ *
+ * Every pair of nodes is joined by two TCP connections, each of them is written only by the node which connected it.
+ * Node which is not running yet is connected later by cluster_timer().
+ */
+void cluster_init(){
+    if(!nodeId)
+        return;
+    if(!cluster_load())
+        server_quit();
+
+    peer_t * self = &peers[nodeId];
+    clusterWatch.handler = link_accept;
+    if(handoffFd < 0){
+        clusterWatch.fd = socket(self->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if(clusterWatch.fd >= 0)
+            setsockopt(clusterWatch.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(clusterWatch.fd < 0 || bind(clusterWatch.fd, (struct sockaddr *)&self->address, self->addressLength) || listen(clusterWatch.fd, SOMAXCONN)){
+            perror("cluster_init");
+            server_quit();
+        }
+    }
+    else if(clusterWatch.fd < 0){
+        fprintf(stderr, "cluster_init: previous server was not in cluster\n");
+        server_quit();
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &clusterWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, clusterWatch.fd, &ev);
+
+    clusterTimer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    clusterTimer.handler = cluster_timer;
+    struct itimerspec interval = {{LINK_RETRY, 0}, {0, 1}};
+    timerfd_settime(clusterTimer.fd, 0, &interval, NULL);
+    ev.data.ptr = &clusterTimer;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, clusterTimer.fd, &ev);
+}
+
+/**
+ * State of server handed over to restarted server
+ */
+typedef struct {
+    int pid;                    /**< Process which sends the state, it exits after the last record */
+    int discard;                /**< Server input is being skipped till the next newline */
+    int listen;                 /**< Listening socket for clients is attached */
+    int cluster;                /**< Listening socket for other nodes is attached */
+    time_t start;               /**< Time when the first server process started, uptime continues from it */
+} handoff_header_t;
+
+/**
+ * User handed over to restarted server - username follows, descriptor of outbox and socket of connection are attached
+ */
+typedef struct {
+    int binary;                 /**< User uses binary frames */
+    int watcher;                /**< User is subscribed to presence */
+    int connection;             /**< User is connected by socket - it is attached after outbox */
+} handoff_user_t;
+
+/**
+ * @brief Send one record of state to restarted server
+ * @param sock - Socket
+ * @param type - Type of record: H header, I part of unprocessed input, C connection, U user, G membership in group, E end
+ * @param data - Data of record
+ * @param length - Length of data
+ * @param fd - Descriptors sent with record
+ * @param count - Number of descriptors
+ * @return 1 if record was sent
+ */
+int handoff_send(int sock, char type, const void * data, size_t length, const int * fd, int count){
+    struct iovec iov[2] = {{&type, 1}, {(void *)data, length}};
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if(count){
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fd, count * sizeof(int));
+    }
+    while(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0){
+        if(errno != EINTR){
+            perror("handoff_send");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Receive one record of state from previous server process
+ * @param data - Buffer for record, the first byte is type of record
+ * @param size - Size of buffer
+ * @param fd - Array for at least 4 received descriptors
+ * @param count - Number of received descriptors
+ * @return Length of record, 0 if previous process closed the socket
+ */
+size_t handoff_receive(char * data, size_t size, int * fd, int * count){
+    struct iovec iov = {data, size};
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t n;
+    while((n = recvmsg(handoffFd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    *count = 0;
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        *count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fd, CMSG_DATA(cmsg), *count * sizeof(int));
+    }
+    return n > 0 ? (size_t)n : 0;
+}
+
+/**
+ * @brief Send state of server to restarted server - called in child process
+ * @param sock - Socket
+ * @param outboxFd - Descriptors of outboxes indexed by slot of user
+ *
+ * Unprocessed input of named pipe, connections of clients which are not logged in, logged users and their groups are sent.
+ * Descriptors stay open in this process until it exits, so clients do not notice that the server was restarted.
+ */
+void handoff_state(int sock, int * outboxFd){
+    handoff_header_t header = {getpid(), inDiscard, listenWatch.fd >= 0, nodeId && clusterWatch.fd >= 0, serverStart};
+    int fd[4] = {in, inKeepalive}, count = 2;
+    if(header.listen)
+        fd[count++] = listenWatch.fd;
+    if(header.cluster)
+        fd[count++] = clusterWatch.fd;
+    if(!handoff_send(sock, 'H', &header, sizeof(header), fd, count))
+        return;
+    for(size_t i=0; i<inLength; i += ARENA_CHUNK)
+        handoff_send(sock, 'I', inBuffer + i, inLength - i < ARENA_CHUNK ? inLength - i : ARENA_CHUNK, NULL, 0);
+
+    for(connection_t * connection = connections; connection; connection = connection->next)
+        if(!connection->user)
+            handoff_send(sock, 'C', NULL, 0, &connection->watch.fd, 1);
+
+    bytes_t record = {NULL, 0, 0};
+    for(int i=0; i<usersUsed; i++){
+        user_t * user = users_logged[i];
+        if(!user)
+            continue;
+        handoff_user_t state = {user->binary, user->watcher >= 0, user->connection != NULL};
+        record.length = 0;
+        bytes_append(&record, &state, sizeof(state));
+        bytes_append(&record, user->username, strlen(user->username));
+        fd[0] = outboxFd[i];
+        fd[1] = user->connection ? user->connection->watch.fd : -1;
+        handoff_send(sock, 'U', record.data, record.length, fd, user->connection ? 2 : 1);
+        for(int j=0; j<user->groupCount; j++){
+            record.length = 0;
+            bytes_append(&record, user->username, strlen(user->username) + 1);
+            bytes_append(&record, user->groups[j]->name, strlen(user->groups[j]->name));
+            handoff_send(sock, 'G', record.data, record.length, NULL, 0);
+        }
+    }
+    free(record.data);
+    handoff_send(sock, 'E', NULL, 0, NULL, 0);
+}
+
+/**
+ * @brief Restart server with new binary without logging out users
+ *
+ * Requests which are already read are processed, logins being authenticated are finished and delivery threads write all queued messages.
+ * Then a child process keeps all descriptors and sends them with state of server over SCM_RIGHTS, while this process executes the binary again
+ * with the same arguments - it keeps its pid and console. Restart waits until all uploads of files are finished.
+ */
+void server_restart(){
+    if(uploads.count){
+        if(!restartPending)
+            console("Restart waits for %zu uploads of files\n", uploads.count);
+        restartPending = 1;
+        return;
+    }
+    console("Restarting server\n");
+
+    //finish everything what was already read
+    input_stop();
+    while(scheduleHead)
+        schedule_run();
+    auth_stop(1);
+    offline_commit();
+    delayed_commit();
+    receipt_save();
+    history_close();
+
+    //delivery threads write queued messages and free outboxes, but their descriptors stay open
+    int * outboxFd = malloc((usersUsed + 1) * sizeof(int));
+    for(int i=0; i<usersUsed; i++)
+        if(users_logged[i])
+            outboxFd[i] = outbox_detach(users_logged[i]->outbox);
+    cluster_flush();
+    workers_stop();
+
+    int sock[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock)){
+        perror("server_restart");
+        exit(1);
+    }
+    int size = 4 * ARENA_CHUNK;
+    setsockopt(sock[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    pid_t pid = fork();
+    if(pid == 0){
+        close(sock[1]);
+        handoff_state(sock[0], outboxFd);
+        _exit(0);
+    }
+    if(pid < 0){
+        perror("fork");
+        exit(1);
+    }
+
+    close(sock[0]);
+    fcntl(sock[1], F_SETFD, 0);
+    char number[16];
+    snprintf(number, sizeof(number), "%d", sock[1]);
+    setenv("SERVER_HANDOFF", number, 1);
+    fflush(stdout);
+    execvp(serverArgv[0], serverArgv);
+    perror("execvp");
+    exit(1);
+}
+
+/**
+ * @brief Receive descriptors of server input and listening sockets from previous server process
+ *
+ * Called at the beginning of server_init() of restarted server instead of creating them.
+ */
+void handoff_begin(){
+    char data[64];
+    int fd[4], count;
+    size_t n = handoff_receive(data, sizeof(data), fd, &count);
+    handoff_header_t header;
+    if(n != 1 + sizeof(header) || data[0] != 'H' || count < 2){
+        fprintf(stderr, "handoff: invalid state of previous server\n");
+        exit(1);
+    }
+    memcpy(&header, data + 1, sizeof(header));
+    handoffPid = header.pid;
+    serverStart = header.start;
+    in = fd[0];
+    inKeepalive = fd[1];
+    inDiscard = header.discard;
+    count = 2;
+    listenWatch.fd = header.listen ? fd[count++] : -1;
+    clusterWatch.fd = header.cluster ? fd[count++] : -1;
+}
+
+/**
+ * @brief Receive connections and logged users from previous server process
+ *
+ * Called at the end of server_init() of restarted server - users get outboxes for received descriptors and they are not told about anything.
+ */
+void handoff_finish(){
+    char * data = malloc(INPUT_BUFFER_SIZE + ARENA_CHUNK);
+    int fd[4], count, users = 0;
+    size_t n;
+    while((n = handoff_receive(data, INPUT_BUFFER_SIZE + ARENA_CHUNK, fd, &count)) > 0 && data[0] != 'E'){
+        char * p = data + 1;
+        size_t length = n - 1;
+        if(data[0] == 'I' && inLength + length < INPUT_BUFFER_SIZE){
+            memcpy(inBuffer + inLength, p, length);
+            inLength += length;
+        }
+        else if(data[0] == 'C' && count == 1)
+            connection_new(fd[0]);
+        else if(data[0] == 'U' && count >= 1 && length > sizeof(handoff_user_t)){
+            handoff_user_t state;
+            memcpy(&state, p, sizeof(state));
+            //user without slot is dropped before anything refers to it
+            if(!users_reserve()){
+                for(int i=0; i<count; i++)
+                    close(fd[i]);
+                continue;
+            }
+            user_t * user = user_new(p + sizeof(state), length - sizeof(state));
+            user->binary = state.binary;
+            user->connection = state.connection && count == 2 ? connection_new(fd[1]) : NULL;
+            if(!user->connection && count == 2)
+                close(fd[1]);
+            user->outbox = outbox_new(user->username, fd[0], user->connection != NULL);
+            user_attach(user);
+            if(state.watcher)
+                presence_subscribe(user, 1);
+            users++;
+        }
+        else if(data[0] == 'G' && memchr(p, '\0', length)){
+            user_t * user = user_find(p);
+            size_t nameLength = strlen(p);
+            char * name = p + nameLength + 1;
+            if(user){
+                group_t * group = group_find(name, length - nameLength - 1);
+                if(!group)
+                    group = group_create(name, length - nameLength - 1);
+                group_join(group, user);
+            }
+        }
+        else{
+            for(int i=0; i<count; i++)
+                close(fd[i]);
+        }
+    }
+    free(data);
+
+    //process which sent the state exits now
+    waitpid(handoffPid, NULL, 0);
+    close(handoffFd);
+    handoffFd = -1;
+    console("Server restarted, %d users are still logged in\n", users);
+}
+
+/**
+ * @brief Terminate server when SIGTERM or SIGINT is received, restart it when SIGUSR2 is received
+ * @param watch - Watch of signalfd
+ * @param events - Epoll events
+ */
+void server_signal(watch_t * watch, uint32_t events){
+    (void)events;
+    struct signalfd_siginfo info;
+    if(read(watch->fd, &info, sizeof(info)) != sizeof(info))
+        return;
+    if(info.ssi_signo == SIGUSR2)
+        server_restart();
+    else
+        server_quit();
+}
+
+/**
+ *
+ * @brief Initialize server
+ *
+ * Set terminate behaviour - SIGTERM is blocked and received through signalfd, so server_quit() runs from the event loop - for clean environment.<br/>
+ * Create and open named pipe for server requests in non-blocking mode. Server keeps also its write end opened, otherwise epoll reports hang up every time when the last client closes the pipe.<br/>
+ * Load registered users from login file and watch it for new registrations - see credentials_init().<br/>
+ * Load messages stored for offline users - see offline_load().<br/>
+ * Load conversations of messages with receipt when users are handed over - see receipt_load().<br/>
+ * Load history of messages and build its indexes - see history_load().<br/>
+ * Start periodic writing of statistics - see stats_format().<br/>
+ * Start delivery threads - see worker_run() - and authentication threads - see auth_run().<br/>
+ * Start listening for clients connected by unix domain socket - see connection_init().<br/>
+ * Join cluster if node id is given - see cluster_init().<br/>
+ * Restarted server takes over descriptors and users of previous process instead of creating them - see server_restart().<br/>
+ * Prepare memory for logged users.
+ *
+ */
+void server_init(){
+    
+    //signal for quit when q is pressed in the another process is handled in server_run()
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signalWatch.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signalWatch.handler = server_signal;
+
+    //client which closes its named pipe must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    //restarted server gets named pipe and listening sockets from previous process
+    if(handoffFd >= 0)
+        handoff_begin();
+    else{
+        //create named pipe for server input
+        mkfifo(inPipe,0666);
+
+        //open named pipe for input - read end must be opened first, otherwise non-blocking open for writing fails
+        in = open(inPipe, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        inKeepalive = open(inPipe, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    inWatch.fd = in;
+    inWatch.handler = server_read_input;
+    if(in<0 || inKeepalive<0 || signalWatch.fd<0){
+        perror("server_init");
+        server_quit();
+    }
+
+    //wait for signals, server input is added after state of previous server is received
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &signalWatch;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalWatch.fd, &ev);
+    
+    //every logged user has opened named pipe - allow as many descriptors as possible
+    struct rlimit limit;
+    if(!getrlimit(RLIMIT_NOFILE, &limit)){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    //load registered users
+    credentials_init();
+
+    //load messages for offline users
+    offline_load();
+
+    //load history and build its indexes
+    history_load();
+
+    //messages waiting for time of delivery
+    delayed_load();
+
+    //write statistics periodically
+    stats_init();
+
+    //clients can connect also by socket
+    connection_init();
+
+    //large messages are reported by delivery threads
+    transfer_init();
+
+    //logins are authenticated by their own threads
+    auth_init();
+
+    //links to other nodes of cluster
+    cluster_init();
+
+    //start delivery threads
+    int count = workerOption > 0 ? workerOption : sysconf(_SC_NPROCESSORS_ONLN);
+    workers_start(count < 1 ? 1 : count > MAX_WORKERS ? MAX_WORKERS : count);
+
+    //prepare memory for logged users
+    usersCapacity = SERVER_CAPACITY;
+    users_logged = calloc(usersCapacity, sizeof(user_t *));
+    freeSlots = malloc(usersCapacity * sizeof(int));
+
+    //users logged in before restart
+    if(handoffFd >= 0)
+        handoff_finish();
+
+    //conversations of messages with receipt - unacknowledged messages are kept for users logged in before restart
+    receipt_load();
+
+    //read requests
+    input_start();
+}
+
+/**
+ *
+ * @brief Process all requests in input
+ * 
+ * Requests for server are written to named pipe "serverin" one per line. Server waits in epoll_wait() until there are new data in pipe or signal for quit,
+ * so it does not use CPU when there is nothing to do. All complete requests which were read are processed before waiting again.
+ * Queries are processed by server_parse_input(). Messages produced by all requests in one iteration are written at the end of iteration by server_flush(),
+ * so more messages for the same user are written by one system call. Frames for other nodes of cluster are written in the same way by cluster_flush(). Messages for offline users and delayed messages are synced to disk before by offline_commit() and delayed_commit().
+ */
+void server_run(){
+    struct epoll_event events[MAX_EVENTS];
+    while(1){
+        //waiting requests are processed without sleeping, new input is read between rounds
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, scheduleHead ? 0 : -1);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            server_quit();
+        }
+
+        //new requests, signals and client pipes which are writable again
+        for(int i=0; i<n; i++){
+            watch_t * watch = events[i].data.ptr;
+            watch->handler(watch, events[i].events);
+        }
+        schedule_run();
+
+        //store messages for offline users and delayed messages, deliver all queued messages, then index and store history off the delivery path
+        offline_commit();
+        delayed_commit();
+        server_flush();
+        cluster_flush();
+        history_commit();
+
+        //restart waited for large messages
+        if(restartPending && !uploads.count)
+            server_restart();
+    }
+}
+
+/**
+ * @brief Load usernames of all registered users
+ * @param fd - Opened login file
+ * @param names - Map for usernames, keys point to the returned buffer
+ * @return Content of login file - it must be freed when the map is not needed anymore
+ */
+char * registered_load(int fd, strmap_t * names){
+    struct stat st;
+    fstat(fd, &st);
+    char * data = malloc(st.st_size + 1);
+    ssize_t n = pread(fd, data, st.st_size, 0);
+    if(n < 0)
+        n = 0;
+    data[n] = '\0';
+
+    //odd lines are usernames
+    char * line = data;
+    char * end = data + n;
+    while(line < end){
+        char * nameEnd = memchr(line, '\n', end - line);
+        if(!nameEnd)
+            break;
+        nameEnd[0] = '\0';
+        strmap_put(names, line, line);
+        char * passwordEnd = memchr(nameEnd + 1, '\n', end - nameEnd - 1);
+        if(!passwordEnd)
+            break;
+        line = passwordEnd + 1;
+    }
+    return data;
+}
+
+/**
+ * @brief Register new users
+ * @param names - Usernames
+ * @param passwords - Passwords
+ * @param count - Number of users
+ * @return Number of registered users, -1 if login file can not be written
+ *
+ * Login file is locked by flock() for the whole registration, so more registrations can run at the same time, also while the server is running.
+ * Already registered usernames are found in a map of all registered users - they are skipped. All new users are appended by one write and synced to disk.
+ * Server reads only complete pairs of lines, so it never sees half written registration.
+ */
+int users_register(char ** names, char ** passwords, int count){
+    int fd = open(loginFile, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(fd < 0 || flock(fd, LOCK_EX)){
+        perror(loginFile);
+        return -1;
+    }
+
+    //all registered usernames - also users added in this call are inserted
+    strmap_t registered = {0};
+    char * data = registered_load(fd, &registered);
+
+    size_t length = 0;
+    for(int i=0; i<count; i++)
+        length += strlen(names[i]) + strlen(passwords[i]) + 2;
+    char * output = malloc(length + 1);
+
+    //prepare lines for new users
+    char * pos = output;
+    int added = 0;
+    for(int i=0; i<count; i++){
+        if(strmap_get(&registered, names[i])){
+            printf("Username %s already exists !!!!\n", names[i]);
+            continue;
+        }
+        strmap_put(&registered, names[i], names[i]);
+        pos += sprintf(pos, "%s\n%s\n", names[i], passwords[i]);
+        added++;
+    }
+
+    //append everything at once
+    int result = added;
+    for(char * p = output; p < pos; ){
+        ssize_t n = write(fd, p, pos - p);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0){
+            perror(loginFile);
+            result = -1;
+            break;
+        }
+        p += n;
+    }
+    if(result >= 0 && fsync(fd)){
+        perror(loginFile);
+        result = -1;
+    }
+
+    //closing also unlocks the file
+    close(fd);
+    strmap_clear(&registered);
+    free(data);
+    free(output);
+    return result;
+}
+
+/**
+ * @brief Register users from file
+ * @param input - File with one user per line - username and password separated by whitespace
+ * @return Number of registered users, -1 on error
+ *
+ * Whole input is read at first, invalid lines are reported and skipped. Then all users are registered by one call of users_register().
+ */
+int users_import(FILE * input){
+    int count = 0, capacity = 1024, lineNumber = 0;
+    char ** names = malloc(capacity * sizeof(char *));
+    char ** passwords = malloc(capacity * sizeof(char *));
+    char line[BUFFER_SIZE];
+
+    while(fgets(line, BUFFER_SIZE, input)){
+        lineNumber++;
+        char * name = strtok(line, " \t\r\n");
+        char * password = strtok(NULL, " \t\r\n");
+        //skip empty lines
+        if(!name)
+            continue;
+        if(!password || strtok(NULL, " \t\r\n") || !is_alphanumeric(name) || !is_alphanumeric(password)){
+            printf("Line %d is not valid - expected alphanumeric username and password\n", lineNumber);
+            continue;
+        }
+        if(count == capacity){
+            capacity *= 2;
+            names = realloc(names, capacity * sizeof(char *));
+            passwords = realloc(passwords, capacity * sizeof(char *));
+        }
+        names[count] = strdup(name);
+        passwords[count] = strdup(password);
+        count++;
+    }
+
+    int added = users_register(names, passwords, count);
+    if(added >= 0)
+        printf("Registered %d of %d users\n", added, count);
+
+    for(int i=0; i<count; i++){
+        free(names[i]);
+        free(passwords[i]);
+    }
+    free(names);
+    free(passwords);
+    return added;
+}
+
+/**
+ *
+ * @brief Main function
+ *
+ * Server has 3 modes:
+ * 1. <b>Registration mode</b><br/>
+ * <pre>./server adduser username</pre>
+ * Second argument is considered as username for register. At first server check if the username isn't already registered. If no, server asks for password 2 times using getpassword(). If passwords are equal server writes username and password to login file by users_register() - each per line. So all odd lines contain usernames and even lines contain passwords - numbering from 1
+ *
+ * 2. <b>Batch registration mode</b><br/>
+ * <pre>./server adduser --batch [file]</pre>
+ * Users are read from file (or standard input if file is not given or it is "-"), one user per line - username and password separated by space. See users_import().
+ * 
+ * 3. <b>Normal mode</b><br/>
+ * <pre>./server [-q] [-e] [-w delivery_threads] [-r retention_days] [-k history_days] [-i stats_interval] [-m messages_per_sec] [-b bytes_per_sec] [-a auth_threads] [-c cluster_file -n node_id]</pre>
+ * Option -q turns off printing of single requests to console.
+ * Option -e uses only epoll even if io_uring is available.
+ * Option -w sets number of delivery threads (default is number of processors).
+ * Option -r sets number of days for which messages for offline users are kept (default 30).
+ * Option -k sets number of days for which history of messages is kept, 0 turns history off (default 90).
+ * Option -i sets number of seconds between writes of statistics file server.stats, 0 turns it off (default 10).
+ * Options -m and -b set number of messages and bytes which one user can send per second, 0 means no limit (default 100 and 1048576).
+ * Option -a sets number of threads checking credentials of logins, 0 checks them on server thread (default 2).
+ * Options -c and -n make server a node of cluster - cluster file has lines "id host port" of all nodes and node id (1 - 64) chooses the line of this server.
+ * At first server checks if there is no instance of server running. After server creates a file "server.lock" (used to prevent multiple instances of running servers) and server forks - parent process runs server_init() and server_run(), and the child process is console waiting for commands from commandline
+ */
+
+
+
+int main(int argc, char ** argv){
+
+    //if is given parameters for add users from file
+    if(argc>2 && !strcmp(argv[1],"adduser") && !strcmp(argv[2],"--batch")){
+        FILE * input = stdin;
+        if(argc>3 && strcmp(argv[3],"-"))
+            input = fopen(argv[3],"r");
+        if(!input){
+            perror(argv[3]);
+            return 1;
+        }
+        return users_import(input) < 0;
+    }
+
+    //if is given parameters for add user
+    if(argc>2 && !strcmp(argv[1],"adduser")){
+
+        //check for username in login file
+        FILE * login_file = fopen(loginFile,"r");
+        if(login_file){
+            //find given username in login file
+            char username[BUFFER_SIZE],password[BUFFER_SIZE];
+            while(fgets(username,BUFFER_SIZE,login_file)!=NULL){
+                fgets(password,BUFFER_SIZE,login_file);
+                username[strlen(username)-1]='\0';
+                password[strlen(password)-1]='\0';
+
+                //if we found suitable username and password credentials are OK
+                if(!strcmp(argv[2],username)){
+                    printf("Username already exists !!!!\n");
+                    fclose(login_file);
+                    return 0;
+                }
+            }
+            fclose(login_file);
+        }
+
+        char password[BUFFER_SIZE],password1[BUFFER_SIZE];
+
+        //ask for password
+        getpassword("Password: ",password);
+        //ask for password again
+        getpassword("Retype password: ",password1);
+        
+        //if passwords are same
+        if(!strcmp(password,password1)){
+            //add username and password to login file
+            char * name = argv[2];
+            char * pass = password;
+            users_register(&name, &pass, 1);
+        }
+        //passwords are not same
+        else
+            printf("Passwords are different!!!\n");
+
+        //exiting
+        return 0;
+    }
+
+    //options of normal mode
+    int option;
+    while((option = getopt(argc, argv, "w:r:k:i:m:b:a:c:n:qe")) != -1){
+        if(option == 'w')
+            workerOption = atoi(optarg);
+        else if(option == 'r')
+            offlineRetention = atoi(optarg);
+        else if(option == 'k')
+            historyRetention = atoi(optarg);
+        else if(option == 'i')
+            statsInterval = atoi(optarg);
+        else if(option == 'm')
+            rateMessages = atof(optarg);
+        else if(option == 'b')
+            rateBytes = atof(optarg);
+        else if(option == 'a')
+            authOption = atoi(optarg);
+        else if(option == 'c')
+            clusterFile = optarg;
+        else if(option == 'n')
+            nodeId = atoi(optarg);
+        else if(option == 'q')
+            consoleLog = 0;
+        else if(option == 'e')
+            uringOption = 0;
+        else{
+            printf("Usage: ./server [-q] [-e] [-w delivery_threads] [-r retention_days] [-k history_days] [-i stats_interval] [-m messages_per_sec] [-b bytes_per_sec] [-a auth_threads] [-c cluster_file -n node_id]\n       ./server adduser username\n       ./server adduser --batch [file]\n");
+            return 1;
+        }
+    }
+    //node of cluster needs both options
+    if((clusterFile != NULL) != (nodeId != 0) || nodeId < 0 || nodeId > MAX_NODES){
+        printf("Options -c cluster_file and -n node_id (1 - %d) must be given together\n", MAX_NODES);
+        return 1;
+    }
+
+    //restarted server takes over everything from previous process - it keeps server.lock and console
+    serverArgv = argv;
+    char * handoff = getenv("SERVER_HANDOFF");
+    if(handoff){
+        handoffFd = atoi(handoff);
+        unsetenv("SERVER_HANDOFF");
+        fcntl(handoffFd, F_SETFD, FD_CLOEXEC);
+        server_init();
+        server_run();
+    }
+
+    //check for running server
+    FILE * f = fopen(serverLock,"r");
+    if(f){
+        printf("Another instance of server is running !!!\n");
+        fclose(f);
+        return 0;
+    }
+
+    //create server.lock
+    f = fopen(serverLock,"w");
+    fclose(f);
+
+
+
+    //print message to server console
+    printf("To quit press q and then enter.\n");
+    printf("To restart server with new binary without logging out users press r and then enter.\n");
+
+    //create child process for console
+    int pid = fork();
+    if(pid < 0){
+        perror("fork");
+        return 1;
+    }
+    
+    if(pid > (pid_t)0){
+        //parent process
+        server_init();
+        server_run();
+    }
+    else{
+        //child process - console
+        //without console (end of input) server runs until it gets SIGTERM or SIGINT
+        char c;
+        while(scanf("%c",&c) == 1){
+            //if q is pressed terminate parent process - processing queries
+            if(c=='q'){
+                printf("Are you sure you want to end the server?\n");
+                printf("Please confirm (y/n): ");
+                if(scanf(" %c",&c) != 1)
+                    break;
+                if(c=='y'){
+                    kill(getppid(),SIGTERM);
+                    exit(0);
+                }
+            }
+            //restarted server keeps pid of this one, so console works with it too
+            else if(c=='r')
+                kill(getppid(),SIGUSR2);
+        }
+    }
+    //exit
+    return 0;
+
+}